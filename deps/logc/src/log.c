@@ -22,6 +22,15 @@
 
 #include "log.h"
 
+#ifdef LOG_USE_ASYNC
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <wchar.h>
+#endif
+
 #define MAX_CALLBACKS 32
 
 typedef struct {
@@ -128,6 +137,462 @@ int log_add_fp(FILE *fp, int level) {
 }
 
 
+#ifdef LOG_USE_ASYNC
+/* The async sink hands messages to a background thread through a bounded
+ * lock-free ring. Rather than formatting on the calling thread, log_log copies
+ * the raw printf arguments into a slot (strings by value, as they may not
+ * outlive the call) and the drain thread formats and writes them. A message
+ * which finds the ring full is dropped and counted instead of waiting. */
+
+#define ASYNC_MAX_ARGS 12
+#define ASYNC_TEXT_LEN 128
+
+enum { ARG_INT, ARG_UINT, ARG_DOUBLE, ARG_PTR, ARG_STR, ARG_CHAR, ARG_WCHAR };
+
+typedef struct {
+  int kind;
+  union {
+    long long i;
+    unsigned long long u;
+    double d;
+    const void *p;
+    size_t str; /* offset of the copied string in the slot's text */
+  } v;
+} AsyncArg;
+
+typedef struct {
+  atomic_size_t seq;
+  time_t time;
+  const char *fmt;
+  const char *file;
+  int line;
+  int level;
+  int nargs;
+  bool truncated; /* more arguments than fit, the rest of fmt is dropped */
+  AsyncArg args[ASYNC_MAX_ARGS];
+  char text[ASYNC_TEXT_LEN];
+} AsyncSlot;
+
+static struct {
+  atomic_bool enabled;
+  atomic_int writers; /* log_log calls which may be pushing into the ring */
+  int level;
+  FILE *fp;
+  AsyncSlot *slots;
+  size_t mask;
+  atomic_size_t head; /* next slot for a writer to claim */
+  size_t tail;        /* next slot to drain, only touched by the drain thread */
+  atomic_bool running;
+  atomic_ulong dropped;
+  thrd_t thread;
+} A;
+
+/* One printf conversion: the text of its flags, width and precision, whether
+ * the width or precision are taken from arguments, and its conversion. */
+typedef struct {
+  const char *flags;
+  int flags_len;
+  const char *width;
+  int width_len;
+  const char *prec;
+  int prec_len;
+  bool star_width;
+  bool star_prec;
+  int longs;  /* number of 'l' length modifiers */
+  int shorts; /* number of 'h' length modifiers */
+  char size;  /* 'z', 'j', 't', 'L' or 0 */
+  char conv;
+} Spec;
+
+
+/* Parse the conversion starting just after a '%', returning the character
+ * after it. */
+static const char *parse_spec(const char *p, Spec *spec) {
+  memset(spec, 0, sizeof(*spec));
+
+  spec->flags = p;
+  while (*p && strchr("-+ #0", *p)) { p++; }
+  spec->flags_len = (int)(p - spec->flags);
+
+  spec->width = p;
+  if (*p == '*') { spec->star_width = true; p++; }
+  while (*p >= '0' && *p <= '9') { p++; }
+  spec->width_len = (int)(p - spec->width);
+
+  if (*p == '.') {
+    p++;
+    spec->prec = p;
+    if (*p == '*') { spec->star_prec = true; p++; }
+    while (*p >= '0' && *p <= '9') { p++; }
+    spec->prec_len = (int)(p - spec->prec);
+  }
+
+  while (*p && strchr("hlzjtL", *p)) {
+    if (*p == 'l') { spec->longs++; }
+    else if (*p == 'h') { spec->shorts++; }
+    else { spec->size = *p; }
+    p++;
+  }
+
+  spec->conv = *p;
+  return *p ? p + 1 : p;
+}
+
+
+static bool add_arg(AsyncSlot *slot, int kind) {
+  if (slot->nargs == ASYNC_MAX_ARGS) {
+    slot->truncated = true;
+    return false;
+  }
+  slot->args[slot->nargs].kind = kind;
+  return true;
+}
+
+
+/* Copy the arguments of fmt out of ap into the slot without formatting them. */
+static void capture_args(AsyncSlot *slot, const char *fmt, va_list ap) {
+  size_t text_len = 0;
+  const char *p = fmt;
+
+  while (!slot->truncated && (p = strchr(p, '%'))) {
+    Spec spec;
+    p = parse_spec(p + 1, &spec);
+
+    if (spec.star_width && add_arg(slot, ARG_INT)) {
+      slot->args[slot->nargs++].v.i = va_arg(ap, int);
+    }
+    if (spec.star_prec && add_arg(slot, ARG_INT)) {
+      slot->args[slot->nargs++].v.i = va_arg(ap, int);
+    }
+
+    switch (spec.conv) {
+      case 'd': case 'i':
+        if (!add_arg(slot, ARG_INT)) { break; }
+        if (spec.longs >= 2) { slot->args[slot->nargs].v.i = va_arg(ap, long long); }
+        else if (spec.longs == 1) { slot->args[slot->nargs].v.i = va_arg(ap, long); }
+        else if (spec.size == 'z') {
+          // the signed type matching size_t has no name, so read it as size_t and restore the sign
+          size_t raw = va_arg(ap, size_t);
+          slot->args[slot->nargs].v.i = (raw > SIZE_MAX / 2) ? -(long long)(SIZE_MAX - raw) - 1 : (long long)raw;
+        }
+        else if (spec.size == 't') { slot->args[slot->nargs].v.i = va_arg(ap, ptrdiff_t); }
+        else if (spec.size == 'j') { slot->args[slot->nargs].v.i = va_arg(ap, intmax_t); }
+        else if (spec.shorts >= 2) { slot->args[slot->nargs].v.i = (signed char)va_arg(ap, int); }
+        else if (spec.shorts == 1) { slot->args[slot->nargs].v.i = (short)va_arg(ap, int); }
+        else { slot->args[slot->nargs].v.i = va_arg(ap, int); }
+        slot->nargs++;
+        break;
+
+      case 'u': case 'o': case 'x': case 'X':
+        if (!add_arg(slot, ARG_UINT)) { break; }
+        if (spec.longs >= 2) { slot->args[slot->nargs].v.u = va_arg(ap, unsigned long long); }
+        else if (spec.longs == 1) { slot->args[slot->nargs].v.u = va_arg(ap, unsigned long); }
+        else if (spec.size == 'z') { slot->args[slot->nargs].v.u = va_arg(ap, size_t); }
+        else if (spec.size == 't') { slot->args[slot->nargs].v.u = (size_t)va_arg(ap, ptrdiff_t); }
+        else if (spec.size == 'j') { slot->args[slot->nargs].v.u = va_arg(ap, uintmax_t); }
+        else if (spec.shorts >= 2) { slot->args[slot->nargs].v.u = (unsigned char)va_arg(ap, unsigned int); }
+        else if (spec.shorts == 1) { slot->args[slot->nargs].v.u = (unsigned short)va_arg(ap, unsigned int); }
+        else { slot->args[slot->nargs].v.u = va_arg(ap, unsigned int); }
+        slot->nargs++;
+        break;
+
+      // a char is passed promoted to int, and printed as the unsigned char it converts to
+      case 'c':
+        if (spec.longs) {
+          if (!add_arg(slot, ARG_WCHAR)) { break; }
+          slot->args[slot->nargs++].v.u = va_arg(ap, wint_t);
+        } else {
+          if (!add_arg(slot, ARG_CHAR)) { break; }
+          slot->args[slot->nargs++].v.u = (unsigned char)va_arg(ap, int);
+        }
+        break;
+
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        if (!add_arg(slot, ARG_DOUBLE)) { break; }
+        if (spec.size == 'L') { slot->args[slot->nargs].v.d = (double)va_arg(ap, long double); }
+        else { slot->args[slot->nargs].v.d = va_arg(ap, double); }
+        slot->nargs++;
+        break;
+
+      case 'p':
+        if (!add_arg(slot, ARG_PTR)) { break; }
+        slot->args[slot->nargs++].v.p = va_arg(ap, void*);
+        break;
+
+      case 's': {
+        if (!add_arg(slot, ARG_STR)) { break; }
+        const char *str = va_arg(ap, const char*);
+        if (!str) { str = "(null)"; }
+        size_t len = strlen(str);
+        size_t room = ASYNC_TEXT_LEN - text_len - 1;
+        if (len > room) { len = room; }
+        memcpy(&slot->text[text_len], str, len);
+        slot->text[text_len + len] = '\0';
+        slot->args[slot->nargs++].v.str = text_len;
+        // once the text is full, later strings share its final terminator
+        text_len += len;
+        if (text_len < ASYNC_TEXT_LEN - 1) { text_len++; }
+        break;
+      }
+
+      case 'n':
+        (void)va_arg(ap, void*);
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+
+/* Format a drained slot the way file_callback would have. */
+static void write_slot(FILE *fp, AsyncSlot *slot) {
+  char buf[64];
+  buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&slot->time))] = '\0';
+  fprintf(fp, "%s %-5s %s:%d: ", buf, level_strings[slot->level], slot->file, slot->line);
+
+  int arg = 0;
+  const char *p = slot->fmt;
+
+  for (;;) {
+    const char *percent = strchr(p, '%');
+    if (!percent) {
+      fputs(p, fp);
+      break;
+    }
+    fwrite(p, 1, (size_t)(percent - p), fp);
+
+    Spec spec;
+    p = parse_spec(percent + 1, &spec);
+
+    if (spec.conv == '%') {
+      fputc('%', fp);
+      continue;
+    }
+    if (spec.conv == 'n') {
+      continue;
+    }
+
+    // rebuild the conversion with any '*' replaced by its value, and the
+    // length modifier matching how the argument was stored
+    char conv[64];
+    int len = snprintf(conv, sizeof(conv), "%%%.*s", spec.flags_len, spec.flags);
+    if (spec.star_width) {
+      if (arg >= slot->nargs) { break; }
+      len += snprintf(conv + len, sizeof(conv) - len, "%lld", slot->args[arg++].v.i);
+    } else {
+      len += snprintf(conv + len, sizeof(conv) - len, "%.*s", spec.width_len, spec.width);
+    }
+    if (spec.prec) {
+      if (spec.star_prec) {
+        if (arg >= slot->nargs) { break; }
+        len += snprintf(conv + len, sizeof(conv) - len, ".%lld", slot->args[arg++].v.i);
+      } else {
+        len += snprintf(conv + len, sizeof(conv) - len, ".%.*s", spec.prec_len, spec.prec);
+      }
+    }
+
+    if (arg >= slot->nargs) { break; }
+    AsyncArg *a = &slot->args[arg++];
+
+    switch (a->kind) {
+      case ARG_INT:
+        snprintf(conv + len, sizeof(conv) - len, "ll%c", spec.conv);
+        fprintf(fp, conv, a->v.i);
+        break;
+      case ARG_CHAR:
+        snprintf(conv + len, sizeof(conv) - len, "c");
+        fprintf(fp, conv, (int)a->v.u);
+        break;
+      case ARG_WCHAR:
+        snprintf(conv + len, sizeof(conv) - len, "lc");
+        fprintf(fp, conv, (wint_t)a->v.u);
+        break;
+      case ARG_UINT:
+        snprintf(conv + len, sizeof(conv) - len, "ll%c", spec.conv);
+        fprintf(fp, conv, a->v.u);
+        break;
+      case ARG_DOUBLE:
+        snprintf(conv + len, sizeof(conv) - len, "%c", spec.conv);
+        fprintf(fp, conv, a->v.d);
+        break;
+      case ARG_PTR:
+        snprintf(conv + len, sizeof(conv) - len, "p");
+        fprintf(fp, conv, a->v.p);
+        break;
+      case ARG_STR:
+        snprintf(conv + len, sizeof(conv) - len, "s");
+        fprintf(fp, conv, &slot->text[a->v.str]);
+        break;
+    }
+  }
+
+  if (slot->truncated) {
+    fputs(" ...", fp);
+  }
+  fputc('\n', fp);
+}
+
+
+/* Claim a slot and fill it, or drop the message if the ring is full. Each slot's
+ * sequence number says whose turn it is: a writer may claim it when it equals
+ * the write position, and the drain thread may read it when it is one past. */
+static void async_push(int level, const char *file, int line, const char *fmt, va_list ap) {
+  size_t pos = atomic_load_explicit(&A.head, memory_order_relaxed);
+  AsyncSlot *slot;
+
+  for (;;) {
+    slot = &A.slots[pos & A.mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&A.head, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      atomic_fetch_add_explicit(&A.dropped, 1, memory_order_relaxed);
+      return;
+    } else {
+      pos = atomic_load_explicit(&A.head, memory_order_relaxed);
+    }
+  }
+
+  slot->time = time(NULL);
+  slot->fmt = fmt;
+  slot->file = file;
+  slot->line = line;
+  slot->level = level;
+  slot->nargs = 0;
+  slot->truncated = false;
+  capture_args(slot, fmt, ap);
+
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+
+/* Write out every message in the ring, returning how many there were. */
+static size_t async_drain(void) {
+  size_t count = 0;
+
+  for (;;) {
+    AsyncSlot *slot = &A.slots[A.tail & A.mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if (seq != A.tail + 1) {
+      break;
+    }
+
+    write_slot(A.fp, slot);
+    atomic_store_explicit(&slot->seq, A.tail + A.mask + 1, memory_order_release);
+    A.tail++;
+    count++;
+  }
+
+  if (count) {
+    fflush(A.fp);
+  }
+
+  return count;
+}
+
+
+static int async_thread(void *arg) {
+  (void)arg;
+  struct timespec nap = { 0, 1000000 };
+
+  while (atomic_load_explicit(&A.running, memory_order_acquire)) {
+    if (!async_drain()) {
+      thrd_sleep(&nap, NULL);
+    }
+  }
+
+  async_drain();
+  return 0;
+}
+
+
+int log_add_async(FILE *fp, int level, size_t capacity) {
+  if (atomic_load(&A.enabled) || !fp || capacity < 2) {
+    return -1;
+  }
+
+  // the ring is indexed with a mask, so round its size up to a power of two
+  size_t size = 2;
+  while (size < capacity) { size *= 2; }
+
+  A.slots = calloc(size, sizeof(AsyncSlot));
+  if (!A.slots) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&A.slots[i].seq, i);
+  }
+
+  A.mask = size - 1;
+  A.fp = fp;
+  A.level = level;
+  A.tail = 0;
+  atomic_init(&A.head, 0);
+  atomic_init(&A.dropped, 0);
+  atomic_init(&A.running, true);
+
+  if (thrd_create(&A.thread, async_thread, NULL) != thrd_success) {
+    free(A.slots);
+    A.slots = NULL;
+    return -1;
+  }
+
+  atomic_store(&A.enabled, true);
+  return 0;
+}
+
+
+/* A log_log call counts itself in A.writers before checking A.enabled, and this
+ * clears A.enabled before checking A.writers, so once the count drops to zero no
+ * call can still be pushing into the ring and it can be freed. */
+void log_stop_async(void) {
+  if (!atomic_load(&A.enabled)) {
+    return;
+  }
+
+  atomic_store(&A.enabled, false);
+  while (atomic_load(&A.writers) != 0) {
+    thrd_yield();
+  }
+
+  atomic_store_explicit(&A.running, false, memory_order_release);
+  thrd_join(A.thread, NULL);
+
+  free(A.slots);
+  A.slots = NULL;
+}
+
+
+unsigned long log_async_dropped(void) {
+  return atomic_load_explicit(&A.dropped, memory_order_relaxed);
+}
+#endif
+
+
+/* Whether any output wants a message at this level. Checked before taking the
+ * lock, so outputs should be set up before logging from several threads. */
+static bool level_wanted(int level) {
+  if (!L.quiet && level >= L.level) {
+    return true;
+  }
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    if (level >= L.callbacks[i].level) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
 static void init_event(log_Event *ev, void *udata) {
   if (!ev->time) {
     time_t t = time(NULL);
@@ -145,6 +610,23 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
     .level = level,
   };
 
+#ifdef LOG_USE_ASYNC
+  if (atomic_load_explicit(&A.enabled, memory_order_relaxed)) {
+    atomic_fetch_add(&A.writers, 1);
+    if (atomic_load(&A.enabled) && level >= A.level) {
+      va_list ap;
+      va_start(ap, fmt);
+      async_push(level, file, line, fmt, ap);
+      va_end(ap);
+    }
+    atomic_fetch_sub_explicit(&A.writers, 1, memory_order_release);
+  }
+#endif
+
+  if (!level_wanted(level)) {
+    return;
+  }
+
   lock();
 
   if (!L.quiet && level >= L.level) {
@@ -166,3 +648,137 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
 
   unlock();
 }
+
+
+#if defined(LOG_TEST) && defined(LOG_USE_ASYNC)
+#include <assert.h>
+
+#define TEST_THREADS 4
+#define TEST_MESSAGES 500
+
+static atomic_bool test_logging;
+
+static int test_producer(void *arg) {
+  int thread = (int)(intptr_t)arg;
+  for (int message = 0; message < TEST_MESSAGES; message++) {
+    log_info("thread %d message %d", thread, message);
+  }
+  return 0;
+}
+
+static int test_until_stopped(void *arg) {
+  (void)arg;
+  while (atomic_load(&test_logging)) {
+    log_info("racing %s %d", "stop", 1);
+  }
+  return 0;
+}
+
+/* Read back a log file, checking that no message was written twice. */
+static int test_count_lines(FILE *fp, bool seen[TEST_THREADS][TEST_MESSAGES]) {
+  char line[512];
+  int count = 0;
+  rewind(fp);
+  while (fgets(line, sizeof(line), fp)) {
+    const char *text = strstr(line, "thread ");
+    int thread, message;
+    assert(text && sscanf(text, "thread %d message %d", &thread, &message) == 2);
+    assert(thread >= 0 && thread < TEST_THREADS && message >= 0 && message < TEST_MESSAGES);
+    assert(!seen[thread][message]);
+    seen[thread][message] = true;
+    count++;
+  }
+  return count;
+}
+
+static void test_threads(size_t capacity) {
+  static bool seen[TEST_THREADS][TEST_MESSAGES];
+  memset(seen, 0, sizeof(seen));
+
+  FILE *fp = tmpfile();
+  assert(fp && log_add_async(fp, LOG_TRACE, capacity) == 0);
+  assert(log_add_async(fp, LOG_TRACE, capacity) == -1);
+
+  thrd_t threads[TEST_THREADS];
+  for (int i = 0; i < TEST_THREADS; i++) {
+    assert(thrd_create(&threads[i], test_producer, (void*)(intptr_t)i) == thrd_success);
+  }
+  for (int i = 0; i < TEST_THREADS; i++) {
+    thrd_join(threads[i], NULL);
+  }
+  log_stop_async();
+
+  // every message is either written once or counted as dropped
+  int written = test_count_lines(fp, seen);
+  assert(written + (int)log_async_dropped() == TEST_THREADS * TEST_MESSAGES);
+  if (capacity >= TEST_THREADS * TEST_MESSAGES) {
+    assert(log_async_dropped() == 0);
+  }
+  fclose(fp);
+}
+
+static void test_formats(void) {
+  FILE *fp = tmpfile();
+  assert(fp && log_add_async(fp, LOG_INFO, 16) == 0);
+
+  // below the sink's level, so never written
+  log_debug("not written");
+
+  const char *name = "rings";
+  size_t size = 12;
+  ptrdiff_t offset = -3;
+  short small = -2;
+  log_info("%c %lc %zd %zu %td %hd %hhu %5.2f %-6s| %*d %p %%",
+           'x', (wint_t)L'y', (size_t)-5, size, offset, small, 300, 1.25, name, 4, 7, (void*)fp);
+  log_stop_async();
+
+  char expected[256];
+  snprintf(expected, sizeof(expected), "%c %lc %zd %zu %td %hd %hhu %5.2f %-6s| %*d %p %%\n",
+           'x', (wint_t)L'y', (ptrdiff_t)-5, size, offset, small, 300, 1.25, name, 4, 7, (void*)fp);
+
+  char line[512];
+  rewind(fp);
+  assert(fgets(line, sizeof(line), fp));
+  assert(strstr(line, " INFO "));
+  assert(strlen(line) > strlen(expected));
+  assert(strcmp(line + strlen(line) - strlen(expected), expected) == 0);
+  assert(!fgets(line, sizeof(line), fp));
+  assert(log_async_dropped() == 0);
+  fclose(fp);
+}
+
+static void test_stop_while_logging(void) {
+  FILE *fp = tmpfile();
+  assert(fp && log_add_async(fp, LOG_TRACE, 64) == 0);
+
+  atomic_store(&test_logging, true);
+  thrd_t threads[TEST_THREADS];
+  for (int i = 0; i < TEST_THREADS; i++) {
+    assert(thrd_create(&threads[i], test_until_stopped, NULL) == thrd_success);
+  }
+
+  // stopping waits out calls still pushing into the ring before freeing it
+  struct timespec nap = { 0, 5000000 };
+  thrd_sleep(&nap, NULL);
+  log_stop_async();
+  thrd_sleep(&nap, NULL);
+
+  atomic_store(&test_logging, false);
+  for (int i = 0; i < TEST_THREADS; i++) {
+    thrd_join(threads[i], NULL);
+  }
+  fclose(fp);
+}
+
+int main(void) {
+  log_set_quiet(true);
+
+  test_threads(TEST_THREADS * TEST_MESSAGES);
+  test_threads(8);
+  test_formats();
+  test_stop_while_logging();
+
+  printf("All Tests Passed!\n");
+  return 0;
+}
+#endif
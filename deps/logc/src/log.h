@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <time.h>
 
 #define LOG_VERSION "0.1.0"
@@ -30,12 +31,44 @@ typedef void (*log_LockFn)(bool lock, void *udata);
 
 enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
+/* Calls below LOG_MIN_LEVEL are removed at compile time, arguments and all.
+ * Levels are numbered as above, from 0 for LOG_TRACE to 5 for LOG_FATAL. */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+#define LOG_STRIPPED(...) ((void)0)
+
+#if LOG_MIN_LEVEL <= 0
 #define log_trace(...) log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define log_trace(...) LOG_STRIPPED(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= 1
 #define log_debug(...) log_log(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define log_debug(...) LOG_STRIPPED(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= 2
 #define log_info(...)  log_log(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define log_info(...)  LOG_STRIPPED(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= 3
 #define log_warn(...)  log_log(LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define log_warn(...)  LOG_STRIPPED(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= 4
 #define log_error(...) log_log(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define log_error(...) LOG_STRIPPED(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= 5
 #define log_fatal(...) log_log(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define log_fatal(...) LOG_STRIPPED(__VA_ARGS__)
+#endif
 
 const char* log_level_string(int level);
 void log_set_lock(log_LockFn fn, void *udata);
@@ -46,4 +79,10 @@ int log_add_fp(FILE *fp, int level);
 
 void log_log(int level, const char *file, int line, const char *fmt, ...);
 
+#ifdef LOG_USE_ASYNC
+int log_add_async(FILE *fp, int level, size_t capacity);
+void log_stop_async(void);
+unsigned long log_async_dropped(void);
+#endif
+
 #endif
@@ -2,15 +2,44 @@
 #define __WFC_H__
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 
-#define WFC_TILE_NUM_CELLS 4
+// Patterns are WFC_N x WFC_N cells of WFC_CELL_NUM_BITS bits each. Both are
+// fixed at build time, by defining them before this header or on the command
+// line, so every tile routine is specialized to them. The default is 2x2 patterns
+// of 4 bit cells.
+#if !defined(WFC_N)
 #define WFC_N 2
-#define WFC_PATTERN_LEN (WFC_N * WFC_N)
+#endif
+#if !defined(WFC_CELL_NUM_BITS)
 #define WFC_CELL_NUM_BITS 4
+#endif
+
+#define WFC_PATTERN_LEN (WFC_N * WFC_N)
+#define WFC_TILE_NUM_CELLS WFC_PATTERN_LEN
 #define WFC_CELL_MASK ((1 << WFC_CELL_NUM_BITS) - 1)
 
+// bits used by a tile, and by one of its rows
+#define WFC_TILE_BITS (WFC_PATTERN_LEN * WFC_CELL_NUM_BITS)
+#define WFC_ROW_BITS (WFC_N * WFC_CELL_NUM_BITS)
+
+// pattern bitmaps are stored as 64 bit words. A model with at most 64 patterns uses a
+// single word, larger ones are padded to a multiple of the widest vector width so
+// bitmap kernels never need a scalar tail.
+#define WFC_BITMAP_WORD_BITS 64
+#define WFC_BITMAP_ALIGN_WORDS 4
+#define WFC_BITMAP_ALIGN_BYTES (WFC_BITMAP_ALIGN_WORDS * sizeof(uint64_t))
+
+// alignment of the arena given to WFC_StateInitInArena, one cache line
+#define WFC_ARENA_ALIGN 64
+
+// rng seed of a newly initialized state
+#define WFC_DEFAULT_SEED 7
+
 
 typedef uint8_t WFC_Value;
 
@@ -34,18 +63,58 @@ typedef enum WFC_ADJACENT_ENUM {
     WFC_NUM_ADJACENT,
 } WFC_ADJACENT_ENUM;
 
+/* The neighbours which constrain a pixel, valued by their number. With
+ * overlapping patterns, the part a diagonal neighbour overlaps is also covered by
+ * the cardinal neighbours between them, so an output decided under cardinal
+ * adjacency agrees diagonally as well. It has half the index and half the
+ * propagation work, at the cost of pruning less before each choice. Its
+ * directions are numbered 0 to 3 for up, right, down and left.
+ */
+typedef enum WFC_ADJACENCY_ENUM {
+    WFC_ADJACENCY_CARDINAL = 4,
+    WFC_ADJACENCY_ALL = WFC_NUM_ADJACENT,
+} WFC_ADJACENCY_ENUM;
+
 typedef struct WFC_Pos {
     int32_t x;
     int32_t y;
 } WFC_Pos;
 
+/* The grid edges a pixel lies on. A pixel's neighbours are at the same index
+ * offsets as every other pixel on the same edges, so offsets are kept per
+ * combination of edges rather than per pixel.
+ */
+typedef enum WFC_EDGE_ENUM {
+    WFC_EDGE_LEFT = 1,
+    WFC_EDGE_RIGHT = 2,
+    WFC_EDGE_TOP = 4,
+    WFC_EDGE_BOTTOM = 8,
+    WFC_NUM_EDGE_CLASSES = 16,
+} WFC_EDGE_ENUM;
+
+static_assert((WFC_N >= 2) && (WFC_N <= 8), "patterns must be 2x2 to 8x8");
+static_assert((WFC_CELL_NUM_BITS >= 1) && (WFC_CELL_NUM_BITS <= 8), "input cells are bytes");
+
+// a pattern packed into the narrowest integer that holds it, first cell in the highest bits
+#if WFC_TILE_BITS <= 16
 typedef uint16_t WFC_Tile;
-static_assert((sizeof(WFC_Tile) * 8) == (WFC_PATTERN_LEN * WFC_TILE_NUM_CELLS));
+#elif WFC_TILE_BITS <= 32
+typedef uint32_t WFC_Tile;
+#elif WFC_TILE_BITS <= 64
+typedef uint64_t WFC_Tile;
+#elif WFC_TILE_BITS <= 128
+__extension__ typedef unsigned __int128 WFC_Tile;
+#else
+#error "patterns of more than 128 bits are not supported"
+#endif
+
+/* number of patterns in a neighbouring cell that still support a pattern */
+typedef uint16_t WFC_Support;
 
 typedef struct WFC_Pattern {
     uint32_t index; /* index into the propagator's pattern array */
 	uint32_t count; /* number of times the pattern occurred in the input image */
-    WFC_Tile tile; /* 2x2 tile pattern */
+    WFC_Tile tile; /* WFC_N x WFC_N tile pattern */
 } WFC_Pattern;
 
 typedef struct WFC_Propagator {
@@ -53,33 +122,160 @@ typedef struct WFC_Propagator {
     uint32_t num_patterns;
     WFC_Pattern *patterns;
 
-    uint32_t bitmap_len;
-    uint8_t *index; /* Patterns x Adjacency x Pattern where the last dimension is a bitmap */
+    double *weight_log_weights; /* count * log(count) for each pattern */
+
+    uint32_t num_adjacent; /* directions in the index, a WFC_ADJACENCY_ENUM */
+    uint32_t bitmap_words; /* number of 64 bit words in each pattern bitmap */
+    uint64_t *index; /* Patterns x Adjacency x Pattern where the last dimension is a bitmap */
+
+    void *mapping; /* if not NULL, the arrays above point into this read-only file mapping */
+    size_t mapping_len;
 } WFC_Propagator;
 
-// NOTE used more like a stack than a queue
+typedef enum WFC_QUEUE_ORDER_ENUM {
+    // the pixel changed most recently is propagated first, following each chain
+    // of removals as far as it goes before the next
+    WFC_QUEUE_ORDER_LIFO,
+    // pixels are propagated in the order they changed, spreading out as a wavefront
+    WFC_QUEUE_ORDER_FIFO,
+} WFC_QUEUE_ORDER_ENUM;
+
+// ring of indices of pixels with removals waiting to be propagated. A pixel is
+// on the queue at most once, so the ring never holds more than one per pixel.
 typedef struct WFC_Queue {
-    WFC_Pos *items;
+    uint32_t *items;
+    uint32_t head; /* position of the oldest item in the ring */
     uint32_t num_items;
     uint32_t max_items;
+    WFC_QUEUE_ORDER_ENUM order;
 } WFC_Queue;
 
-typedef struct WFC_State {
-    WFC_Propagator propagator;
-    uint32_t step_num;
+// cached entropy terms for a pixel, updated as patterns are removed
+typedef struct WFC_CellEntropy {
+    uint32_t num_valid; /* number of patterns still valid for the pixel */
+    uint32_t sum_weights; /* sum of the counts of the valid patterns */
+    double sum_weight_log_weights; /* sum of count * log(count) of the valid patterns */
+    uint32_t tie_break; /* random value ordering pixels whose entropies are equal */
+    uint64_t key; /* entropy in fixed point above tie_break, the entropy heap's sort key */
+} WFC_CellEntropy;
+
+#define WFC_HEAP_NONE 0xFFFFFFFF
+
+// binary min-heap of undecided pixel indices keyed by their entropy
+typedef struct WFC_Heap {
+    uint32_t *items;
+    uint32_t *positions; /* position of each pixel in items, or WFC_HEAP_NONE */
+    uint32_t num_items;
+} WFC_Heap;
+
+// a pattern removed from a pixel, recorded so it can be restored when backtracking
+typedef struct WFC_TrailEntry {
+    uint32_t pixel_index;
+    uint32_t pattern;
+} WFC_TrailEntry;
+
+// a pattern chosen by WFC_Observe, and the trail length before the choice was made
+typedef struct WFC_Decision {
+    uint32_t trail_len;
+    uint32_t pixel_index;
+    uint32_t pattern;
+} WFC_Decision;
+
+typedef struct WFC_Backtrack {
+    bool enabled;
+
+    WFC_TrailEntry *trail;
+    uint32_t trail_len;
+    uint32_t max_trail_len;
+
+    WFC_Decision *decisions; /* stack of choices, one per pixel at most */
+    uint32_t num_decisions;
 
-    uint32_t rng;
+    uint32_t num_backtracks; /* number of choices undone so far */
+} WFC_Backtrack;
 
-    // TODO split some of these into structures
+#if defined(WFC_STATS)
+/* Counters describing what a run has done, kept when the library is built with
+ * WFC_STATS defined. Anything including this header must agree on WFC_STATS,
+ * as it changes the layout of WFC_State. The counters start at 0 when a state
+ * is initialized or a batch is reset.
+ */
+typedef struct WFC_Stats {
+    uint64_t steps;
+    uint64_t propagations; /* calls to WFC_Propagate */
+    uint64_t queue_pushes;
+    uint64_t queue_pops;
+    uint32_t queue_high_water; /* most pixels queued at once */
+    uint64_t bits_cleared; /* patterns removed from pixels */
+    uint64_t index_lookups; /* index bitmaps walked to update supports */
+    uint64_t contradictions; /* pixels left with no valid patterns */
+    uint64_t restarts; /* steps which returned WFC_RESULT_RESTART */
+
+    // time spent in each phase, in cycles where the CPU has a cycle counter and
+    // in nanoseconds otherwise
+    uint64_t observe_cycles;
+    uint64_t propagate_cycles;
+    uint64_t backtrack_cycles; /* undoing removals, not the propagation after */
+} WFC_Stats;
+#endif
+
+/* Everything derived from an input image. A model is never modified once created,
+ * so any number of states, on any threads, can share one. Each state holds a
+ * reference, and the model is freed when the last reference is released.
+ */
+typedef struct WFC_Model {
+    atomic_uint ref_count;
+
+    // the input is not available for a model loaded from a file
     uint32_t input_width;
     uint32_t input_height;
     uint8_t *input;
 
+    WFC_Propagator propagator;
+
+    WFC_Support *initial_supports; /* Pattern x Adjacency supports of a pixel with every pattern valid */
+    uint8_t *pattern_directions; /* for each pattern, a bit for each direction it allows any pattern in */
+    uint32_t *prefix_weights; /* sum of the counts of the patterns before each pattern, and of all of them */
+    WFC_CellEntropy initial_entropy; /* entropy terms of a pixel with every pattern valid */
+} WFC_Model;
+
+typedef struct WFC_State {
+    WFC_Model *model;
+    uint32_t step_num;
+
+    uint32_t seed; /* key of the counter-based random numbers the state draws */
+
+    bool periodic; /* if false, pixels on the edges have no neighbours across them */
+
+    // neighbour lookup, so propagation never divides or wraps coordinates
+    uint8_t *edge_classes; /* for each pixel, the WFC_EDGE_ENUM edges it lies on */
+    int32_t neighbour_deltas[WFC_NUM_EDGE_CLASSES][WFC_NUM_ADJACENT]; /* index offset to each neighbour */
+    uint8_t neighbour_directions[WFC_NUM_EDGE_CLASSES]; /* a bit for each direction with a neighbour */
+
     uint32_t output_width;
     uint32_t output_height;
-    uint8_t *output; /* Array of bitmaps indicating which tiles are valid for each output image pixel */
+    uint64_t *output; /* Array of bitmaps indicating which tiles are valid for each output image pixel */
+
+    // AC-4 propagation state
+    WFC_Support *supports; /* Pixel x Pattern x Adjacency support counts */
+    uint64_t *removed; /* Array of bitmaps of patterns removed from each pixel but not yet propagated */
+    uint64_t *queued; /* bitset with a bit per pixel, set while the pixel is on the queue */
+    uint8_t *queued_directions; /* for each queued pixel, the directions its removals reach */
+    uint64_t *live; /* bitmap of the patterns a removal took support from that a neighbour still allows */
 
     WFC_Queue queue;
+
+    // entropy selection state
+    WFC_CellEntropy *entropies; /* one entry per output pixel */
+    WFC_Heap heap;
+
+    WFC_Backtrack backtrack;
+
+#if defined(WFC_STATS)
+    WFC_Stats stats;
+#endif
+
+    void *memory; /* block holding the buffers above, or NULL if they are in a caller's arena */
 } WFC_State;
 
 WFC_RESULT_ENUM WFC_StateInit(WFC_State *state,
@@ -87,27 +283,315 @@ WFC_RESULT_ENUM WFC_StateInit(WFC_State *state,
                               uint32_t input_height,
                               const uint8_t *input,
                               uint32_t output_width,
-                              uint32_t output_height,
-                              uint8_t *output);
+                              uint32_t output_height);
 void WFC_StateDestroy(WFC_State *state);
 
-WFC_RESULT_ENUM WFC_FindPatterns(WFC_State *state);
-WFC_RESULT_ENUM WFC_IndexInit(WFC_State *state);
+// Hooks for every allocation the library makes. 'alloc' returns memory aligned
+// to 'align', a power of two, or NULL on failure.
+typedef struct WFC_Allocator {
+    void *(*alloc)(size_t size, size_t align, void *user);
+    void (*free)(void *ptr, void *user);
+    void *user;
+} WFC_Allocator;
+
+// Replace the allocator, or restore the default if NULL. This must not be
+// called while any model or state exists.
+void WFC_SetAllocator(const WFC_Allocator *allocator);
+
+// Name of the bitmap kernels in use: "avx512", "avx2", "sse2" or "scalar". The widest
+// the CPU supports are chosen the first time a model or state is built.
+const char *WFC_BitmapKernelsName(void);
+
+// Use the named bitmap kernels instead, failing if they were not built or this CPU cannot
+// run them. Every variant gives the same results, so this may be called while other
+// threads are solving, which switch over at their next propagation.
+WFC_RESULT_ENUM WFC_UseBitmapKernels(const char *name);
+
+// Build a model from an input image. The model starts with one reference,
+// owned by the caller.
+WFC_RESULT_ENUM WFC_ModelCreate(WFC_Model **model,
+                                uint32_t input_width,
+                                uint32_t input_height,
+                                const uint8_t *input);
+
+// Build a model whose pixels are constrained by the given neighbours only.
+// WFC_ModelCreate uses WFC_ADJACENCY_ALL.
+WFC_RESULT_ENUM WFC_ModelCreateWithAdjacency(WFC_Model **model,
+                                             uint32_t input_width,
+                                             uint32_t input_height,
+                                             const uint8_t *input,
+                                             WFC_ADJACENCY_ENUM adjacency);
+
+// Take or drop a reference to a model. These are safe to call from any thread.
+WFC_Model *WFC_ModelRetain(WFC_Model *model);
+void WFC_ModelRelease(WFC_Model *model);
+
+// Initialize a state which generates from a shared model. The state takes its
+// own reference, released by WFC_StateDestroy.
+WFC_RESULT_ENUM WFC_StateInitFromModel(WFC_State *state,
+                                       WFC_Model *model,
+                                       uint32_t output_width,
+                                       uint32_t output_height);
+
+// Number of bytes of per-run buffers a state with the given model and output
+// size needs. This is the arena size WFC_StateInitInArena requires. It is 0 if
+// the output is empty or too large to index, which WFC_StateInit* also reject.
+size_t WFC_StateSize(const WFC_Model *model, uint32_t output_width, uint32_t output_height);
+
+// Initialize a state whose buffers are all carved out of the caller's arena,
+// which must be WFC_ARENA_ALIGN aligned and at least WFC_StateSize bytes. The
+// arena must outlive the state, and is not freed by WFC_StateDestroy. Only
+// enabling backtracking allocates afterwards, for its trail.
+WFC_RESULT_ENUM WFC_StateInitInArena(WFC_State *state,
+                                     WFC_Model *model,
+                                     uint32_t output_width,
+                                     uint32_t output_height,
+                                     void *arena,
+                                     size_t arena_bytes);
+
+// Number of bytes held by a model, including a mapped propagator file
+size_t WFC_ModelSize(const WFC_Model *model);
+
+// version of the compiled propagator file format written by WFC_ModelSave
+#define WFC_FILE_VERSION 2
+
+// Write a model's propagator (patterns, weights and index) to a file which
+// WFC_ModelLoad can map back in without rebuilding it.
+WFC_RESULT_ENUM WFC_ModelSave(const WFC_Model *model, const char *path);
+
+// Create a model from a compiled propagator file. The file is mapped
+// read-only and used in place, so the model has no input image.
+WFC_RESULT_ENUM WFC_ModelLoad(WFC_Model **model, const char *path);
+WFC_RESULT_ENUM WFC_StateInitFromFile(WFC_State *state,
+                                      const char *path,
+                                      uint32_t output_width,
+                                      uint32_t output_height);
+
+WFC_RESULT_ENUM WFC_FindPatterns(WFC_Model *model);
+WFC_RESULT_ENUM WFC_IndexInit(WFC_Model *model);
 WFC_Pos WFC_OffsetFrom(WFC_Pos pos, WFC_Pos offset, uint32_t width, uint32_t height);
 
 void WFC_PrintState(WFC_State *state);
 
+// Reseed a state before its first step.
+WFC_RESULT_ENUM WFC_StateSetSeed(WFC_State *state, uint32_t seed);
+
+// Counter-based random numbers. Each (seed, stream, counter) gives an unrelated
+// value with no state in between, so values can be drawn in any order, or in
+// parallel, and always come out the same. A state draws its tie breaks from
+// the stream of each pixel at counter WFC_RANDOM_TIE_BREAK, and its choice
+// for step n from the stream of the observed pixel at counter n.
+#define WFC_RANDOM_TIE_BREAK 0xFFFFFFFF
+uint32_t WFC_Random(uint32_t seed, uint32_t stream, uint32_t counter);
+
+// Choose whether the output wraps around at its edges, before the first step.
+// Outputs are periodic by default.
+WFC_RESULT_ENUM WFC_StateSetPeriodic(WFC_State *state, bool periodic);
+
+// Choose the order pixels are taken off the propagation queue. The order
+// changes which outputs a seed gives, but not whether they are valid. States
+// start with WFC_QUEUE_ORDER_LIFO. This can be called whenever nothing is
+// waiting to be propagated, which is true between steps.
+WFC_RESULT_ENUM WFC_StateSetQueueOrder(WFC_State *state, WFC_QUEUE_ORDER_ENUM order);
+
+// Remove every pattern but 'pattern' from a pixel and propagate the removals.
+// Returns WFC_RESULT_RESTART if this leaves a pixel with no valid patterns.
+WFC_RESULT_ENUM WFC_Constrain(WFC_State *state, WFC_Pos pos, uint32_t pattern);
+
 WFC_RESULT_ENUM WFC_Step(WFC_State *state);
 
-/*
+// Number of pixels which still have more than one valid pattern. These are the
+// pixels on the entropy heap, so this takes constant time, and a state with none
+// left is finished.
+uint32_t WFC_StateRemaining(const WFC_State *state);
 
+// The two halves of a step: collapse the lowest entropy pixel to one pattern,
+// then propagate the removals. WFC_Step is WFC_Observe followed by
+// WFC_Propagate if the observation returned WFC_RESULT_CONTINUE.
+WFC_RESULT_ENUM WFC_Observe(WFC_State *state, WFC_Pos *pos);
+WFC_RESULT_ENUM WFC_Propagate(WFC_State *state);
 
-// Create an output image of 4bit colors by copying the state->output bitmaps
-// into the output image.
-// TODO either average the tile color values, or return an error if there is
-// more then one possible color for a tile.
+// Enable backtracking for a state before its first step. When a step hits a
+// contradiction, the removals since the last choice are undone and the chosen
+// pattern is banned instead, so WFC_Step only returns WFC_RESULT_RESTART once
+// every choice has been exhausted.
+WFC_RESULT_ENUM WFC_EnableBacktracking(WFC_State *state);
+
+// Create an output image of WFC_CELL_NUM_BITS bit colors, one per byte, by copying
+// the state->output bitmaps into the output image. Returns an error if any pixel
+// has not been collapsed to a single pattern.
 WFC_RESULT_ENUM WFC_Output(WFC_State *state, uint8_t *output);
-*/
+
+// A state reused for many outputs from one model. Its buffers are reset between
+// outputs with a single copy from a template taken when the batch was created.
+typedef struct WFC_Batch {
+    WFC_State state;
+    void *template; /* the state's buffers as they were after initialization */
+    size_t template_bytes;
+} WFC_Batch;
+
+WFC_RESULT_ENUM WFC_BatchInit(WFC_Batch *batch, WFC_Model *model, uint32_t output_width, uint32_t output_height);
+void WFC_BatchDestroy(WFC_Batch *batch);
+
+// Reset the batch's state and reseed it, leaving it as WFC_StateInitFromModel
+// followed by WFC_StateSetSeed would. Backtracking stays enabled if it was.
+WFC_RESULT_ENUM WFC_BatchReset(WFC_Batch *batch, uint32_t seed);
+
+// attempts at each image of a batch before it is given up on
+#define WFC_BATCH_MAX_ATTEMPTS 16
+
+// Generate 'num_outputs' images of output_width x output_height pixels into
+// 'outputs', one after the other. Attempt k at image i is seeded with
+// WFC_RaceSeed(seed, i + k * num_outputs), and an image which hits a contradiction
+// is attempted again, up to WFC_BATCH_MAX_ATTEMPTS times.
+// If 'results' is not NULL it receives WFC_RESULT_FINISHED for each image that
+// was generated, or the result which stopped it, in which case the image is left
+// zeroed. Returns WFC_RESULT_RESTART if any image contradicted on every attempt,
+// or WFC_RESULT_ERROR, after which the remaining images are not generated.
+WFC_RESULT_ENUM WFC_GenerateBatch(WFC_Model *model,
+                                  uint32_t output_width,
+                                  uint32_t output_height,
+                                  uint32_t seed,
+                                  uint32_t num_outputs,
+                                  uint8_t *outputs,
+                                  WFC_RESULT_ENUM *results);
+
+// how WFC_Race picks a winner when several attempts finish
+typedef enum WFC_RACE_POLICY_ENUM {
+    // the first attempt to finish wins and cancels the rest. Fastest, but which
+    // attempt wins depends on thread timing.
+    WFC_RACE_POLICY_FIRST,
+    // the lowest numbered attempt which finishes wins. Only attempts numbered
+    // above a finished one are cancelled, so the result matches trying each
+    // seed in turn no matter how many threads are used.
+    WFC_RACE_POLICY_LOWEST,
+} WFC_RACE_POLICY_ENUM;
+
+typedef struct WFC_RaceOptions {
+    uint32_t num_attempts;
+    uint32_t num_threads;
+    uint32_t seed; /* attempt seeds are derived from this and the attempt number */
+    bool backtracking;
+    WFC_RACE_POLICY_ENUM policy;
+} WFC_RaceOptions;
+
+// Run several attempts from one model with different seeds on a pool of threads,
+// which share the model. The winning attempt's state is moved into 'winner', and
+// its number into 'winner_attempt' if not NULL. Returns WFC_RESULT_RESTART if
+// every attempt hit a contradiction.
+WFC_RESULT_ENUM WFC_Race(WFC_Model *model,
+                         uint32_t output_width,
+                         uint32_t output_height,
+                         const WFC_RaceOptions *options,
+                         WFC_State *winner,
+                         uint32_t *winner_attempt);
+
+// seed used by WFC_Race for an attempt
+uint32_t WFC_RaceSeed(uint32_t seed, uint32_t attempt);
+
+// a pixel with no pattern to match in WFC_ChunkSolve
+#define WFC_PATTERN_NONE 0xFFFFFFFF
+
+// Solve one chunk of a larger, non-wrapping world. 'top' holds the width + 1 + lookahead
+// patterns of the pixel row above the chunk, starting with the pixel above and to the
+// left, and 'left' the height + lookahead patterns of the column to its left. Either
+// can be NULL, and entries can be WFC_PATTERN_NONE, where there is no neighbouring
+// chunk. Chunks whose neighbours are done do not depend on each other, and can be
+// solved on different threads.
+//
+// 'lookahead' pixels past the chunk's right and bottom edges are solved as well, so
+// its last row and column have a way to continue. 'patterns' receives the
+// (width + lookahead) x (height + lookahead) patterns of the chunk and its lookahead,
+// row by row. Returns WFC_RESULT_RESTART if the chunk has no solution matching its
+// neighbours, which happens when the input's features are larger than the lookahead.
+WFC_RESULT_ENUM WFC_ChunkSolve(WFC_Model *model,
+                               uint32_t width,
+                               uint32_t height,
+                               const uint32_t *top,
+                               const uint32_t *left,
+                               uint32_t lookahead,
+                               uint32_t seed,
+                               uint32_t *patterns);
+
+// called with each finished chunk's pixel colors, row by row
+typedef WFC_RESULT_ENUM (*WFC_ChunkSink)(void *user,
+                                         uint32_t chunk_x,
+                                         uint32_t chunk_y,
+                                         uint32_t width,
+                                         uint32_t height,
+                                         const uint8_t *pixels);
+
+typedef struct WFC_ChunkOptions {
+    uint32_t chunk_width;
+    uint32_t chunk_height;
+    uint32_t num_chunks_x;
+    uint32_t num_chunks_y;
+    uint32_t lookahead; /* at least 1, see WFC_ChunkSolve */
+    uint32_t max_attempts; /* times a row of chunks is solved before giving up */
+    uint32_t seed; /* chunk seeds are derived from this and the chunk's number */
+    uint32_t num_threads; /* threads solving rows at once, counting the calling thread. 0 is taken as 1 */
+} WFC_ChunkOptions;
+
+// Generate a world of chunks row by row, passing each row's chunks to 'sink' once
+// they are all solved. Memory use depends on the world's width but not its height.
+//
+// With several threads a row is started as soon as the chunks it rests on are
+// solved, and is solved again if the row above has to restart. 'sink' is called
+// by one thread at a time, in row order, and the world is the same for any
+// number of threads.
+WFC_RESULT_ENUM WFC_GenerateChunks(WFC_Model *model,
+                                   const WFC_ChunkOptions *options,
+                                   WFC_ChunkSink sink,
+                                   void *user);
+
+// A WFC_ChunkSink writing to the FILE* in 'user'. Each chunk is written as its
+// x, y, width and height as uint32_t, followed by its pixels.
+WFC_RESULT_ENUM WFC_ChunkSinkFile(void *user,
+                                  uint32_t chunk_x,
+                                  uint32_t chunk_y,
+                                  uint32_t width,
+                                  uint32_t height,
+                                  const uint8_t *pixels);
+
+#if defined(WFC_TRACE)
+/* A timeline of what the library did, kept when it is built with WFC_TRACE
+ * defined. Initialization phases, steps and their observe and propagate halves
+ * are recorded as begin and end events, and contradictions as instant events.
+ * Events are written into a ring buffer given by the caller, so once it is full
+ * the oldest events are overwritten, and recording never allocates.
+ */
+typedef struct WFC_TraceEvent {
+    uint64_t time_ns; /* since the trace was started */
+    const char *name; /* a string literal naming the phase */
+    const char *arg_name; /* NULL if the event has no argument */
+    uint32_t arg;
+    uint32_t thread; /* small id of the thread which recorded the event */
+    char phase; /* 'B' for begin, 'E' for end or 'i' for instant, as in a Chrome trace */
+
+    // 2 * (event number + 1) once the event is written, one less while it is being written,
+    // or 0 if the slot has not been used
+    atomic_uint_fast64_t sequence;
+} WFC_TraceEvent;
+
+typedef struct WFC_Trace {
+    WFC_TraceEvent *events;
+    uint32_t max_events;
+    atomic_uint_fast64_t num_events; /* events recorded, including those overwritten */
+    uint64_t start_ns;
+} WFC_Trace;
+
+// Start recording into 'events', which must hold 'max_events' events and outlive
+// the trace. Only one trace records at a time. Threads may record into it
+// concurrently, and it may be saved while they do. An event whose slot another
+// thread is still writing when the buffer wraps is dropped.
+WFC_RESULT_ENUM WFC_TraceStart(WFC_Trace *trace, WFC_TraceEvent *events, uint32_t max_events);
+void WFC_TraceStop(void);
+
+// Write the events still in a trace's buffer, oldest first, as Chrome trace
+// JSON which chrome://tracing and Perfetto can open. Events being written or
+// overwritten while they are read are left out.
+WFC_RESULT_ENUM WFC_TraceSave(const WFC_Trace *trace, const char *path);
+#endif
 
 #if defined(WFC_TEST)
 void WFC_Test(void);
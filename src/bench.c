@@ -0,0 +1,534 @@
+// needed for clock_gettime and getrusage when compiling with -std=c11
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "log.h"
+
+#include "wfc.h"
+
+
+/* Benchmarks for the library on fixed, reproducible workloads.
+ *
+ * Each workload is an input image and an output size. Every input is either a
+ * fixed string or generated from a fixed seed, and every run uses fixed seeds,
+ * so two runs of the same build do the same work and their times can be compared.
+ *
+ * For each workload the model building phases (finding patterns and filling the
+ * index) are timed on their own, then the output is solved step by step with the
+ * observe and propagate halves of each step timed separately, then solved again
+ * with WFC_Step to time a full solve. A contradiction restarts the solve with
+ * the next seed, and the number of restarts is reported.
+ *
+ * When built with WFC_STATS defined, the library's counters for the full solve
+ * are reported too.
+ *
+ * Pixels are taken off the propagation queue in LIFO order, or FIFO order
+ * with --fifo, so the two can be compared. Likewise models constrain all eight
+ * neighbours, or only the four cardinal ones with --cardinal.
+ *
+ * The library picks its bitmap kernels for the CPU, and --kernels runs with
+ * another variant ("avx512", "avx2", "sse2" or "scalar") instead.
+ *
+ * Usage: wfc_bench [--json] [--fifo] [--cardinal] [--kernels name] [workload name...]
+ */
+
+// seeds tried for each solve before the workload is reported as failed
+#define BENCH_MAX_ATTEMPTS 64
+
+// seed of the first solve attempt of every workload
+#define BENCH_SEED 1
+
+typedef struct Bench_Input {
+    const char *name;
+    uint32_t width;
+    uint32_t height;
+    uint8_t *pixels;
+} Bench_Input;
+
+typedef struct Bench_Workload {
+    const char *name;
+    uint32_t input; /* index into gv_inputs */
+    uint32_t output_width;
+    uint32_t output_height;
+} Bench_Workload;
+
+typedef struct Bench_Result {
+    uint32_t num_patterns;
+
+    uint64_t find_patterns_ns;
+    uint64_t index_init_ns;
+    uint64_t model_create_ns;
+    uint64_t state_init_ns;
+
+    uint64_t observe_ns; /* summed over the steps of the phased solve */
+    uint64_t propagate_ns;
+
+    uint64_t solve_ns; /* full solve with WFC_Step, including any restarts */
+    uint32_t steps; /* steps taken by the full solve, including any restarts */
+    uint32_t restarts;
+    bool finished;
+
+    size_t model_bytes;
+    size_t state_bytes;
+    size_t peak_alloc_bytes; /* most memory the library held at once */
+    long peak_rss_kb; /* peak resident set size of the process so far */
+
+#if defined(WFC_STATS)
+    WFC_Stats stats; /* summed over the attempts of the full solve */
+#endif
+} Bench_Result;
+
+// allocator which tracks how much memory the library holds, so its peak can be reported
+typedef struct Bench_AllocHeader {
+    size_t size;
+    size_t offset; /* bytes from the start of the malloc'd block to the user pointer */
+} Bench_AllocHeader;
+
+static size_t gv_alloc_bytes = 0;
+static size_t gv_alloc_peak = 0;
+
+static void *Bench_Alloc(size_t size, size_t align, void *user) {
+    (void)user;
+
+    if (align < _Alignof(Bench_AllocHeader)) {
+        align = _Alignof(Bench_AllocHeader);
+    }
+
+    size_t offset = ((sizeof(Bench_AllocHeader) + align - 1) / align) * align;
+    uint8_t *block = (uint8_t*)malloc(size + offset + align);
+
+    if (NULL == block) {
+        return NULL;
+    }
+
+    uintptr_t addr = ((uintptr_t)block + offset + align - 1) & ~((uintptr_t)align - 1);
+    Bench_AllocHeader *header = (Bench_AllocHeader*)(addr - sizeof(Bench_AllocHeader));
+    header->size = size;
+    header->offset = addr - (uintptr_t)block;
+
+    gv_alloc_bytes += size;
+    if (gv_alloc_bytes > gv_alloc_peak) {
+        gv_alloc_peak = gv_alloc_bytes;
+    }
+
+    return (void*)addr;
+}
+
+static void Bench_Free(void *ptr, void *user) {
+    (void)user;
+
+    if (NULL == ptr) {
+        return;
+    }
+
+    Bench_AllocHeader *header = (Bench_AllocHeader*)((uint8_t*)ptr - sizeof(Bench_AllocHeader));
+    gv_alloc_bytes -= header->size;
+    free((uint8_t*)ptr - header->offset);
+}
+
+static const WFC_Allocator gv_bench_allocator = { Bench_Alloc, Bench_Free, NULL };
+
+static uint64_t Bench_Now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static uint32_t Bench_XorShift(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// a ring of one colour inside another, with a dot in the middle. Few patterns.
+static uint8_t gv_rings[] = {
+    0, 0, 0, 0,
+    0, 1, 1, 1,
+    0, 1, 2, 1,
+    0, 1, 1, 1,
+};
+
+/* Fill a 'width' x 'height' image with rectangles of random colours drawn over
+ * each other, which tiles well but gives many distinct patterns at the corners
+ * where rectangles overlap.
+ */
+static void Bench_GenerateRooms(uint8_t *pixels, uint32_t width, uint32_t height,
+                                uint32_t num_colors, uint32_t num_rooms, uint32_t seed) {
+    uint32_t rng = seed;
+
+    memset(pixels, 0, width * height);
+
+    for (uint32_t room = 0; room < num_rooms; room++) {
+        uint32_t x = Bench_XorShift(&rng) % width;
+        uint32_t y = Bench_XorShift(&rng) % height;
+        uint32_t w = 2 + Bench_XorShift(&rng) % (width / 2);
+        uint32_t h = 2 + Bench_XorShift(&rng) % (height / 2);
+        uint8_t color = (uint8_t)(1 + Bench_XorShift(&rng) % (num_colors - 1));
+
+        for (uint32_t dy = 0; dy < h; dy++) {
+            for (uint32_t dx = 0; dx < w; dx++) {
+                pixels[((y + dy) % height) * width + ((x + dx) % width)] = color;
+            }
+        }
+    }
+}
+
+static uint8_t gv_rooms[24 * 24];
+
+// more colours and rooms on a larger image, for a model with several hundred patterns
+static uint8_t gv_city[64 * 64];
+
+static WFC_QUEUE_ORDER_ENUM gv_queue_order = WFC_QUEUE_ORDER_LIFO;
+static WFC_ADJACENCY_ENUM gv_adjacency = WFC_ADJACENCY_ALL;
+
+static Bench_Input gv_inputs[] = {
+    { "rings", 4, 4, gv_rings },
+    { "rooms", 24, 24, gv_rooms },
+    { "city", 64, 64, gv_city },
+};
+
+static const Bench_Workload gv_workloads[] = {
+    { "rings_small",  0,  16,  16 },
+    { "rings_medium", 0,  64,  64 },
+    { "rings_large",  0, 128, 128 },
+    { "rooms_small",  1,  16,  16 },
+    { "rooms_medium", 1,  48,  48 },
+    { "rooms_large",  1,  96,  96 },
+    { "city_small",   2,  16,  16 },
+    { "city_medium",  2,  48,  48 },
+    { "city_large",   2,  96,  96 },
+};
+
+#define BENCH_NUM_WORKLOADS (sizeof(gv_workloads) / sizeof(gv_workloads[0]))
+
+#if defined(WFC_STATS)
+// the counters of WFC_Stats, in the order they are reported
+#define BENCH_STATS(X) \
+    X(steps) X(propagations) X(queue_pushes) X(queue_pops) X(queue_high_water) \
+    X(bits_cleared) X(index_lookups) X(contradictions) X(restarts) \
+    X(observe_cycles) X(propagate_cycles) X(backtrack_cycles)
+
+static void Bench_AddStats(WFC_Stats *total, const WFC_Stats *stats) {
+#define BENCH_ADD_STAT(name) total->name += stats->name;
+    BENCH_STATS(BENCH_ADD_STAT)
+#undef BENCH_ADD_STAT
+
+    // the high water mark is the largest of any attempt, not their sum
+    total->queue_high_water -= stats->queue_high_water;
+    if (stats->queue_high_water > total->queue_high_water) {
+        total->queue_high_water = stats->queue_high_water;
+    }
+}
+
+static void Bench_PrintStats(const WFC_Stats *stats, bool json, bool header) {
+#define BENCH_PRINT_STAT(name) \
+    if (header) { \
+        printf(",stat_" #name); \
+    } else if (json) { \
+        printf(", \"stat_" #name "\": %llu", (unsigned long long)stats->name); \
+    } else { \
+        printf(",%llu", (unsigned long long)stats->name); \
+    }
+    BENCH_STATS(BENCH_PRINT_STAT)
+#undef BENCH_PRINT_STAT
+}
+#endif
+
+/* Time WFC_FindPatterns and WFC_IndexInit on their own. WFC_ModelCreate runs
+ * both along with its other setup, so they are repeated here on a scratch model
+ * built from the same input, whose buffers are then freed.
+ */
+static bool Bench_ModelPhases(const WFC_Model *model, Bench_Result *result) {
+    bool okay = true;
+
+    WFC_Model scratch = {0};
+    scratch.input_width = model->input_width;
+    scratch.input_height = model->input_height;
+    scratch.input = model->input;
+
+    uint64_t start = Bench_Now();
+    okay = WFC_RESULT_OKAY == WFC_FindPatterns(&scratch);
+    result->find_patterns_ns = Bench_Now() - start;
+
+    Bench_Free(scratch.propagator.patterns, NULL);
+
+    // fill a fresh index for the model's own patterns
+    size_t index_bytes = (size_t)model->propagator.num_patterns *
+                         model->propagator.bitmap_words *
+                         model->propagator.num_adjacent *
+                         sizeof(uint64_t);
+
+    scratch.propagator = model->propagator;
+    scratch.propagator.index = (uint64_t*)Bench_Alloc(index_bytes, WFC_ARENA_ALIGN, NULL);
+
+    if (okay && (NULL != scratch.propagator.index)) {
+        memset(scratch.propagator.index, 0, index_bytes);
+
+        start = Bench_Now();
+        okay = WFC_RESULT_OKAY == WFC_IndexInit(&scratch);
+        result->index_init_ns = Bench_Now() - start;
+
+        okay = okay && (0 == memcmp(scratch.propagator.index, model->propagator.index, index_bytes));
+    } else {
+        okay = false;
+    }
+
+    Bench_Free(scratch.propagator.index, NULL);
+
+    return okay;
+}
+
+/* Solve one attempt by calling the halves of WFC_Step directly, adding the time
+ * spent in each to the result. Returns the result which ended the attempt.
+ */
+static WFC_RESULT_ENUM Bench_SolvePhased(WFC_State *state, Bench_Result *result) {
+    WFC_RESULT_ENUM step_result = WFC_RESULT_CONTINUE;
+
+    while (WFC_RESULT_CONTINUE == step_result) {
+        WFC_Pos pos;
+
+        uint64_t start = Bench_Now();
+        step_result = WFC_Observe(state, &pos);
+        uint64_t observed = Bench_Now();
+        result->observe_ns += observed - start;
+
+        if (WFC_RESULT_CONTINUE == step_result) {
+            step_result = WFC_Propagate(state);
+            result->propagate_ns += Bench_Now() - observed;
+        }
+
+        state->step_num++;
+    }
+
+    return step_result;
+}
+
+static WFC_RESULT_ENUM Bench_Solve(WFC_State *state, uint32_t *steps) {
+    WFC_RESULT_ENUM step_result = WFC_RESULT_CONTINUE;
+
+    while (WFC_RESULT_CONTINUE == step_result) {
+        step_result = WFC_Step(state);
+        (*steps)++;
+    }
+
+    return step_result;
+}
+
+/* Try seeds in turn until one solves the output, once with the phased solve
+ * and once with the full solve. Both see the same seeds, so they do the same work.
+ */
+static bool Bench_Run(const Bench_Workload *workload, Bench_Result *result) {
+    const Bench_Input *input = &gv_inputs[workload->input];
+    WFC_Model *model = NULL;
+    WFC_State state = {0};
+    bool okay = true;
+
+    memset(result, 0, sizeof(*result));
+    gv_alloc_peak = gv_alloc_bytes;
+
+    uint64_t start = Bench_Now();
+    okay = WFC_RESULT_OKAY ==
+           WFC_ModelCreateWithAdjacency(&model, input->width, input->height, input->pixels, gv_adjacency);
+    result->model_create_ns = Bench_Now() - start;
+
+    if (okay) {
+        result->num_patterns = model->propagator.num_patterns;
+        result->model_bytes = WFC_ModelSize(model);
+        result->state_bytes = WFC_StateSize(model, workload->output_width, workload->output_height);
+
+        okay = Bench_ModelPhases(model, result);
+    }
+
+    for (uint32_t attempt = 0; okay && (attempt < BENCH_MAX_ATTEMPTS); attempt++) {
+        okay = WFC_RESULT_OKAY == WFC_StateInitFromModel(&state, model, workload->output_width, workload->output_height);
+        okay = okay && (WFC_RESULT_OKAY == WFC_StateSetSeed(&state, BENCH_SEED + attempt));
+        okay = okay && (WFC_RESULT_OKAY == WFC_StateSetQueueOrder(&state, gv_queue_order));
+
+        if (okay && (WFC_RESULT_FINISHED == Bench_SolvePhased(&state, result))) {
+            attempt = BENCH_MAX_ATTEMPTS;
+        }
+
+        WFC_StateDestroy(&state);
+    }
+
+    start = Bench_Now();
+    for (uint32_t attempt = 0; okay && (attempt < BENCH_MAX_ATTEMPTS); attempt++) {
+        uint64_t init_start = Bench_Now();
+        okay = WFC_RESULT_OKAY == WFC_StateInitFromModel(&state, model, workload->output_width, workload->output_height);
+        okay = okay && (WFC_RESULT_OKAY == WFC_StateSetSeed(&state, BENCH_SEED + attempt));
+        okay = okay && (WFC_RESULT_OKAY == WFC_StateSetQueueOrder(&state, gv_queue_order));
+        result->state_init_ns += Bench_Now() - init_start;
+
+        if (okay && (WFC_RESULT_FINISHED == Bench_Solve(&state, &result->steps))) {
+            result->finished = true;
+        }
+
+#if defined(WFC_STATS)
+        Bench_AddStats(&result->stats, &state.stats);
+#endif
+
+        WFC_StateDestroy(&state);
+
+        if (result->finished) {
+            break;
+        }
+
+        result->restarts++;
+    }
+    result->solve_ns = Bench_Now() - start;
+
+    if (NULL != model) {
+        WFC_ModelRelease(model);
+    }
+
+    result->peak_alloc_bytes = gv_alloc_peak;
+
+    struct rusage usage;
+    if (0 == getrusage(RUSAGE_SELF, &usage)) {
+        result->peak_rss_kb = usage.ru_maxrss;
+    }
+
+    return okay;
+}
+
+static void Bench_Print(const Bench_Workload *workload, const Bench_Result *result, bool json, bool first) {
+    const Bench_Input *input = &gv_inputs[workload->input];
+    uint64_t cells = (uint64_t)workload->output_width * workload->output_height;
+    double ns_per_cell = (double)result->solve_ns / (double)cells;
+    double steps_per_sec = (0 == result->solve_ns) ? 0.0 : (double)result->steps * 1e9 / (double)result->solve_ns;
+    const char *order = (WFC_QUEUE_ORDER_FIFO == gv_queue_order) ? "fifo" : "lifo";
+    const uint32_t adjacency = gv_adjacency;
+    const char *kernels = WFC_BitmapKernelsName();
+
+    if (json) {
+        printf("%s\n  {\"workload\": \"%s\", \"input\": \"%s\", \"order\": \"%s\", \"adjacency\": %u, "
+               "\"kernels\": \"%s\", \"patterns\": %u, "
+               "\"width\": %u, \"height\": %u, \"finished\": %s, "
+               "\"model_create_ns\": %llu, \"find_patterns_ns\": %llu, \"index_init_ns\": %llu, "
+               "\"state_init_ns\": %llu, \"observe_ns\": %llu, \"propagate_ns\": %llu, \"solve_ns\": %llu, "
+               "\"ns_per_cell\": %.1f, \"steps\": %u, \"steps_per_sec\": %.0f, \"restarts\": %u, "
+               "\"model_bytes\": %zu, \"state_bytes\": %zu, \"peak_alloc_bytes\": %zu, \"peak_rss_kb\": %ld",
+               first ? "[" : ",",
+               workload->name, input->name, order, adjacency, kernels, result->num_patterns,
+               workload->output_width, workload->output_height, result->finished ? "true" : "false",
+               (unsigned long long)result->model_create_ns,
+               (unsigned long long)result->find_patterns_ns,
+               (unsigned long long)result->index_init_ns,
+               (unsigned long long)result->state_init_ns,
+               (unsigned long long)result->observe_ns,
+               (unsigned long long)result->propagate_ns,
+               (unsigned long long)result->solve_ns,
+               ns_per_cell, result->steps, steps_per_sec, result->restarts,
+               result->model_bytes, result->state_bytes, result->peak_alloc_bytes, result->peak_rss_kb);
+#if defined(WFC_STATS)
+        Bench_PrintStats(&result->stats, json, false);
+#endif
+        printf("}");
+    } else {
+        if (first) {
+            printf("workload,input,order,adjacency,kernels,patterns,width,height,finished,"
+                   "model_create_ns,find_patterns_ns,index_init_ns,"
+                   "state_init_ns,observe_ns,propagate_ns,solve_ns,"
+                   "ns_per_cell,steps,steps_per_sec,restarts,"
+                   "model_bytes,state_bytes,peak_alloc_bytes,peak_rss_kb");
+#if defined(WFC_STATS)
+            Bench_PrintStats(NULL, json, true);
+#endif
+            printf("\n");
+        }
+
+        printf("%s,%s,%s,%u,%s,%u,%u,%u,%d,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.1f,%u,%.0f,%u,%zu,%zu,%zu,%ld",
+               workload->name, input->name, order, adjacency, kernels, result->num_patterns,
+               workload->output_width, workload->output_height, result->finished ? 1 : 0,
+               (unsigned long long)result->model_create_ns,
+               (unsigned long long)result->find_patterns_ns,
+               (unsigned long long)result->index_init_ns,
+               (unsigned long long)result->state_init_ns,
+               (unsigned long long)result->observe_ns,
+               (unsigned long long)result->propagate_ns,
+               (unsigned long long)result->solve_ns,
+               ns_per_cell, result->steps, steps_per_sec, result->restarts,
+               result->model_bytes, result->state_bytes, result->peak_alloc_bytes, result->peak_rss_kb);
+#if defined(WFC_STATS)
+        Bench_PrintStats(&result->stats, json, false);
+#endif
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    bool json = false;
+    uint32_t num_selected = 0;
+
+    for (int arg_index = 1; arg_index < argc; arg_index++) {
+        if (0 == strcmp(argv[arg_index], "--json")) {
+            json = true;
+        } else if (0 == strcmp(argv[arg_index], "--fifo")) {
+            gv_queue_order = WFC_QUEUE_ORDER_FIFO;
+        } else if (0 == strcmp(argv[arg_index], "--cardinal")) {
+            gv_adjacency = WFC_ADJACENCY_CARDINAL;
+        } else if (0 == strcmp(argv[arg_index], "--kernels") && (arg_index + 1 < argc)) {
+            arg_index++;
+            if (WFC_RESULT_OKAY != WFC_UseBitmapKernels(argv[arg_index])) {
+                fprintf(stderr, "bitmap kernels '%s' are not available on this CPU\n", argv[arg_index]);
+                return 1;
+            }
+        } else {
+            num_selected++;
+        }
+    }
+
+    // keep the library's trace logging out of the results
+    log_set_quiet(1);
+
+    WFC_SetAllocator(&gv_bench_allocator);
+
+    Bench_GenerateRooms(gv_rooms, 24, 24, 5, 12, 0x2545F491);
+    Bench_GenerateRooms(gv_city, 64, 64, 16, 120, 0x9E3779B9);
+
+    bool first = true;
+    bool okay = true;
+
+    for (uint32_t workload_index = 0; workload_index < BENCH_NUM_WORKLOADS; workload_index++) {
+        const Bench_Workload *workload = &gv_workloads[workload_index];
+
+        // run every workload unless some were named on the command line
+        bool selected = (0 == num_selected);
+        for (int arg_index = 1; arg_index < argc; arg_index++) {
+            selected = selected || (0 == strcmp(argv[arg_index], workload->name));
+        }
+
+        if (!selected) {
+            continue;
+        }
+
+        Bench_Result result;
+        if (!Bench_Run(workload, &result)) {
+            fprintf(stderr, "workload %s failed\n", workload->name);
+            okay = false;
+        }
+
+        Bench_Print(workload, &result, json, first);
+        first = false;
+    }
+
+    if (json) {
+        printf("%s\n", first ? "[]" : "\n]");
+    }
+
+    WFC_SetAllocator(NULL);
+
+    return okay ? 0 : 1;
+}
@@ -1,652 +1,5591 @@
-#include <stdint.h>
-#include <stddef.h>
-#include <stdlib.h>
-#include <stdbool.h>
-#include <string.h>
-#include <stdio.h>
-#include <assert.h>
-
-#include "log.h"
-
-#include "wfc.h"
-
-
-// bytes needed to create a bitmap with one bit per pattern
-#define WFC_BITMAP_BYTES_NEEDED(num_patterns) ((num_patterns / 8UL) + ((num_patterns % 8) != 0))
-
-// number of bytes needed for one bitmap per adjacency type
-#define WFC_PATTERN_BYTES_NEEDED(num_patterns) (WFC_BITMAP_BYTES_NEEDED(num_patterns) * WFC_NUM_ADJACENT)
-
-// length of the index (number of patterns times bitmap length for each pattern)
-#define WFC_INDEX_LENGTH_BYTES(num_patterns) (num_patterns * WFC_PATTERN_BYTES_NEEDED(num_patterns))
-
-#define WFC_PATTERN_INDEX(num_patterns, pattern) (WFC_PATTERN_BYTES_NEEDED(num_patterns) * pattern)
-#define WFC_ADJACENT_INDEX(num_patterns, adjacent) (WFC_BITMAP_BYTES_NEEDED(num_patterns) * adjacent)
-
-
-const WFC_Pos gv_adjacent_offsets[WFC_NUM_ADJACENT] =
-    { { -1, -1 }
-    , { -1, 0 }
-    , { -1, 1 }
-    , {  0, 1 }
-    , {  1, 1 }
-    , {  1, 0 }
-    , {  1, -1 }
-    , {  0, -1 }
-    };
-
-const WFC_Pos gv_pattern_offsets[WFC_PATTERN_LEN] =
-    { { 0, 0 }
-    , { 1, 0 }
-    , { 0, 1 }
-    , { 1, 1 }
-    };
-
-
-// check if 'tile' overlaps with 'other_tile', if 'other_tile' is offset by 'adjacency'.
-static bool WFC_TilesOverlap(WFC_Tile tile, WFC_Tile other_tile, WFC_Pos adjacency);
-
-// helper functions to check tile overlaps
-static WFC_Tile WFC_MaskTile(WFC_Tile tile, WFC_Pos adjacency);
-static WFC_Tile WFC_ShiftTile(WFC_Tile tile, WFC_Pos adjacency);
-
-// get a pointer to the output array's pattern bitmap for a particular pixel
-static uint8_t *WFC_GetOutputBitmap(WFC_State *state, WFC_Pos pos);
-
-
-WFC_RESULT_ENUM WFC_StateInit(WFC_State *state,
-                              uint32_t input_width,
-                              uint32_t input_height,
-                              const uint8_t *input
-                              uint32_t output_width,
-                              uint32_t output_height) {
-    WFC_RESULT_ENUM result = WFC_RESULT_OKAY;
-
-    if ((NULL == state) || (NULL == input)) {
-        result = WFC_RESULT_ERROR;
-    }
-
-    if (WFC_RESULT_OKAY == result) {
-        log_trace("WFC checking input");
-        // check that input does not contain values >= 16
-        for (uint32_t input_index = 0; input_index < input_width * input_height; input_index++) {
-            if ((input[input_index] & (~WFC_CELL_MASK)) != 0) {
-                result = WFC_RESULT_ERROR;
-                break;
-            }
-        }
-    }
-
-    if (WFC_RESULT_OKAY == result) {
-        memset(state, 0, sizeof(*state));
-
-        state->rng = 7;
-
-        log_trace("WFC initializing state");
-        // copy input buffer to ensure we can clean up at the end
-        uint32_t input_size_bytes = input_width * input_height;
-
-        // check arithmatic overflow
-        assert(input_height == (input_size_bytes / input_width));
-
-        uint8_t *input_copy = (uint8_t*)malloc(input_size_bytes);
-
-        if (NULL == input_copy) {
-            result = WFC_RESULT_ERROR;
-        } else {
-            memcpy(input_copy, input, input_size_bytes);
-            state->input = input_copy;
-            state->input_width = input_width;
-            state->input_height = input_height;
-        }
-    }
-
-    if (result == WFC_RESULT_OKAY) {
-        state->queue.num_items = 0;
-        state->queue.max_items = output_width * output_height;
-        state->queue.items = (WFC_Pos*)(calloc(1, state->queue.max_items * sizeof(WFC_Pos)));
-
-        if (NULL == state->queue.items) {
-            result = WFC_RESULT_ERROR;
-        }
-    }
-
-    if (WFC_RESULT_OKAY == result) {
-        log_trace("WFC finding patterns");
-        // collect patterns from input into a table
-        result = WFC_FindPatterns(state);
-    }
-
-    if (WFC_RESULT_OKAY == result) {
-        log_trace("WFC allocating index");
-        // create the index (table of adjacent patterns for each pattern)
-        uint8_t *index = (uint8_t*)calloc(1, WFC_INDEX_LENGTH_BYTES(state->propagator.num_patterns));
-
-        if (NULL == index) {
-            result = WFC_RESULT_ERROR;
-        } else {
-            state->propagator.index = index;
-        }
-    }
-
-    if (WFC_RESULT_OKAY == result) {
-        log_trace("WFC initializing index");
-        // fill the index with the discovered patterns and their adjacency information
-        result = WFC_IndexInit(state);
-    }
-
-    if (WFC_RESULT_OKAY == result) {
-        log_trace("WFC setting up output map");
-        state->propagator.bitmap_len =
-            (state->propagator.num_patterns / 8) + 
-            ((state->propagator.num_patterns % 8) != 0);
-        uint32_t num_pixels = state->input_width * state->input_height;
-        log_trace("Output bitmap length %d", state->propagator.bitmap_len);
-
-        // allocate a bitmap for each pixel
-        state->output = (uint8_t*)calloc(state->propagator.bitmap_len, num_pixels);
-        assert(NULL != state->output);
-
-        // initial each bitmap to all 1, indicating that all patterns are valid
-        // NOTE this could be done by setting 0xFF in each byte. The current approach at
-        // least only sets bits that are actually used.
-        for (uint32_t pix_index = 0; pix_index < num_pixels; pix_index++) {
-            for (uint32_t pat_index = 0; pat_index < state->propagator.num_patterns; pat_index++) {
-                uint32_t bitmap_offset = pix_index * (state->propagator.bitmap_len);
-                state->output[bitmap_offset + (pat_index / 8)] |= 1 << (pat_index % 8);
-            }
-        }
-    }
-
-    // TODO we should probably call WFC_StateDestroy on error to clean up
-    // any allocated memory from a partially constructed state.
-
-    return result;
-}
-
-void WFC_StateDestroy(WFC_State *state) {
-    if (NULL != state) {
-          if (NULL != state->input) {
-              free(state->input);
-          }
-
-          if (NULL != state->output) {
-              free(state->output);
-          }
-
-          if (NULL != state->propagator.patterns) {
-              free(state->propagator.patterns);
-          }
-
-          if (NULL != state->propagator.index) {
-              free(state->propagator.index);
-          }
-
-          // clear memory so its pointers are no longer available for use
-          memset(state, 0, sizeof(*state));
-     }
-}
-
-void WFC_PrintTile(WFC_Tile tile) {
-    printf("\t\t");
-    printf("%1X", (tile & 0xF000) >> 12);
-    printf("%1X", (tile & 0x0F00) >> 8);
-    printf("\n");
-    printf("\t\t");
-    printf("%1X", (tile & 0x00F0) >> 4);
-    printf("%1X", (tile & 0x000F) >> 0);
-    printf("\n");
-}
-
-void WFC_PrintState(WFC_State *state) {
-    printf("WFC_State: \n");
-    printf("\tinput:\n");
-    for (uint32_t y = 0; y < state->input_height; y++) {
-        printf("\t\t");
-        for (uint32_t x = 0; x < state->input_width; x++) {
-            printf("%1X", state->input[x + y * state->input_width]);
-        }
-        printf("\n");
-    }
-
-    printf("\tpatterns (%d):\n", state->propagator.num_patterns);
-    for (uint32_t pattern_index = 0; pattern_index < state->propagator.num_patterns; pattern_index++) {
-        WFC_Pattern pattern = state->propagator.patterns[pattern_index];
-        printf("\t\tindex %d (count %d)\n", pattern.index, pattern.count);
-        WFC_PrintTile(pattern.tile);
-    }
-    printf("\n");
-}
-
-uint8_t *WFC_GetOutputBitmap(WFC_State *state, WFC_Pos pos) {
-    uint32_t pixel_index = pos.x + pos.y * state->output_width;
-    uint32_t output_index =
-         pixel_index * WFC_BITMAP_BYTES_NEEDED(state->propagator.num_patterns);
-
-    return &state->output[output_index];
-}
-
-/** Offset a given position by a given offset, wrapping around a grid of a given
- * width and height.
- */
-WFC_Pos WFC_OffsetFrom(WFC_Pos pos, WFC_Pos offset, uint32_t width, uint32_t height) {
-    WFC_Pos loc = pos;
-
-    loc.x = loc.x + offset.x;
-    if (loc.x < 0) {
-        loc.x = width + loc.x;
-    }
-    loc.x %= width;
-
-    loc.y = loc.y + offset.y;
-    if (loc.y < 0) {
-        loc.y = height + loc.y;
-    }
-    loc.y %= height;
-
-    return loc;
-}
-
-#if defined(WFC_TEST)
-bool WFC_PosEqual(WFC_Pos first, WFC_Pos second) {
-    return (first.x == second.x) && (first.y == second.y);
-}
-
-void WFC_TestOffsetFrom(void) {
-    WFC_Pos pos = { .x = 0, .y = 0};
-    WFC_Pos answer;
-
-    WFC_Pos offset;
-    offset.x = 1;
-    offset.y = 1;
-
-    answer = WFC_OffsetFrom(pos, offset, 10, 10);
-    assert(WFC_PosEqual((WFC_Pos){ .x = 1, .y = 1 }, answer));
-
-    offset.x = 1;
-    offset.y = -1;
-    answer = WFC_OffsetFrom(pos, offset, 10, 10);
-    assert(WFC_PosEqual((WFC_Pos){ .x = 1, .y = 9 }, answer));
-}
-#endif
-
-/** Get the WFC_Tile from a given offset. This is a 2x2 pattern
- * encoded into an integer.
- */
-WFC_Tile WFC_TileAt(WFC_Pos pos, uint32_t width, uint32_t height, uint8_t *input) {
-    assert(NULL != input);
-
-    WFC_Tile tile = 0;
-
-    for (uint32_t offset_index = 0; offset_index < WFC_PATTERN_LEN; offset_index++) {
-        WFC_Pos offset = gv_pattern_offsets[offset_index];
-
-        WFC_Pos loc = WFC_OffsetFrom(pos, offset, width, height);
-
-        tile = tile << WFC_CELL_NUM_BITS;
-
-        tile |= input[loc.x + loc.y * width];
-    }
-
-    return tile;
-}
-
-WFC_RESULT_ENUM WFC_FindPatterns(WFC_State *state) {
-    WFC_RESULT_ENUM result = WFC_RESULT_OKAY; 
-
-    assert(NULL != state);
-
-    for (uint32_t y = 0; y < state->input_height; y++) {
-        for (uint32_t x = 0; x < state->input_width; x++) {
-            WFC_Pos pos = { x, y };
-
-            // get the tile at the current location
-            WFC_Pattern pattern = {0};
-            pattern.tile = WFC_TileAt(pos, state->input_width, state->input_height, state->input);
-
-            // check if the pattern is already defined
-            // NOTE a hash table or set structure may be faster then this linear search
-            bool pattern_found = false;
-            for (uint32_t pattern_index = 0; pattern_index < state->propagator.num_patterns; pattern_index++) {
-                if (memcmp(&state->propagator.patterns[pattern_index].tile, &pattern.tile, sizeof(WFC_Tile)) == 0) {
-                    pattern_found = true;
-                    pattern.index = pattern_index;
-                    break;
-                }
-            }
-
-            // if not defined, add to the propagator table
-            if (!pattern_found) {
-                // if we have not yet allocated the patterns table, allocate it now.
-                if (state->propagator.patterns == NULL) {
-                    state->propagator.max_patterns = 1;
-                    state->propagator.patterns = (WFC_Pattern*)calloc(1, sizeof(WFC_Pattern));
-                    assert(NULL != state->propagator.patterns);
-                }
-
-                // check that we have space for one more pattern. If not, realloc
-                if ((state->propagator.num_patterns + 1) == state->propagator.max_patterns) {
-                    uint32_t new_size = state->propagator.max_patterns * sizeof(WFC_Pattern) * 2;
-
-                    state->propagator.patterns =
-                        realloc(state->propagator.patterns, new_size);
-                    assert(NULL != state->propagator.patterns);
-
-                    state->propagator.max_patterns *= 2;
-                }
-
-                pattern.count = 1;
-                pattern.index = state->propagator.num_patterns;
-                state->propagator.patterns[state->propagator.num_patterns] = pattern;
-                state->propagator.num_patterns++;
-            } else {
-                // found another occurrance, so bump the count
-                state->propagator.patterns[pattern.index].count++;
-            }
-        }
-    }
-
-    return result;
-}
-
-WFC_RESULT_ENUM WFC_IndexInit(WFC_State *state) {
-    WFC_RESULT_ENUM result = WFC_RESULT_OKAY; 
-
-    assert(NULL != state);
-
-    const uint32_t num_patterns = state->propagator.num_patterns;
-
-    //   NOTE could do triangular matrix and mark opposite adjacencies as you go
-    for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
-        WFC_Tile tile = state->propagator.patterns[pat_index].tile;
-
-        uint32_t pattern_bitmap_offset = pat_index * WFC_PATTERN_BYTES_NEEDED(num_patterns);
-
-        for (uint8_t adj_index = 0; adj_index < WFC_NUM_ADJACENT; adj_index++) {
-            uint32_t bitmap_offset =
-                pattern_bitmap_offset + adj_index * WFC_BITMAP_BYTES_NEEDED(num_patterns);
-
-            for (uint32_t other_pat_index = 0; other_pat_index < num_patterns; other_pat_index++) {
-                WFC_Tile other_tile = state->propagator.patterns[other_pat_index].tile;
-
-                // if the tiles overlap with the given adjacency, mark the bit
-                if (WFC_TilesOverlap(tile, other_tile, gv_adjacent_offsets[adj_index])) {
-                    state->propagator.index[bitmap_offset + (other_pat_index / 8)] |=
-                        1 << (other_pat_index % 8);
-                }
-            }
-        }
-    }
-
-    return result;
-}
-
-WFC_Tile WFC_MaskTile(WFC_Tile tile, WFC_Pos adjacency) {
-    uint16_t tile_part = tile;
-
-    // TODO(perf) consider something like
-    //
-    // initiailze to no mask (keep all bits)
-    // uint16_t x_mask = 0xFFFF;
-    // flip mask if negative, and set to 0 if x == 0
-    // x_mask &= (0x0F0F ^ (0xFFFF * (adjacency.x < 0))) * (adjacency.x != 0);
-    //
-    // uint16_t y_mask = 0xFFFF;
-    // y_mask = (0x00FF ^ (0xFFFF * (adjacency.y < 0))) * (adjacency.x != 0);
-    // return tile & x_mask & y_mask;
-    if (adjacency.x == 1) {
-        tile_part &= 0x0F0F;
-    } else if (adjacency.x == -1) {
-        tile_part &= 0xF0F0;
-    }
-
-    if (adjacency.y == 1) {
-        tile_part &= 0x00FF;
-    } else if (adjacency.y == -1) {
-        tile_part &= 0xFF00;
-    }
-
-    return tile_part;
-}
-
-WFC_Tile WFC_ShiftTile(WFC_Tile tile, WFC_Pos adjacency) {
-    uint16_t tile_part = tile;
-
-    if (adjacency.x == 1) {
-        tile_part = tile_part << 4;
-    } else if (adjacency.x == -1) {
-        tile_part = tile_part >> 4;
-    }
-
-    if (adjacency.y == 1) {
-        tile_part = tile_part << 8;
-    } else if (adjacency.y == -1) {
-        tile_part = tile_part >> 8;
-    }
-
-    return tile_part;
-}
-
-bool WFC_TilesOverlap(WFC_Tile tile, WFC_Tile other_tile, WFC_Pos adjacency) {
-    uint16_t tile_part = WFC_ShiftTile(WFC_MaskTile(tile, adjacency), adjacency);
-    uint16_t other_tile_part = WFC_MaskTile(other_tile, (WFC_Pos){-adjacency.x, -adjacency.y});
-    //log_trace("%04X tile", tile_part);
-    //log_trace("%04X other", other_tile_part);
-
-    return tile_part == other_tile_part;
-}
-
-#if defined(WFC_TEST)
-void WFC_TestTileOverlap(void) {
-    assert(WFC_TilesOverlap(0x0001, 0x1000, (WFC_Pos){1, 1}));
-    assert(WFC_TilesOverlap(0x1234, 0x4321, (WFC_Pos){1, 1}));
-
-    assert(WFC_TilesOverlap(0x1234, 0x2040, (WFC_Pos){1, 0}));
-    assert(WFC_TilesOverlap(0x1234, 0x2948, (WFC_Pos){1, 0}));
-
-    assert(WFC_TilesOverlap(0x1234, 0x3400, (WFC_Pos){0, 1}));
-
-    assert(WFC_TilesOverlap(0x1234, 0x0001, (WFC_Pos){-1, -1}));
-
-    assert(WFC_TilesOverlap(0x1234, 0x0103, (WFC_Pos){-1, 0}));
-
-    assert(WFC_TilesOverlap(0x1234, 0x0012, (WFC_Pos){0, -1}));
-}
-#endif
-
-uint32_t WFC_Entropy(State *state, uint32_t x, uint32_t y) {
-    uint32_t entropy = 0;
-
-    uint8_t *output_bitmap = WFC_GetOutputBitmap(state, (WFC_Pos){x, y});
-
-    for (uint32_t pat_index = 0; pat_index < state->propagator.num_patterns; pat_index++) {
-        if ((output_bitmap[pat_index / 8] & (1 << (pat_index % 8))) != 0) {
-            entropy += state->propagator.patterns[pat_index].count;
-        }
-    }
-
-    return entropy;
-}
-
-WFC_RESULT_ENUM WFC_LowestEntropy(WFC_State *state, WFC_Pos *pos, uint32_t *entropy) {
-    assert(NULL != state);
-    assert(NULL != pos);
-    assert(NULL != entropy);
-
-    uint32_t min_entropy_count = 0;
-    *entropy = 0xFFFFFFFF;
-
-    uint32_t bitmap_len = WFC_BITMAP_BYTES_NEEDED(state->propagator.num_patterns);
-    for (uint32_t y = 0; y < state->output_height; y++) {
-        for (uint32_t x = 0; x < state->output_width; x++) {
-
-            uint32_t current_entropy = WFC_Entropy(state, x, y);
-
-            if (current_entropy == 0) {
-                return WFC_RESULT_RESTART;
-            }
-
-            if (current_entropy < *entropy) {
-                *pos = (WFC_Pos){x, y};
-                min_entropy_count = 0;
-                *entropy = current_entropy;
-            } else if (current_entropy == *entropy) {
-                min_entropy_count++;
-
-                // accept with probability 1 / min_entropy_count
-                float prob = ((1.0 / (float)0xFFFFFFFF)) * WFC_GenRandom(state);
-
-                if (prob < (1.0 / ((float)min_entropy_count))) {
-                    *entropy = current_entropy;
-                    *pos = (WFC_Pos){x, y};
-                }
-            }
-            // otherwise ignore
-        }
-    }
-
-    if (min_entropy == 1) {
-        return WFC_RESULT_OKAY;
-    }
-
-    return WFC_RESULT_CONTINUE;
-}
-
-WFC_RESULT_ENUM WFC_Observe(WFC_State *state, WFC_Pos *pos) {
-    assert(NULL != state);
-    assert(NULL != pos);
-
-    uint32_t entropy = 0;
-
-    WFC_RESULT_ENUM result;
-    result = WFC_LowestEntropy(state, pos, &entropy);
-
-    if (result == WFC_RESULT_CONTINUE) {
-        uint32_t n = WFC_GenRandom(state) % entropy;
-        bool chosen_pattern = false;
-
-        uint8_t *output_bitmap = WFC_GetOutputBitmap(state, *pos);
-
-        for (uint32_t pat_index = 0; pat_index < state->propagator.num_patterns; pat_index++) {
-            // skip patterns that are not available for selection
-            if (output_bitmap[(pat_index / 8)] & (1 << (pat_index % 8)) == 0) {
-                continue
-            }
-
-            if (chosen_pattern) {
-                // clear all remaining patterns once we have chosen one
-                output_bitmap[(pat_index / 8)] &= ~(1 << (pat_index % 8));
-            } else {
-                uint32_t pat_count = state->propagator.patterns[pat_index].count;
-
-                if (entropy < count) {
-                    // we found our chosen pattern
-                    chosen_pattern = true;
-                    // we leave the pattern bit set here to select it
-                    break;
-                } else {
-                    // this is not our chosen pattern so clear it an remove its count
-                    output_bitmap[(pat_index / 8)] &= ~(1 << (pat_index % 8));
-                    entropy -= count;
-                }
-            }
-        }
-        // check that we did actually choose a pattern
-        assert(chosen_pattern);
-    }
-
-    return result;
-}
-
-WFC_RESULT_ENUM WFC_Propagate(WFC_State *state, WFC_Pos start_pos) {
-    assert(NULL != state);
-
-    state->queue.items[0] = start_pos;
-    state->queue.num_items = 1;
-
-    while (state->queue.num_items > 0) {
-        // pop off an item
-        state->queue.num_items--;
-        WFC_Pos cur_pos = state->queue.items[state->queue.num_items];
-
-        uint8_t *output_bitmap = WFC_GetOutputBitmap(state, cur_pos);
-
-        for (uint32_t adj_index = 0; adj_index < WFC_NUM_ADJACENT; adj_index++) {
-            WFC_Pos adjacency = gv_adjacent_offsets[adj_index];
-            WFC_Pos other_pos = WFC_OffsetFrom(pos, adjacency, state->output_width, state->output_height);
-
-            uint8_t *other_output_bitmap = WFC_GetOutputBitmap(state, other_pos);
-
-            for (uint32_t pat_index = 0; pat_index < state->propagator.num_patterns; pat_index++) {
-                // if the pattern is not currently valid, skip it
-                // TODO wrap pattern stuff in functions to avoid duplication like this
-                if (state->output[output_index + (pat_index / 8)] & (1 << (pat_index % 8)) == 0) {
-                    continue
-                }
-
-                WFC_Tile tile = state->propagator.patterns[pat_index].tile;
-
-                for (uint32_t other_pat_index = 0; other_pat_index < state->propagator.num_patterns; other_pat_index++) {
-                    // TODO what about if this pattern is 0 already?
-
-                    WFC_Tile other_tile = state->propagator.patterns[other_pat_index].tile;
-
-                    if (!WFC_TilesOverlap(tile, other_tile, adjacency)) {
-                        // TODO the tiles do not overlap, so remove other_pat_index from the other cell and
-                        // mark it as needing queueing. Then, after the loop, queue if needed
-                        // NOTE this is wrong- we need the output index of the other cell, not the current cell
-                        // this is a good argument for abstraction to avoid lots of duplicate logic
-                        //state->output[output_index + (pat_index / 8)] &= ~(1 << (pat_index % 8));
-                    }
-                }
-            }
-        }
-    }
-}
-
-WFC_RESULT_ENUM WFC_Step(WFC_State *state) {
-    assert(NULL != state);
-
-    WFC_Pos pos;
-
-    WFC_RESULT_ENUM result;
-    result = WFC_Observe(state, &pos);
-
-    if (result == WFC_RESULT_CONTINUE) {
-        WFC_Propagate(state, pos);
-    }
-
-    return result;
-}
-
-uint32_t WFC_GenRandom(WFC_State *state) {
-    state->rng = random(state->rng);
-
-    return state->rng;
-}
-
-static uint32_t random(uint32_t seed)
-{
-  seed ^= seed << 13;
-  seed ^= seed >> 17;
-  seed ^= seed << 5;
-  return seed;
-}
-
-#if defined(WFC_TEST)
-void WFC_Test(void) {
-    WFC_TestOffsetFrom();
-    WFC_TestTileOverlap();
-}
-#endif
-
-#if defined(WFC_TEST_MAIN)
-int main(int argc, char *argv[]) {
-    WFC_Test();
-
-    printf("All Tests Passed!\n");
-
-    return 0;
-}
-#endif
-
+// needed for mmap and friends when compiling with -std=c11
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <assert.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <threads.h>
+#include <time.h>
+
+#if defined(WFC_STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+// bitmap kernels are built for each x86 instruction set and chosen at runtime
+#if defined(__x86_64__) && defined(__GNUC__)
+#define WFC_BITMAP_DISPATCH
+#include <immintrin.h>
+#endif
+
+#include "log.h"
+
+#include "wfc.h"
+
+
+// words needed to create a bitmap with one bit per pattern. A model with at most 64 patterns
+// uses a single word, otherwise the bitmap is padded to WFC_BITMAP_ALIGN_WORDS.
+#define WFC_BITMAP_WORDS_NEEDED(num_patterns) \
+    (((num_patterns) <= WFC_BITMAP_WORD_BITS) ? 1 : \
+     ((((num_patterns) + (WFC_BITMAP_WORD_BITS * WFC_BITMAP_ALIGN_WORDS) - 1) / \
+       (WFC_BITMAP_WORD_BITS * WFC_BITMAP_ALIGN_WORDS)) * WFC_BITMAP_ALIGN_WORDS))
+
+// number of words needed for one bitmap per adjacency type
+#define WFC_PATTERN_WORDS_NEEDED(num_patterns, num_adjacent) (WFC_BITMAP_WORDS_NEEDED(num_patterns) * (num_adjacent))
+
+// length of the index (number of patterns times bitmap length for each pattern)
+#define WFC_INDEX_LENGTH_WORDS(num_patterns, num_adjacent) \
+    ((num_patterns) * WFC_PATTERN_WORDS_NEEDED(num_patterns, num_adjacent))
+
+#define WFC_PATTERN_INDEX(num_patterns, num_adjacent, pattern) \
+    (WFC_PATTERN_WORDS_NEEDED(num_patterns, num_adjacent) * (pattern))
+#define WFC_ADJACENT_INDEX(num_patterns, adjacent) (WFC_BITMAP_WORDS_NEEDED(num_patterns) * (adjacent))
+
+#if defined(WFC_STATS)
+// count an event in a state's statistics
+#define WFC_STATS_ADD(state, counter, amount) ((state)->stats.counter += (amount))
+#define WFC_STATS_MAX(state, counter, value) \
+    do { if ((value) > (state)->stats.counter) { (state)->stats.counter = (value); } } while (0)
+
+// time a phase, adding the cycles between BEGIN and END to a counter
+#define WFC_STATS_BEGIN(start) uint64_t start = WFC_StatsCycles()
+#define WFC_STATS_END(state, counter, start) ((state)->stats.counter += WFC_StatsCycles() - (start))
+#else
+#define WFC_STATS_ADD(state, counter, amount) ((void)0)
+#define WFC_STATS_MAX(state, counter, value) ((void)0)
+#define WFC_STATS_BEGIN(start) ((void)0)
+#define WFC_STATS_END(state, counter, start) ((void)0)
+#endif
+
+#if defined(WFC_TRACE)
+// record an event in the current trace, if one has been started
+#define WFC_TRACE_BEGIN(name) WFC_TraceEmit((name), 'B', NULL, 0)
+#define WFC_TRACE_BEGIN_ARG(name, arg_name, arg) WFC_TraceEmit((name), 'B', (arg_name), (arg))
+#define WFC_TRACE_END(name) WFC_TraceEmit((name), 'E', NULL, 0)
+#define WFC_TRACE_INSTANT(name, arg_name, arg) WFC_TraceEmit((name), 'i', (arg_name), (arg))
+#else
+#define WFC_TRACE_BEGIN(name) ((void)0)
+#define WFC_TRACE_BEGIN_ARG(name, arg_name, arg) ((void)0)
+#define WFC_TRACE_END(name) ((void)0)
+#define WFC_TRACE_INSTANT(name, arg_name, arg) ((void)0)
+#endif
+
+// fractional bits of the fixed point entropy in a pixel's heap key
+#define WFC_ENTROPY_FRACTION_BITS 28
+
+// words in the bitset of queued pixels
+#define WFC_QUEUED_WORDS(num_pixels) (((num_pixels) + WFC_BITMAP_WORD_BITS - 1) / WFC_BITMAP_WORD_BITS)
+
+// round a size up to a multiple of a power of two alignment
+#define WFC_ALIGN_UP(size, align) (((size) + (align) - 1) & ~((size_t)(align) - 1))
+
+// number of entries in a table indexed directly by a WFC_Tile, for tiles small enough for one
+#define WFC_TILE_LOOKUP_LEN (1UL << (sizeof(WFC_Tile) * 8))
+
+// shift of the cell at (x, y) of a tile
+#define WFC_CELL_SHIFT(x, y) ((WFC_PATTERN_LEN - 1 - ((x) + (y) * WFC_N)) * WFC_CELL_NUM_BITS)
+
+// Constant masks of a tile's bits, all built from WFC_N and WFC_CELL_NUM_BITS so the
+// tile routines fold down to the literal masks of the configured size. Shifts are
+// kept below the width of WFC_Tile, so every part is defined for every size.
+#define WFC_TILE_ALL ((WFC_Tile)((((WFC_Tile)1 << (WFC_TILE_BITS - 1)) << 1) - 1))
+#define WFC_ROW_ONE(row) \
+    ((WFC_Tile)((WFC_Tile)((row) < WFC_N) << (((row) < WFC_N ? (row) : 0) * WFC_ROW_BITS)))
+#define WFC_ROW_ONES \
+    ((WFC_Tile)(WFC_ROW_ONE(0) | WFC_ROW_ONE(1) | WFC_ROW_ONE(2) | WFC_ROW_ONE(3) | \
+                WFC_ROW_ONE(4) | WFC_ROW_ONE(5) | WFC_ROW_ONE(6) | WFC_ROW_ONE(7)))
+#define WFC_LEFT_COLUMN ((WFC_Tile)(((WFC_Tile)WFC_CELL_MASK << WFC_CELL_SHIFT(0, WFC_N - 1)) * WFC_ROW_ONES))
+#define WFC_RIGHT_COLUMN ((WFC_Tile)((WFC_Tile)WFC_CELL_MASK * WFC_ROW_ONES))
+#define WFC_BOTTOM_ROW ((WFC_Tile)(((WFC_Tile)1 << WFC_ROW_BITS) - 1))
+#define WFC_TOP_ROW ((WFC_Tile)(WFC_BOTTOM_ROW << ((WFC_N - 1) * WFC_ROW_BITS)))
+
+// compiled propagator file constants
+#define WFC_FILE_MAGIC 0x50434657 /* "WFCP" */
+#define WFC_FILE_BYTE_ORDER 0x01020304
+#define WFC_FILE_ALIGN 64
+#define WFC_FILE_ALIGN_OFFSET(offset) ((((offset) + WFC_FILE_ALIGN - 1) / WFC_FILE_ALIGN) * WFC_FILE_ALIGN)
+
+// returned by WFC_BitmapNext when there are no more set bits
+#define WFC_BITMAP_END 0xFFFFFFFF
+
+// the adjacency pointing the other way, relying on the clockwise order of both sets of directions
+#define WFC_OPPOSITE_ADJACENT(adjacent, num_adjacent) (((adjacent) + ((num_adjacent) / 2)) % (num_adjacent))
+
+
+const WFC_Pos gv_adjacent_offsets[WFC_NUM_ADJACENT] =
+    { [WFC_ADJACENT_UPLEFT]    = { -1, -1 }
+    , [WFC_ADJACENT_UP]        = {  0, -1 }
+    , [WFC_ADJACENT_UPRIGHT]   = {  1, -1 }
+    , [WFC_ADJACENT_RIGHT]     = {  1,  0 }
+    , [WFC_ADJACENT_DOWNRIGHT] = {  1,  1 }
+    , [WFC_ADJACENT_DOWN]      = {  0,  1 }
+    , [WFC_ADJACENT_DOWNLEFT]  = { -1,  1 }
+    , [WFC_ADJACENT_LEFT]      = { -1,  0 }
+    };
+
+// offsets of the directions of WFC_ADJACENCY_CARDINAL, also clockwise
+const WFC_Pos gv_cardinal_offsets[WFC_ADJACENCY_CARDINAL] =
+    { {  0, -1 }
+    , {  1,  0 }
+    , {  0,  1 }
+    , { -1,  0 }
+    };
+
+// the part of a tile overlapping a neighbour at an x offset of -1, 0 and 1, and likewise for y
+static const WFC_Tile gv_column_masks[3] =
+    { WFC_TILE_ALL & ~WFC_RIGHT_COLUMN
+    , WFC_TILE_ALL
+    , WFC_TILE_ALL & ~WFC_LEFT_COLUMN
+    };
+
+static const WFC_Tile gv_row_masks[3] =
+    { WFC_TILE_ALL & ~WFC_BOTTOM_ROW
+    , WFC_TILE_ALL
+    , WFC_TILE_ALL & ~WFC_TOP_ROW
+    };
+
+
+// check if 'tile' overlaps with 'other_tile', if 'other_tile' is offset by 'adjacency'.
+bool WFC_TilesOverlap(WFC_Tile tile, WFC_Tile other_tile, WFC_Pos adjacency);
+
+// helper functions to check tile overlaps
+static WFC_Tile WFC_MaskTile(WFC_Tile tile, WFC_Pos adjacency);
+static WFC_Tile WFC_ShiftTile(WFC_Tile tile, WFC_Pos adjacency);
+
+// the part of a pattern which overlaps a neighbour, used to bucket patterns when building the index
+typedef struct WFC_OverlapKey {
+    WFC_Tile key;
+    uint32_t pattern;
+} WFC_OverlapKey;
+
+static int WFC_CompareOverlapKeys(const void *first, const void *second);
+
+// slot of a tile in the table WFC_FindPatterns keeps of the patterns seen so far
+static uint32_t *WFC_PatternLookup(const WFC_Propagator *propagator, uint32_t *lookup, size_t lookup_len, WFC_Tile tile);
+
+// whether a width and height are both non-zero and their product fits in a uint32_t
+static bool WFC_SizeValid(uint32_t width, uint32_t height);
+
+// whether a state with the model and output size can be indexed with uint32_t pixel and support indices
+static bool WFC_OutputSizeValid(const WFC_Model *model, uint32_t output_width, uint32_t output_height);
+
+// set up the output bitmaps, support counts, queue and heap once the model is set
+static WFC_RESULT_ENUM WFC_StateInitOutput(WFC_State *state,
+                                           uint32_t output_width,
+                                           uint32_t output_height,
+                                           void *arena,
+                                           size_t arena_bytes);
+
+// fill in a model's initial supports and entropy once its propagator is filled in
+static WFC_RESULT_ENUM WFC_ModelInitTables(WFC_Model *model);
+
+// free a model once its last reference is released
+static void WFC_ModelDestroy(WFC_Model *model);
+
+/* Header of a compiled propagator file. Each array follows at an offset aligned to
+ * WFC_FILE_ALIGN, so the index keeps the alignment the bitmap kernels expect when the
+ * file is mapped. The file is in the native byte order, which 'byte_order' checks.
+ */
+typedef struct WFC_FileHeader {
+    uint32_t magic;
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t header_bytes;
+
+    // build parameters the propagator depends on
+    uint32_t n;
+    uint32_t cell_num_bits;
+    uint32_t num_adjacent;
+    uint32_t pattern_bytes;
+
+    uint32_t num_patterns;
+    uint32_t bitmap_words;
+
+    uint64_t patterns_offset;
+    uint64_t weights_offset;
+    uint64_t index_offset;
+    uint64_t file_bytes;
+} WFC_FileHeader;
+
+// fill in the header describing a propagator's file layout
+static void WFC_FileLayout(const WFC_Propagator *propagator, WFC_FileHeader *header);
+
+// whether a propagator mapped from a file is one the solver can safely use
+static bool WFC_PropagatorValid(const WFC_Propagator *propagator);
+
+// get a pointer to the output array's pattern bitmap for a particular pixel
+static uint64_t *WFC_GetOutputBitmap(WFC_State *state, WFC_Pos pos);
+
+// get a pointer to the index bitmap of patterns allowed next to 'pattern' in the direction 'adjacent'
+static uint64_t *WFC_GetIndexBitmap(const WFC_Propagator *propagator, uint32_t pattern, uint32_t adjacent);
+
+// the offset of each direction of an adjacency
+static const WFC_Pos *WFC_AdjacentOffsets(uint32_t num_adjacent);
+
+// allocate zeroed memory aligned for the bitmap kernels
+static void *WFC_BitmapAlloc(size_t num_words);
+
+#if defined(WFC_STATS)
+// read the cycle counter, or a nanosecond clock where there is none
+static inline uint64_t WFC_StatsCycles(void);
+#endif
+
+#if defined(WFC_TRACE)
+// write an event into the next slot of the current trace's ring buffer
+static void WFC_TraceEmit(const char *name, char phase, const char *arg_name, uint32_t arg);
+#endif
+
+// allocate and free through the allocator set by WFC_SetAllocator
+static void *WFC_AlignedAlloc(size_t size, size_t align);
+static void *WFC_Malloc(size_t size);
+static void *WFC_Calloc(size_t size);
+static void *WFC_Realloc(void *ptr, size_t old_size, size_t new_size);
+static void WFC_Free(void *ptr);
+
+static void *WFC_DefaultAlloc(size_t size, size_t align, void *user);
+static void WFC_DefaultFree(void *ptr, void *user);
+
+/* Offsets of a state's per-run buffers within the single block holding them.
+ * Each buffer starts on a cache line.
+ */
+typedef struct WFC_StateLayout {
+    size_t queue_offset;
+    size_t output_offset;
+    size_t removed_offset;
+    size_t queued_offset;
+    size_t queued_directions_offset;
+    size_t live_offset;
+    size_t edge_classes_offset;
+    size_t supports_offset;
+    size_t entropies_offset;
+    size_t heap_items_offset;
+    size_t heap_positions_offset;
+    size_t total_bytes;
+} WFC_StateLayout;
+
+static void WFC_StateLayoutInit(const WFC_Model *model,
+                                uint32_t output_width,
+                                uint32_t output_height,
+                                WFC_StateLayout *layout);
+
+// remove a pattern from a pixel, queueing the pixel so the removal is propagated
+static WFC_RESULT_ENUM WFC_Ban(WFC_State *state, uint32_t pixel_index, uint32_t pattern);
+
+// set the neighbour offsets of each edge class, and which directions have neighbours
+static void WFC_StateSetNeighbours(WFC_State *state);
+
+// remove every pattern but 'pattern', which must be valid, from a pixel at once
+static WFC_RESULT_ENUM WFC_Collapse(WFC_State *state, uint32_t pixel_index, uint32_t pattern);
+
+// find the valid pattern of a pixel whose range of counts holds 'n'
+static uint32_t WFC_ChoosePattern(WFC_State *state, uint32_t pixel_index, uint32_t n);
+
+// make room on the backtracking trail for 'num_entries' more entries
+static WFC_RESULT_ENUM WFC_TrailReserve(WFC_State *state, uint32_t num_entries);
+
+// add a pixel which is not on the propagation queue, and take the next pixel off it
+static void WFC_QueuePush(WFC_Queue *queue, uint32_t pixel_index);
+static uint32_t WFC_QueuePop(WFC_Queue *queue);
+
+// entropy heap maintenance
+static double WFC_Entropy(WFC_State *state, uint32_t pixel_index);
+static void WFC_UpdateKey(WFC_State *state, uint32_t pixel_index);
+static void WFC_HeapSiftUp(WFC_State *state, uint32_t heap_index);
+static void WFC_HeapSiftDown(WFC_State *state, uint32_t heap_index);
+static void WFC_HeapUpdate(WFC_State *state, uint32_t pixel_index);
+static void WFC_HeapRemove(WFC_State *state, uint32_t pixel_index);
+static void WFC_HeapInsert(WFC_State *state, uint32_t pixel_index);
+
+// backtracking- restore removed patterns back to a given trail length
+static void WFC_Unban(WFC_State *state, uint32_t pixel_index, uint32_t pattern);
+static void WFC_Undo(WFC_State *state, uint32_t trail_len);
+static WFC_RESULT_ENUM WFC_UndoDecision(WFC_State *state);
+
+// run attempts of a race until none are left
+static int WFC_RaceWorker(void *arg);
+
+// check whether an attempt of a race can no longer win
+typedef struct WFC_RaceContext WFC_RaceContext;
+static bool WFC_RaceCancelled(WFC_RaceContext *context, uint32_t attempt);
+
+// solve and pass on rows of chunks until the world is done
+static int WFC_ChunkWorker(void *arg);
+
+#if defined(WFC_TEST)
+// a small sequential generator for building test inputs
+static uint32_t WFC_XorShift(uint32_t seed);
+
+// fill an input with colors below 'num_colors' drawn from 'seed', returning the next seed
+static uint32_t WFC_TestNoise(uint8_t *input, uint32_t num_pixels, uint32_t seed, uint32_t num_colors);
+
+// fill a 5x5 input with noise which contradicts several times while solving a 12x12 output
+static void WFC_TestNoisyInput(uint8_t *input);
+#endif
+
+
+static inline bool WFC_BitmapGet(const uint64_t *bitmap, uint32_t bit) {
+    return (bitmap[bit / WFC_BITMAP_WORD_BITS] & (1ULL << (bit % WFC_BITMAP_WORD_BITS))) != 0;
+}
+
+static inline void WFC_BitmapSet(uint64_t *bitmap, uint32_t bit) {
+    bitmap[bit / WFC_BITMAP_WORD_BITS] |= 1ULL << (bit % WFC_BITMAP_WORD_BITS);
+}
+
+static inline void WFC_BitmapClear(uint64_t *bitmap, uint32_t bit) {
+    bitmap[bit / WFC_BITMAP_WORD_BITS] &= ~(1ULL << (bit % WFC_BITMAP_WORD_BITS));
+}
+
+/* Bitmap kernels. 'num_words' is either 1 or a multiple of WFC_BITMAP_ALIGN_WORDS and the
+ * bitmaps are aligned to WFC_BITMAP_ALIGN_BYTES, so these loops vectorize without a tail.
+ * Callers on the hot path pass a constant 1 for single word models so they reduce to
+ * a single word operation.
+ */
+
+// dst = first & second, returning whether any bit is set in the result
+static inline bool WFC_BitmapAnd(uint64_t *dst, const uint64_t *first, const uint64_t *second, uint32_t num_words) {
+    uint64_t any = 0;
+
+    for (uint32_t word_index = 0; word_index < num_words; word_index++) {
+        dst[word_index] = first[word_index] & second[word_index];
+        any |= dst[word_index];
+    }
+
+    return any != 0;
+}
+
+// dst = first & ~second, returning whether any bit is set in the result
+static inline bool WFC_BitmapAndNot(uint64_t *dst, const uint64_t *first, const uint64_t *second, uint32_t num_words) {
+    uint64_t any = 0;
+
+    for (uint32_t word_index = 0; word_index < num_words; word_index++) {
+        dst[word_index] = first[word_index] & ~second[word_index];
+        any |= dst[word_index];
+    }
+
+    return any != 0;
+}
+
+static inline uint32_t WFC_BitmapPopcount(const uint64_t *bitmap, uint32_t num_words) {
+    uint32_t count = 0;
+
+    for (uint32_t word_index = 0; word_index < num_words; word_index++) {
+        count += __builtin_popcountll(bitmap[word_index]);
+    }
+
+    return count;
+}
+
+static inline bool WFC_BitmapAny(const uint64_t *bitmap, uint32_t num_words) {
+    uint64_t any = 0;
+
+    for (uint32_t word_index = 0; word_index < num_words; word_index++) {
+        any |= bitmap[word_index];
+    }
+
+    return any != 0;
+}
+
+/** Find the first set bit at or after 'bit', or WFC_BITMAP_END if there is none.
+ * Used to iterate over set bits:
+ *   for (bit = WFC_BitmapNext(bitmap, num_words, 0); bit != WFC_BITMAP_END; bit = WFC_BitmapNext(bitmap, num_words, bit + 1))
+ */
+static inline uint32_t WFC_BitmapNext(const uint64_t *bitmap, uint32_t num_words, uint32_t bit) {
+    uint32_t word_index = bit / WFC_BITMAP_WORD_BITS;
+
+    if (word_index >= num_words) {
+        return WFC_BITMAP_END;
+    }
+
+    // mask off the bits below the starting bit in the first word
+    uint64_t word = bitmap[word_index] & (~0ULL << (bit % WFC_BITMAP_WORD_BITS));
+
+    while (word == 0) {
+        word_index++;
+        if (word_index >= num_words) {
+            return WFC_BITMAP_END;
+        }
+        word = bitmap[word_index];
+    }
+
+    return word_index * WFC_BITMAP_WORD_BITS + __builtin_ctzll(word);
+}
+
+/* The bitmap kernels above are also compiled for several x86 instruction sets, and the
+ * widest one the CPU supports is chosen the first time a model or state is built. These
+ * handle the loops over whole bitmaps: intersecting an index row with a neighbour's valid
+ * patterns during propagation, support counts and direction masks over the index rows, and
+ * filling the output when a state is reset. Bitmaps here are only word aligned, as a single
+ * word model's output bitmaps are packed one after another.
+ */
+typedef struct WFC_BitmapKernels {
+    const char *name;
+    // whether this CPU can run these kernels
+    bool (*supported)(void);
+    uint32_t (*popcount)(const uint64_t *bitmap, uint32_t num_words);
+    bool (*any)(const uint64_t *bitmap, uint32_t num_words);
+    // dst = first & second, returning whether any bit is set in the result
+    bool (*intersect)(uint64_t *dst, const uint64_t *first, const uint64_t *second, uint32_t num_words);
+    // write 'count' copies of the bitmap 'src' after each other into 'dst'
+    void (*fill)(uint64_t *dst, const uint64_t *src, uint32_t num_words, uint32_t count);
+} WFC_BitmapKernels;
+
+static bool WFC_ScalarSupported(void) {
+    return true;
+}
+
+static uint32_t WFC_ScalarPopcount(const uint64_t *bitmap, uint32_t num_words) {
+    return WFC_BitmapPopcount(bitmap, num_words);
+}
+
+static bool WFC_ScalarAny(const uint64_t *bitmap, uint32_t num_words) {
+    return WFC_BitmapAny(bitmap, num_words);
+}
+
+static bool WFC_ScalarIntersect(uint64_t *dst, const uint64_t *first, const uint64_t *second, uint32_t num_words) {
+    return WFC_BitmapAnd(dst, first, second, num_words);
+}
+
+static void WFC_ScalarFill(uint64_t *dst, const uint64_t *src, uint32_t num_words, uint32_t count) {
+    for (size_t copy_index = 0; copy_index < count; copy_index++) {
+        memcpy(&dst[copy_index * num_words], src, num_words * sizeof(uint64_t));
+    }
+}
+
+#if defined(WFC_BITMAP_DISPATCH)
+static bool WFC_SSE2Supported(void) {
+    return __builtin_cpu_supports("sse2");
+}
+
+// SSE2 has no popcount instruction, so bits are summed within each byte and the bytes summed with psadbw
+__attribute__((target("sse2")))
+static uint32_t WFC_SSE2Popcount(const uint64_t *bitmap, uint32_t num_words) {
+    const __m128i ones = _mm_set1_epi8(0x55);
+    const __m128i twos = _mm_set1_epi8(0x33);
+    const __m128i fours = _mm_set1_epi8(0x0F);
+    __m128i sums = _mm_setzero_si128();
+
+    uint32_t word_index = 0;
+    for (; word_index + 2 <= num_words; word_index += 2) {
+        __m128i bits = _mm_loadu_si128((const __m128i*)&bitmap[word_index]);
+        bits = _mm_sub_epi8(bits, _mm_and_si128(_mm_srli_epi16(bits, 1), ones));
+        bits = _mm_add_epi8(_mm_and_si128(bits, twos), _mm_and_si128(_mm_srli_epi16(bits, 2), twos));
+        bits = _mm_and_si128(_mm_add_epi8(bits, _mm_srli_epi16(bits, 4)), fours);
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(bits, _mm_setzero_si128()));
+    }
+
+    uint32_t count = (uint32_t)(_mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums)));
+    for (; word_index < num_words; word_index++) {
+        count += __builtin_popcountll(bitmap[word_index]);
+    }
+
+    return count;
+}
+
+__attribute__((target("sse2")))
+static bool WFC_SSE2Any(const uint64_t *bitmap, uint32_t num_words) {
+    __m128i any = _mm_setzero_si128();
+
+    uint32_t word_index = 0;
+    for (; word_index + 2 <= num_words; word_index += 2) {
+        any = _mm_or_si128(any, _mm_loadu_si128((const __m128i*)&bitmap[word_index]));
+    }
+
+    uint64_t tail = 0;
+    for (; word_index < num_words; word_index++) {
+        tail |= bitmap[word_index];
+    }
+
+    return (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128()))) || (0 != tail);
+}
+
+__attribute__((target("sse2")))
+static bool WFC_SSE2Intersect(uint64_t *dst, const uint64_t *first, const uint64_t *second, uint32_t num_words) {
+    __m128i any = _mm_setzero_si128();
+
+    uint32_t word_index = 0;
+    for (; word_index + 2 <= num_words; word_index += 2) {
+        __m128i words = _mm_and_si128(_mm_loadu_si128((const __m128i*)&first[word_index]),
+                                      _mm_loadu_si128((const __m128i*)&second[word_index]));
+        _mm_storeu_si128((__m128i*)&dst[word_index], words);
+        any = _mm_or_si128(any, words);
+    }
+
+    uint64_t tail = 0;
+    for (; word_index < num_words; word_index++) {
+        dst[word_index] = first[word_index] & second[word_index];
+        tail |= dst[word_index];
+    }
+
+    return (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128()))) || (0 != tail);
+}
+
+__attribute__((target("sse2")))
+static void WFC_SSE2Fill(uint64_t *dst, const uint64_t *src, uint32_t num_words, uint32_t count) {
+    if (1 == num_words) {
+        const __m128i word = _mm_set1_epi64x((long long)src[0]);
+
+        size_t word_index = 0;
+        for (; word_index + 2 <= count; word_index += 2) {
+            _mm_storeu_si128((__m128i*)&dst[word_index], word);
+        }
+        for (; word_index < count; word_index++) {
+            dst[word_index] = src[0];
+        }
+    } else {
+        // wider bitmaps are a whole number of vectors
+        for (size_t copy_index = 0; copy_index < count; copy_index++) {
+            uint64_t *copy = &dst[copy_index * num_words];
+            for (uint32_t word_index = 0; word_index < num_words; word_index += 2) {
+                _mm_storeu_si128((__m128i*)&copy[word_index], _mm_loadu_si128((const __m128i*)&src[word_index]));
+            }
+        }
+    }
+}
+
+static bool WFC_AVX2Supported(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+// count the bits of each nibble with a byte shuffle, then sum the bytes with vpsadbw
+__attribute__((target("avx2")))
+static uint32_t WFC_AVX2Popcount(const uint64_t *bitmap, uint32_t num_words) {
+    const __m256i nibble_counts = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                   0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+    __m256i sums = _mm256_setzero_si256();
+
+    uint32_t word_index = 0;
+    for (; word_index + 4 <= num_words; word_index += 4) {
+        __m256i bits = _mm256_loadu_si256((const __m256i*)&bitmap[word_index]);
+        __m256i low = _mm256_shuffle_epi8(nibble_counts, _mm256_and_si256(bits, nibble_mask));
+        __m256i high = _mm256_shuffle_epi8(nibble_counts, _mm256_and_si256(_mm256_srli_epi16(bits, 4), nibble_mask));
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256()));
+    }
+
+    uint32_t count = (uint32_t)(_mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                                _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3));
+    for (; word_index < num_words; word_index++) {
+        count += __builtin_popcountll(bitmap[word_index]);
+    }
+
+    return count;
+}
+
+__attribute__((target("avx2")))
+static bool WFC_AVX2Any(const uint64_t *bitmap, uint32_t num_words) {
+    __m256i any = _mm256_setzero_si256();
+
+    uint32_t word_index = 0;
+    for (; word_index + 4 <= num_words; word_index += 4) {
+        any = _mm256_or_si256(any, _mm256_loadu_si256((const __m256i*)&bitmap[word_index]));
+    }
+
+    uint64_t tail = 0;
+    for (; word_index < num_words; word_index++) {
+        tail |= bitmap[word_index];
+    }
+
+    return !_mm256_testz_si256(any, any) || (0 != tail);
+}
+
+__attribute__((target("avx2")))
+static bool WFC_AVX2Intersect(uint64_t *dst, const uint64_t *first, const uint64_t *second, uint32_t num_words) {
+    __m256i any = _mm256_setzero_si256();
+
+    uint32_t word_index = 0;
+    for (; word_index + 4 <= num_words; word_index += 4) {
+        __m256i words = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)&first[word_index]),
+                                         _mm256_loadu_si256((const __m256i*)&second[word_index]));
+        _mm256_storeu_si256((__m256i*)&dst[word_index], words);
+        any = _mm256_or_si256(any, words);
+    }
+
+    uint64_t tail = 0;
+    for (; word_index < num_words; word_index++) {
+        dst[word_index] = first[word_index] & second[word_index];
+        tail |= dst[word_index];
+    }
+
+    return !_mm256_testz_si256(any, any) || (0 != tail);
+}
+
+__attribute__((target("avx2")))
+static void WFC_AVX2Fill(uint64_t *dst, const uint64_t *src, uint32_t num_words, uint32_t count) {
+    if (1 == num_words) {
+        const __m256i word = _mm256_set1_epi64x((long long)src[0]);
+
+        size_t word_index = 0;
+        for (; word_index + 4 <= count; word_index += 4) {
+            _mm256_storeu_si256((__m256i*)&dst[word_index], word);
+        }
+        for (; word_index < count; word_index++) {
+            dst[word_index] = src[0];
+        }
+    } else {
+        for (size_t copy_index = 0; copy_index < count; copy_index++) {
+            uint64_t *copy = &dst[copy_index * num_words];
+            for (uint32_t word_index = 0; word_index < num_words; word_index += 4) {
+                _mm256_storeu_si256((__m256i*)&copy[word_index], _mm256_loadu_si256((const __m256i*)&src[word_index]));
+            }
+        }
+    }
+}
+
+static bool WFC_AVX512Supported(void) {
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+// as the AVX2 kernels, with the words left over from a whole vector handled by masked loads and stores
+__attribute__((target("avx512f,avx512bw")))
+static uint32_t WFC_AVX512Popcount(const uint64_t *bitmap, uint32_t num_words) {
+    const __m512i nibble_counts = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m512i nibble_mask = _mm512_set1_epi8(0x0F);
+    __m512i sums = _mm512_setzero_si512();
+
+    for (uint32_t word_index = 0; word_index < num_words; word_index += 8) {
+        __mmask8 mask = (num_words - word_index >= 8) ? 0xFF : (__mmask8)((1U << (num_words - word_index)) - 1);
+        __m512i bits = _mm512_maskz_loadu_epi64(mask, &bitmap[word_index]);
+        __m512i low = _mm512_shuffle_epi8(nibble_counts, _mm512_and_si512(bits, nibble_mask));
+        __m512i high = _mm512_shuffle_epi8(nibble_counts, _mm512_and_si512(_mm512_srli_epi16(bits, 4), nibble_mask));
+        sums = _mm512_add_epi64(sums, _mm512_sad_epu8(_mm512_add_epi8(low, high), _mm512_setzero_si512()));
+    }
+
+    return (uint32_t)_mm512_reduce_add_epi64(sums);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static bool WFC_AVX512Any(const uint64_t *bitmap, uint32_t num_words) {
+    __m512i any = _mm512_setzero_si512();
+
+    for (uint32_t word_index = 0; word_index < num_words; word_index += 8) {
+        __mmask8 mask = (num_words - word_index >= 8) ? 0xFF : (__mmask8)((1U << (num_words - word_index)) - 1);
+        any = _mm512_or_si512(any, _mm512_maskz_loadu_epi64(mask, &bitmap[word_index]));
+    }
+
+    return 0 != _mm512_test_epi64_mask(any, any);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static bool WFC_AVX512Intersect(uint64_t *dst, const uint64_t *first, const uint64_t *second, uint32_t num_words) {
+    __m512i any = _mm512_setzero_si512();
+
+    for (uint32_t word_index = 0; word_index < num_words; word_index += 8) {
+        __mmask8 mask = (num_words - word_index >= 8) ? 0xFF : (__mmask8)((1U << (num_words - word_index)) - 1);
+        __m512i words = _mm512_and_si512(_mm512_maskz_loadu_epi64(mask, &first[word_index]),
+                                         _mm512_maskz_loadu_epi64(mask, &second[word_index]));
+        _mm512_mask_storeu_epi64(&dst[word_index], mask, words);
+        any = _mm512_or_si512(any, words);
+    }
+
+    return 0 != _mm512_test_epi64_mask(any, any);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void WFC_AVX512Fill(uint64_t *dst, const uint64_t *src, uint32_t num_words, uint32_t count) {
+    if (1 == num_words) {
+        const __m512i word = _mm512_set1_epi64((long long)src[0]);
+
+        for (size_t word_index = 0; word_index < count; word_index += 8) {
+            __mmask8 mask = (count - word_index >= 8) ? 0xFF : (__mmask8)((1U << (count - word_index)) - 1);
+            _mm512_mask_storeu_epi64(&dst[word_index], mask, word);
+        }
+    } else {
+        for (size_t copy_index = 0; copy_index < count; copy_index++) {
+            uint64_t *copy = &dst[copy_index * num_words];
+            for (uint32_t word_index = 0; word_index < num_words; word_index += 8) {
+                __mmask8 mask = (num_words - word_index >= 8) ? 0xFF : (__mmask8)((1U << (num_words - word_index)) - 1);
+                _mm512_mask_storeu_epi64(&copy[word_index], mask, _mm512_maskz_loadu_epi64(mask, &src[word_index]));
+            }
+        }
+    }
+}
+#endif
+
+// every variant built for this target, widest first. The scalar kernels are always last.
+static const WFC_BitmapKernels gv_bitmap_kernel_variants[] = {
+#if defined(WFC_BITMAP_DISPATCH)
+    { "avx512", WFC_AVX512Supported, WFC_AVX512Popcount, WFC_AVX512Any, WFC_AVX512Intersect, WFC_AVX512Fill },
+    { "avx2", WFC_AVX2Supported, WFC_AVX2Popcount, WFC_AVX2Any, WFC_AVX2Intersect, WFC_AVX2Fill },
+    { "sse2", WFC_SSE2Supported, WFC_SSE2Popcount, WFC_SSE2Any, WFC_SSE2Intersect, WFC_SSE2Fill },
+#endif
+    { "scalar", WFC_ScalarSupported, WFC_ScalarPopcount, WFC_ScalarAny, WFC_ScalarIntersect, WFC_ScalarFill },
+};
+#define WFC_NUM_BITMAP_KERNELS (sizeof(gv_bitmap_kernel_variants) / sizeof(gv_bitmap_kernel_variants[0]))
+
+// may be switched by WFC_UseBitmapKernels while other threads are solving
+static _Atomic(const WFC_BitmapKernels*) gv_bitmap_kernels = NULL;
+static once_flag gv_bitmap_kernels_once = ONCE_FLAG_INIT;
+
+static void WFC_SelectBitmapKernels(void) {
+#if defined(WFC_BITMAP_DISPATCH)
+    __builtin_cpu_init();
+#endif
+
+    for (uint32_t kernels_index = 0; kernels_index < WFC_NUM_BITMAP_KERNELS; kernels_index++) {
+        if (gv_bitmap_kernel_variants[kernels_index].supported()) {
+            atomic_store(&gv_bitmap_kernels, &gv_bitmap_kernel_variants[kernels_index]);
+            break;
+        }
+    }
+
+    log_trace("WFC using %s bitmap kernels", atomic_load(&gv_bitmap_kernels)->name);
+}
+
+static const WFC_BitmapKernels *WFC_GetBitmapKernels(void) {
+    call_once(&gv_bitmap_kernels_once, WFC_SelectBitmapKernels);
+    return atomic_load_explicit(&gv_bitmap_kernels, memory_order_acquire);
+}
+
+const char *WFC_BitmapKernelsName(void) {
+    return WFC_GetBitmapKernels()->name;
+}
+
+WFC_RESULT_ENUM WFC_UseBitmapKernels(const char *name) {
+    WFC_GetBitmapKernels();
+
+    for (uint32_t kernels_index = 0; kernels_index < WFC_NUM_BITMAP_KERNELS; kernels_index++) {
+        const WFC_BitmapKernels *kernels = &gv_bitmap_kernel_variants[kernels_index];
+
+        if ((NULL != name) && (0 == strcmp(name, kernels->name))) {
+            if (!kernels->supported()) {
+                return WFC_RESULT_ERROR;
+            }
+
+            atomic_store_explicit(&gv_bitmap_kernels, kernels, memory_order_release);
+            return WFC_RESULT_OKAY;
+        }
+    }
+
+    return WFC_RESULT_ERROR;
+}
+
+void *WFC_DefaultAlloc(size_t size, size_t align, void *user) {
+    // aligned_alloc requires the size to be a multiple of the alignment
+    return aligned_alloc(align, WFC_ALIGN_UP(size, align));
+}
+
+void WFC_DefaultFree(void *ptr, void *user) {
+    free(ptr);
+}
+
+static WFC_Allocator gv_allocator = { WFC_DefaultAlloc, WFC_DefaultFree, NULL };
+
+void WFC_SetAllocator(const WFC_Allocator *allocator) {
+    if (NULL == allocator) {
+        gv_allocator = (WFC_Allocator){ WFC_DefaultAlloc, WFC_DefaultFree, NULL };
+    } else {
+        gv_allocator = *allocator;
+    }
+}
+
+void *WFC_AlignedAlloc(size_t size, size_t align) {
+    return gv_allocator.alloc((0 == size) ? 1 : size, align, gv_allocator.user);
+}
+
+void *WFC_Malloc(size_t size) {
+    return WFC_AlignedAlloc(size, _Alignof(max_align_t));
+}
+
+void *WFC_Calloc(size_t size) {
+    void *ptr = WFC_Malloc(size);
+
+    if (NULL != ptr) {
+        memset(ptr, 0, size);
+    }
+
+    return ptr;
+}
+
+void *WFC_Realloc(void *ptr, size_t old_size, size_t new_size) {
+    void *new_ptr = WFC_Malloc(new_size);
+
+    // the old block is kept if the new one cannot be allocated
+    if (NULL != new_ptr) {
+        memcpy(new_ptr, ptr, (old_size < new_size) ? old_size : new_size);
+        WFC_Free(ptr);
+    }
+
+    return new_ptr;
+}
+
+void WFC_Free(void *ptr) {
+    if (NULL != ptr) {
+        gv_allocator.free(ptr, gv_allocator.user);
+    }
+}
+
+void *WFC_BitmapAlloc(size_t num_words) {
+    size_t num_bytes = num_words * sizeof(uint64_t);
+    void *bitmap = WFC_AlignedAlloc(num_bytes, WFC_BITMAP_ALIGN_BYTES);
+
+    if (NULL != bitmap) {
+        memset(bitmap, 0, num_bytes);
+    }
+
+    return bitmap;
+}
+
+#if defined(WFC_STATS)
+uint64_t WFC_StatsCycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+#endif
+
+#if defined(WFC_TRACE)
+// the trace being recorded into, or NULL
+static _Atomic(WFC_Trace*) gv_trace = NULL;
+
+// ids handed out to threads the first time they record an event
+static atomic_uint gv_trace_num_threads = 0;
+static _Thread_local uint32_t tv_trace_thread = 0;
+
+static uint64_t WFC_TraceNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+WFC_RESULT_ENUM WFC_TraceStart(WFC_Trace *trace, WFC_TraceEvent *events, uint32_t max_events) {
+    if ((NULL == trace) || (NULL == events) || (0 == max_events)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    trace->events = events;
+    trace->max_events = max_events;
+    atomic_init(&trace->num_events, 0);
+    for (uint32_t event_index = 0; event_index < max_events; event_index++) {
+        atomic_init(&events[event_index].sequence, 0);
+    }
+    trace->start_ns = WFC_TraceNow();
+
+    atomic_store_explicit(&gv_trace, trace, memory_order_release);
+
+    return WFC_RESULT_OKAY;
+}
+
+void WFC_TraceStop(void) {
+    atomic_store_explicit(&gv_trace, NULL, memory_order_release);
+}
+
+void WFC_TraceEmit(const char *name, char phase, const char *arg_name, uint32_t arg) {
+    WFC_Trace *trace = atomic_load_explicit(&gv_trace, memory_order_acquire);
+
+    if (NULL == trace) {
+        return;
+    }
+
+    if (0 == tv_trace_thread) {
+        tv_trace_thread = atomic_fetch_add_explicit(&gv_trace_num_threads, 1, memory_order_relaxed) + 1;
+    }
+
+    // each event claims its own slot, so threads never write the same one until the buffer wraps
+    uint64_t event_index = atomic_fetch_add_explicit(&trace->num_events, 1, memory_order_relaxed);
+    WFC_TraceEvent *event = &trace->events[event_index % trace->max_events];
+
+    // Once it wraps, the slot's sequence marks it as being written, so a thread still writing
+    // an older event there is never interleaved with. This event is dropped instead.
+    const uint64_t written = 2 * (event_index + 1);
+    uint64_t sequence = atomic_load_explicit(&event->sequence, memory_order_relaxed);
+    if ((0 != (sequence & 1)) || (sequence >= written) ||
+        !atomic_compare_exchange_strong_explicit(&event->sequence, &sequence, written - 1,
+                                                 memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+
+    event->time_ns = WFC_TraceNow() - trace->start_ns;
+    event->name = name;
+    event->arg_name = arg_name;
+    event->arg = arg;
+    event->thread = tv_trace_thread;
+    event->phase = phase;
+
+    atomic_store_explicit(&event->sequence, written, memory_order_release);
+}
+
+/** Copy an event out of a trace's buffer, returning false if its slot was not written,
+ * is being written, or holds another event by the time the copy is made.
+ */
+static bool WFC_TraceRead(const WFC_Trace *trace, uint64_t event_index, WFC_TraceEvent *copy) {
+    WFC_TraceEvent *event = &trace->events[event_index % trace->max_events];
+    const uint64_t written = 2 * (event_index + 1);
+
+    if (written != atomic_load_explicit(&event->sequence, memory_order_acquire)) {
+        return false;
+    }
+
+    copy->time_ns = event->time_ns;
+    copy->name = event->name;
+    copy->arg_name = event->arg_name;
+    copy->arg = event->arg;
+    copy->thread = event->thread;
+    copy->phase = event->phase;
+
+    atomic_thread_fence(memory_order_acquire);
+    return written == atomic_load_explicit(&event->sequence, memory_order_relaxed);
+}
+
+WFC_RESULT_ENUM WFC_TraceSave(const WFC_Trace *trace, const char *path) {
+    if ((NULL == trace) || (NULL == path)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    FILE *file = fopen(path, "w");
+    if (NULL == file) {
+        return WFC_RESULT_ERROR;
+    }
+
+    uint64_t num_events = atomic_load_explicit(&trace->num_events, memory_order_acquire);
+    uint64_t first_event = (num_events > trace->max_events) ? num_events - trace->max_events : 0;
+
+    fprintf(file, "{\"traceEvents\":[");
+
+    bool first = true;
+    for (uint64_t event_index = first_event; event_index < num_events; event_index++) {
+        WFC_TraceEvent event;
+        if (!WFC_TraceRead(trace, event_index, &event)) {
+            continue;
+        }
+
+        // Chrome traces are in microseconds
+        fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u",
+                first ? "" : ",",
+                event.name, event.phase, event.time_ns / 1000.0, event.thread);
+        first = false;
+
+        if ('i' == event.phase) {
+            fprintf(file, ",\"s\":\"t\"");
+        }
+
+        if (NULL != event.arg_name) {
+            fprintf(file, ",\"args\":{\"%s\":%u}", event.arg_name, event.arg);
+        }
+
+        fprintf(file, "}");
+    }
+
+    fprintf(file, "\n]}\n");
+
+    return (0 == fclose(file)) ? WFC_RESULT_OKAY : WFC_RESULT_ERROR;
+}
+#endif
+
+#if defined(WFC_TEST)
+// a 4x4 input of nested rings which most tests build their models from. Its 3x3 patterns
+// only tile outputs whose sizes are multiples of 4, so the solving tests use those.
+static const uint8_t gv_test_rings[4 * 4] =
+    { 0, 0, 0, 0
+    , 0, 1, 1, 1
+    , 0, 1, 2, 1
+    , 0, 1, 1, 1
+    };
+
+uint32_t WFC_TestNoise(uint8_t *input, uint32_t num_pixels, uint32_t seed, uint32_t num_colors) {
+    for (uint32_t input_index = 0; input_index < num_pixels; input_index++) {
+        seed = WFC_XorShift(seed);
+        input[input_index] = seed % num_colors;
+    }
+
+    return seed;
+}
+
+void WFC_TestNoisyInput(uint8_t *input) {
+    // larger patterns are more constrained, so they need fewer colors to leave a choice
+#if WFC_N == 2
+    WFC_TestNoise(input, 5 * 5, 23757, 4);
+#else
+    WFC_TestNoise(input, 5 * 5, 22932, 2);
+#endif
+}
+
+void WFC_TestBitmapKernels(void) {
+    // up to 64 patterns fit in one word, beyond that bitmaps are padded
+    assert(WFC_BITMAP_WORDS_NEEDED(1) == 1);
+    assert(WFC_BITMAP_WORDS_NEEDED(64) == 1);
+    assert(WFC_BITMAP_WORDS_NEEDED(65) == WFC_BITMAP_ALIGN_WORDS);
+
+    const uint32_t num_words = WFC_BITMAP_WORDS_NEEDED(130);
+    assert(num_words == WFC_BITMAP_ALIGN_WORDS);
+
+    uint64_t *first = (uint64_t*)WFC_BitmapAlloc(num_words);
+    uint64_t *second = (uint64_t*)WFC_BitmapAlloc(num_words);
+    uint64_t *result = (uint64_t*)WFC_BitmapAlloc(num_words);
+    assert(((uintptr_t)first % WFC_BITMAP_ALIGN_BYTES) == 0);
+
+    assert(!WFC_BitmapAny(first, num_words));
+    assert(WFC_BITMAP_END == WFC_BitmapNext(first, num_words, 0));
+
+    WFC_BitmapSet(first, 0);
+    WFC_BitmapSet(first, 63);
+    WFC_BitmapSet(first, 64);
+    WFC_BitmapSet(first, 129);
+    WFC_BitmapSet(second, 63);
+    WFC_BitmapSet(second, 129);
+
+    assert(WFC_BitmapPopcount(first, num_words) == 4);
+    assert(WFC_BitmapNext(first, num_words, 0) == 0);
+    assert(WFC_BitmapNext(first, num_words, 1) == 63);
+    assert(WFC_BitmapNext(first, num_words, 64) == 64);
+    assert(WFC_BitmapNext(first, num_words, 65) == 129);
+    assert(WFC_BitmapNext(first, num_words, 130) == WFC_BITMAP_END);
+
+    assert(WFC_BitmapAnd(result, first, second, num_words));
+    assert(WFC_BitmapPopcount(result, num_words) == 2);
+    assert(WFC_BitmapGet(result, 63) && WFC_BitmapGet(result, 129));
+
+    assert(WFC_BitmapAndNot(result, first, second, num_words));
+    assert(WFC_BitmapPopcount(result, num_words) == 2);
+    assert(WFC_BitmapGet(result, 0) && WFC_BitmapGet(result, 64));
+
+    WFC_BitmapClear(first, 0);
+    WFC_BitmapClear(first, 64);
+    assert(!WFC_BitmapAndNot(result, first, second, num_words));
+
+    WFC_Free(first);
+    WFC_Free(second);
+    WFC_Free(result);
+}
+
+// solve a few steps with the bitmap kernels in use, leaving the state to compare
+static WFC_RESULT_ENUM WFC_TestDispatchSolve(WFC_State *state, const uint8_t *input, uint32_t input_size) {
+    assert(WFC_RESULT_OKAY == WFC_StateInit(state, input_size, input_size, input, 12, 8));
+    assert(WFC_RESULT_OKAY == WFC_StateSetSeed(state, 17));
+
+    WFC_RESULT_ENUM result = WFC_RESULT_CONTINUE;
+    for (uint32_t step = 0; (WFC_RESULT_CONTINUE == result) && (step < 16); step++) {
+        result = WFC_Step(state);
+    }
+
+    return result;
+}
+
+void WFC_TestBitmapDispatch(void) {
+    const char *selected = WFC_BitmapKernelsName();
+    assert(WFC_RESULT_ERROR == WFC_UseBitmapKernels("mmx"));
+    assert(WFC_RESULT_ERROR == WFC_UseBitmapKernels(NULL));
+
+    // every variant this CPU runs agrees with the scalar kernels, at each bitmap width in use
+    const uint32_t widths[] = { 1, 4, 8, 12, 16 };
+    const uint32_t max_copies = 7;
+    uint64_t source[16];
+    uint64_t mask[16];
+    uint64_t expected[16 * 7 + 1];
+    uint64_t filled[16 * 7 + 1];
+    uint32_t seed = 5711;
+
+    for (uint32_t kernels_index = 0; kernels_index < WFC_NUM_BITMAP_KERNELS; kernels_index++) {
+        const WFC_BitmapKernels *kernels = &gv_bitmap_kernel_variants[kernels_index];
+        if (!kernels->supported()) {
+            continue;
+        }
+
+        for (uint32_t width_index = 0; width_index < sizeof(widths) / sizeof(widths[0]); width_index++) {
+            const uint32_t num_words = widths[width_index];
+
+            for (uint32_t trial = 0; trial < 16; trial++) {
+                for (uint32_t word_index = 0; word_index < num_words; word_index++) {
+                    seed = WFC_XorShift(seed);
+                    uint64_t word = ((uint64_t)seed << 32);
+                    seed = WFC_XorShift(seed);
+                    word |= seed;
+
+                    // include empty bitmaps, full ones, and ones with only their last bit set
+                    if (0 == trial) {
+                        word = 0;
+                    } else if (1 == trial) {
+                        word = ~0ULL;
+                    } else if (2 == trial) {
+                        word = (word_index == num_words - 1) ? (1ULL << 63) : 0;
+                    }
+                    source[word_index] = word;
+                }
+
+                assert(kernels->popcount(source, num_words) == WFC_BitmapPopcount(source, num_words));
+                assert(kernels->any(source, num_words) == WFC_BitmapAny(source, num_words));
+
+                // intersect with a bitmap overlapping the source, and with one covering it
+                for (uint32_t mask_index = 0; mask_index < 2; mask_index++) {
+                    for (uint32_t word_index = 0; word_index < num_words; word_index++) {
+                        mask[word_index] = (0 == mask_index) ? (source[word_index] ^ (source[word_index] << 1)) : ~0ULL;
+                    }
+
+                    memset(expected, 0xA5, sizeof(expected));
+                    memset(filled, 0xA5, sizeof(filled));
+                    bool expected_any = WFC_BitmapAnd(expected, source, mask, num_words);
+                    assert(expected_any == kernels->intersect(filled, source, mask, num_words));
+                    assert(0 == memcmp(expected, filled, sizeof(filled)));
+                }
+
+                for (uint32_t num_copies = 0; num_copies <= max_copies; num_copies++) {
+                    memset(expected, 0xA5, sizeof(expected));
+                    memset(filled, 0xA5, sizeof(filled));
+
+                    WFC_ScalarFill(expected, source, num_words, num_copies);
+                    kernels->fill(filled, source, num_words, num_copies);
+                    assert(0 == memcmp(expected, filled, sizeof(filled)));
+                }
+            }
+        }
+    }
+
+    // and states built and solved with each variant are bit identical, both for a model
+    // with single word bitmaps and for one with padded bitmaps
+    uint8_t noise[16 * 16];
+    seed = WFC_TestNoise(noise, sizeof(noise), seed, 8);
+
+    const uint8_t *inputs[] = { gv_test_rings, noise };
+    const uint32_t input_sizes[] = { 4, 16 };
+
+    for (uint32_t input_index = 0; input_index < 2; input_index++) {
+        WFC_State reference = {0};
+        assert(WFC_RESULT_OKAY == WFC_UseBitmapKernels("scalar"));
+        WFC_RESULT_ENUM reference_result = WFC_TestDispatchSolve(&reference, inputs[input_index], input_sizes[input_index]);
+
+        const WFC_Model *model = reference.model;
+        const uint32_t num_pixels = reference.output_width * reference.output_height;
+        const size_t bitmaps_bytes = sizeof(uint64_t) * model->propagator.bitmap_words * num_pixels;
+        const size_t supports_bytes =
+            sizeof(WFC_Support) * model->propagator.num_patterns * model->propagator.num_adjacent * num_pixels;
+        assert((model->propagator.bitmap_words == 1) == (0 == input_index));
+
+        for (uint32_t kernels_index = 0; kernels_index < WFC_NUM_BITMAP_KERNELS; kernels_index++) {
+            const WFC_BitmapKernels *kernels = &gv_bitmap_kernel_variants[kernels_index];
+            if (!kernels->supported()) {
+                continue;
+            }
+
+            WFC_State state = {0};
+            assert(WFC_RESULT_OKAY == WFC_UseBitmapKernels(kernels->name));
+            assert(0 == strcmp(kernels->name, WFC_BitmapKernelsName()));
+            assert(reference_result == WFC_TestDispatchSolve(&state, inputs[input_index], input_sizes[input_index]));
+
+            assert(0 == memcmp(model->initial_supports, state.model->initial_supports,
+                               sizeof(WFC_Support) * model->propagator.num_patterns * model->propagator.num_adjacent));
+            assert(0 == memcmp(model->pattern_directions, state.model->pattern_directions, model->propagator.num_patterns));
+            assert(0 == memcmp(reference.output, state.output, bitmaps_bytes));
+            assert(0 == memcmp(reference.supports, state.supports, supports_bytes));
+            for (uint32_t pix_index = 0; pix_index < num_pixels; pix_index++) {
+                assert(reference.entropies[pix_index].key == state.entropies[pix_index].key);
+            }
+
+            WFC_StateDestroy(&state);
+        }
+
+        WFC_StateDestroy(&reference);
+    }
+
+    assert(WFC_RESULT_OKAY == WFC_UseBitmapKernels(selected));
+}
+#endif
+
+
+WFC_RESULT_ENUM WFC_ModelCreate(WFC_Model **model_out,
+                                uint32_t input_width,
+                                uint32_t input_height,
+                                const uint8_t *input) {
+    return WFC_ModelCreateWithAdjacency(model_out, input_width, input_height, input, WFC_ADJACENCY_ALL);
+}
+
+WFC_RESULT_ENUM WFC_ModelCreateWithAdjacency(WFC_Model **model_out,
+                                             uint32_t input_width,
+                                             uint32_t input_height,
+                                             const uint8_t *input,
+                                             WFC_ADJACENCY_ENUM adjacency) {
+    WFC_RESULT_ENUM result = WFC_RESULT_OKAY;
+    WFC_Model *model = NULL;
+
+    WFC_TRACE_BEGIN("model_create");
+
+    if ((NULL == model_out) || (NULL == input) || !WFC_SizeValid(input_width, input_height) ||
+        ((WFC_ADJACENCY_ALL != adjacency) && (WFC_ADJACENCY_CARDINAL != adjacency))) {
+        result = WFC_RESULT_ERROR;
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        log_trace("WFC checking input");
+        // check that input does not contain values larger than WFC_CELL_MASK, which do not fit in a cell
+        for (uint32_t input_index = 0; input_index < input_width * input_height; input_index++) {
+            if ((input[input_index] & (~WFC_CELL_MASK)) != 0) {
+                result = WFC_RESULT_ERROR;
+                break;
+            }
+        }
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        model = (WFC_Model*)WFC_Calloc(sizeof(WFC_Model));
+
+        if (NULL == model) {
+            result = WFC_RESULT_ERROR;
+        } else {
+            atomic_init(&model->ref_count, 1);
+        }
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        log_trace("WFC initializing model");
+        // copy input buffer to ensure we can clean up at the end
+        uint32_t input_size_bytes = input_width * input_height;
+
+        uint8_t *input_copy = (uint8_t*)WFC_Malloc(input_size_bytes);
+
+        if (NULL == input_copy) {
+            result = WFC_RESULT_ERROR;
+        } else {
+            memcpy(input_copy, input, input_size_bytes);
+            model->input = input_copy;
+            model->input_width = input_width;
+            model->input_height = input_height;
+        }
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        log_trace("WFC finding patterns");
+        // collect patterns from input into a table
+        WFC_TRACE_BEGIN("find_patterns");
+        result = WFC_FindPatterns(model);
+        WFC_TRACE_END("find_patterns");
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        // support counts are stored in a WFC_Support, which must be able to
+        // hold the number of patterns.
+        if (model->propagator.num_patterns > UINT16_MAX) {
+            result = WFC_RESULT_ERROR;
+        }
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        log_trace("WFC allocating index");
+        model->propagator.num_adjacent = adjacency;
+        model->propagator.bitmap_words = WFC_BITMAP_WORDS_NEEDED(model->propagator.num_patterns);
+        log_trace("Bitmap length %d words", model->propagator.bitmap_words);
+
+        // create the index (table of adjacent patterns for each pattern)
+        uint64_t *index = (uint64_t*)WFC_BitmapAlloc(
+            WFC_INDEX_LENGTH_WORDS(model->propagator.num_patterns, model->propagator.num_adjacent));
+
+        if (NULL == index) {
+            result = WFC_RESULT_ERROR;
+        } else {
+            model->propagator.index = index;
+        }
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        log_trace("WFC initializing index");
+        // fill the index with the discovered patterns and their adjacency information
+        WFC_TRACE_BEGIN("index_init");
+        result = WFC_IndexInit(model);
+        WFC_TRACE_END("index_init");
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        log_trace("WFC calculating pattern weights");
+        const uint32_t num_patterns = model->propagator.num_patterns;
+
+        model->propagator.weight_log_weights = (double*)WFC_Malloc(sizeof(double) * num_patterns);
+
+        if (NULL == model->propagator.weight_log_weights) {
+            result = WFC_RESULT_ERROR;
+        } else {
+            for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
+                double weight = model->propagator.patterns[pat_index].count;
+
+                model->propagator.weight_log_weights[pat_index] = weight * log(weight);
+            }
+        }
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        WFC_TRACE_BEGIN("model_tables");
+        result = WFC_ModelInitTables(model);
+        WFC_TRACE_END("model_tables");
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        *model_out = model;
+    } else if (NULL != model) {
+        WFC_ModelDestroy(model);
+    }
+
+    WFC_TRACE_END("model_create");
+
+    return result;
+}
+
+/** Fill in the model's tables describing a pixel with every pattern valid, which
+ * each run copies from when setting up its output.
+ */
+WFC_RESULT_ENUM WFC_ModelInitTables(WFC_Model *model) {
+    WFC_RESULT_ENUM result = WFC_RESULT_OKAY;
+
+    const WFC_Propagator *propagator = &model->propagator;
+    const uint32_t num_patterns = propagator->num_patterns;
+    const uint32_t num_adjacent = propagator->num_adjacent;
+
+    model->initial_supports = (WFC_Support*)WFC_Malloc(sizeof(WFC_Support) * num_patterns * num_adjacent);
+    model->pattern_directions = (uint8_t*)WFC_Calloc(num_patterns);
+    model->prefix_weights = (uint32_t*)WFC_Malloc(sizeof(uint32_t) * (num_patterns + 1));
+
+    if ((NULL == model->initial_supports) ||
+        (NULL == model->pattern_directions) ||
+        (NULL == model->prefix_weights)) {
+        result = WFC_RESULT_ERROR;
+    } else {
+        const WFC_BitmapKernels *kernels = WFC_GetBitmapKernels();
+
+        // the number of patterns supporting 'pat_index' from the direction 'adj_index' is
+        // the number of patterns it allows in the opposite direction.
+        for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
+            for (uint32_t adj_index = 0; adj_index < num_adjacent; adj_index++) {
+                uint64_t *index_bitmap =
+                    WFC_GetIndexBitmap(propagator, pat_index, WFC_OPPOSITE_ADJACENT(adj_index, num_adjacent));
+
+                model->initial_supports[pat_index * num_adjacent + adj_index] =
+                    kernels->popcount(index_bitmap, propagator->bitmap_words);
+
+                // removing the pattern only takes support from neighbours in directions it allows something in
+                if (kernels->any(WFC_GetIndexBitmap(propagator, pat_index, adj_index), propagator->bitmap_words)) {
+                    model->pattern_directions[pat_index] |= 1 << adj_index;
+                }
+            }
+        }
+
+        memset(&model->initial_entropy, 0, sizeof(model->initial_entropy));
+        model->initial_entropy.num_valid = num_patterns;
+        for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
+            model->prefix_weights[pat_index] = model->initial_entropy.sum_weights;
+            model->initial_entropy.sum_weights += propagator->patterns[pat_index].count;
+            model->initial_entropy.sum_weight_log_weights += propagator->weight_log_weights[pat_index];
+        }
+        model->prefix_weights[num_patterns] = model->initial_entropy.sum_weights;
+    }
+
+    return result;
+}
+
+WFC_Model *WFC_ModelRetain(WFC_Model *model) {
+    if (NULL != model) {
+        atomic_fetch_add_explicit(&model->ref_count, 1, memory_order_relaxed);
+    }
+
+    return model;
+}
+
+void WFC_ModelRelease(WFC_Model *model) {
+    if (NULL != model) {
+        // the last release must see every other holder's use of the model before freeing it
+        if (1 == atomic_fetch_sub_explicit(&model->ref_count, 1, memory_order_acq_rel)) {
+            WFC_ModelDestroy(model);
+        }
+    }
+}
+
+void WFC_ModelDestroy(WFC_Model *model) {
+    WFC_Free(model->input);
+    WFC_Free(model->initial_supports);
+    WFC_Free(model->pattern_directions);
+    WFC_Free(model->prefix_weights);
+
+    if (NULL != model->propagator.mapping) {
+        // the propagator's arrays live in the mapping
+        munmap(model->propagator.mapping, model->propagator.mapping_len);
+    } else {
+        WFC_Free(model->propagator.weight_log_weights);
+        WFC_Free(model->propagator.patterns);
+        WFC_Free(model->propagator.index);
+    }
+
+    WFC_Free(model);
+}
+
+size_t WFC_ModelSize(const WFC_Model *model) {
+    const WFC_Propagator *propagator = &model->propagator;
+
+    size_t num_bytes = sizeof(WFC_Model) +
+                       (size_t)model->input_width * model->input_height +
+                       sizeof(WFC_Support) * (size_t)propagator->num_patterns * propagator->num_adjacent +
+                       propagator->num_patterns +
+                       sizeof(uint32_t) * ((size_t)propagator->num_patterns + 1);
+
+    if (NULL != propagator->mapping) {
+        num_bytes += propagator->mapping_len;
+    } else {
+        num_bytes += sizeof(WFC_Pattern) * (size_t)propagator->max_patterns +
+                     sizeof(double) * (size_t)propagator->num_patterns +
+                     sizeof(uint64_t) * (size_t)WFC_INDEX_LENGTH_WORDS(propagator->num_patterns,
+                                                                       propagator->num_adjacent);
+    }
+
+    return num_bytes;
+}
+
+WFC_RESULT_ENUM WFC_StateInit(WFC_State *state,
+                              uint32_t input_width,
+                              uint32_t input_height,
+                              const uint8_t *input,
+                              uint32_t output_width,
+                              uint32_t output_height) {
+    WFC_Model *model = NULL;
+
+    WFC_RESULT_ENUM result = WFC_ModelCreate(&model, input_width, input_height, input);
+
+    if (WFC_RESULT_OKAY == result) {
+        result = WFC_StateInitFromModel(state, model, output_width, output_height);
+
+        // the state holds its own reference
+        WFC_ModelRelease(model);
+    }
+
+    return result;
+}
+
+WFC_RESULT_ENUM WFC_StateInitFromModel(WFC_State *state,
+                                       WFC_Model *model,
+                                       uint32_t output_width,
+                                       uint32_t output_height) {
+    return WFC_StateInitInArena(state, model, output_width, output_height, NULL, 0);
+}
+
+WFC_RESULT_ENUM WFC_StateInitInArena(WFC_State *state,
+                                     WFC_Model *model,
+                                     uint32_t output_width,
+                                     uint32_t output_height,
+                                     void *arena,
+                                     size_t arena_bytes) {
+    if ((NULL == state) || (NULL == model)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    memset(state, 0, sizeof(*state));
+    state->model = WFC_ModelRetain(model);
+    state->periodic = true;
+
+    WFC_RESULT_ENUM result = WFC_StateInitOutput(state, output_width, output_height, arena, arena_bytes);
+
+    // free whatever was allocated before the failure, and the state's reference
+    if (WFC_RESULT_OKAY != result) {
+        WFC_StateDestroy(state);
+    }
+
+    return result;
+}
+
+void WFC_StateLayoutInit(const WFC_Model *model,
+                         uint32_t output_width,
+                         uint32_t output_height,
+                         WFC_StateLayout *layout) {
+    const size_t num_pixels = (size_t)output_width * output_height;
+    const size_t bitmap_bytes = sizeof(uint64_t) * model->propagator.bitmap_words * num_pixels;
+    const size_t supports_bytes =
+        sizeof(WFC_Support) * (size_t)model->propagator.num_patterns * model->propagator.num_adjacent * num_pixels;
+
+    size_t offset = 0;
+
+    layout->queue_offset = offset;
+    offset = WFC_ALIGN_UP(offset + sizeof(uint32_t) * num_pixels, WFC_ARENA_ALIGN);
+
+    layout->output_offset = offset;
+    offset = WFC_ALIGN_UP(offset + bitmap_bytes, WFC_ARENA_ALIGN);
+
+    layout->removed_offset = offset;
+    offset = WFC_ALIGN_UP(offset + bitmap_bytes, WFC_ARENA_ALIGN);
+
+    layout->queued_offset = offset;
+    offset = WFC_ALIGN_UP(offset + sizeof(uint64_t) * WFC_QUEUED_WORDS(num_pixels), WFC_ARENA_ALIGN);
+
+    layout->queued_directions_offset = offset;
+    offset = WFC_ALIGN_UP(offset + num_pixels, WFC_ARENA_ALIGN);
+
+    layout->live_offset = offset;
+    offset = WFC_ALIGN_UP(offset + sizeof(uint64_t) * model->propagator.bitmap_words, WFC_ARENA_ALIGN);
+
+    layout->edge_classes_offset = offset;
+    offset = WFC_ALIGN_UP(offset + num_pixels, WFC_ARENA_ALIGN);
+
+    layout->supports_offset = offset;
+    offset = WFC_ALIGN_UP(offset + supports_bytes, WFC_ARENA_ALIGN);
+
+    layout->entropies_offset = offset;
+    offset = WFC_ALIGN_UP(offset + sizeof(WFC_CellEntropy) * num_pixels, WFC_ARENA_ALIGN);
+
+    layout->heap_items_offset = offset;
+    offset = WFC_ALIGN_UP(offset + sizeof(uint32_t) * num_pixels, WFC_ARENA_ALIGN);
+
+    layout->heap_positions_offset = offset;
+    offset = WFC_ALIGN_UP(offset + sizeof(uint32_t) * num_pixels, WFC_ARENA_ALIGN);
+
+    layout->total_bytes = offset;
+}
+
+bool WFC_SizeValid(uint32_t width, uint32_t height) {
+    return (0 != width) && (0 != height) && (width <= (UINT32_MAX / height));
+}
+
+bool WFC_OutputSizeValid(const WFC_Model *model, uint32_t output_width, uint32_t output_height) {
+    if (!WFC_SizeValid(output_width, output_height)) {
+        return false;
+    }
+
+    // support counts are indexed by (pixel * num_patterns + pattern) * num_adjacent, and the
+    // bitmaps by pixel * bitmap_words, which is never larger
+    uint64_t supports_per_pixel = (uint64_t)model->propagator.num_patterns * model->propagator.num_adjacent;
+    return ((uint64_t)output_width * output_height * supports_per_pixel) <= UINT32_MAX;
+}
+
+size_t WFC_StateSize(const WFC_Model *model, uint32_t output_width, uint32_t output_height) {
+    if ((NULL == model) || !WFC_OutputSizeValid(model, output_width, output_height)) {
+        return 0;
+    }
+
+    WFC_StateLayout layout;
+    WFC_StateLayoutInit(model, output_width, output_height, &layout);
+
+    return layout.total_bytes;
+}
+
+/** Set up the per-run output state (bitmaps, support counts, queue and entropy heap)
+ * for a state whose model has already been set. The buffers are carved out of the
+ * arena if one is given, and otherwise out of a single allocation owned by the state.
+ */
+WFC_RESULT_ENUM WFC_StateInitOutput(WFC_State *state,
+                                    uint32_t output_width,
+                                    uint32_t output_height,
+                                    void *arena,
+                                    size_t arena_bytes) {
+    WFC_RESULT_ENUM result = WFC_RESULT_OKAY;
+
+    const WFC_Model *model = state->model;
+
+    if (!WFC_OutputSizeValid(model, output_width, output_height)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    const uint32_t num_pixels = output_width * output_height;
+
+    WFC_TRACE_BEGIN("state_init");
+
+    state->output_width = output_width;
+    state->output_height = output_height;
+
+    WFC_StateLayout layout;
+    WFC_StateLayoutInit(model, output_width, output_height, &layout);
+
+    uint8_t *memory = (uint8_t*)arena;
+    if (NULL != arena) {
+        if ((((uintptr_t)arena % WFC_ARENA_ALIGN) != 0) || (arena_bytes < layout.total_bytes)) {
+            result = WFC_RESULT_ERROR;
+        }
+    } else {
+        memory = (uint8_t*)WFC_AlignedAlloc(layout.total_bytes, WFC_ARENA_ALIGN);
+        state->memory = memory;
+
+        if (NULL == memory) {
+            result = WFC_RESULT_ERROR;
+        }
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        state->queue.items = (uint32_t*)(memory + layout.queue_offset);
+        state->output = (uint64_t*)(memory + layout.output_offset);
+        state->removed = (uint64_t*)(memory + layout.removed_offset);
+        state->queued = (uint64_t*)(memory + layout.queued_offset);
+        state->queued_directions = memory + layout.queued_directions_offset;
+        state->live = (uint64_t*)(memory + layout.live_offset);
+        state->edge_classes = memory + layout.edge_classes_offset;
+        state->supports = (WFC_Support*)(memory + layout.supports_offset);
+        state->entropies = (WFC_CellEntropy*)(memory + layout.entropies_offset);
+        state->heap.items = (uint32_t*)(memory + layout.heap_items_offset);
+        state->heap.positions = (uint32_t*)(memory + layout.heap_positions_offset);
+
+        state->queue.head = 0;
+        state->queue.num_items = 0;
+        state->queue.max_items = num_pixels;
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        log_trace("WFC setting up output map");
+        WFC_TRACE_BEGIN("output_map");
+        const uint32_t bitmap_words = model->propagator.bitmap_words;
+
+        memset(state->removed, 0, sizeof(uint64_t) * bitmap_words * (size_t)num_pixels);
+        memset(state->queued, 0, sizeof(uint64_t) * WFC_QUEUED_WORDS(num_pixels));
+        memset(state->queued_directions, 0, num_pixels);
+
+        // initial each bitmap to all 1, indicating that all patterns are valid.
+        // Only the bits of actual patterns are set, leaving the padding clear.
+        // The first bitmap is filled in and copied to the rest.
+        memset(state->output, 0, sizeof(uint64_t) * bitmap_words);
+        for (uint32_t pat_index = 0; pat_index < model->propagator.num_patterns; pat_index++) {
+            WFC_BitmapSet(state->output, pat_index);
+        }
+
+        WFC_GetBitmapKernels()->fill(&state->output[bitmap_words], state->output, bitmap_words, num_pixels - 1);
+        WFC_TRACE_END("output_map");
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        log_trace("WFC setting up neighbours");
+
+        for (uint32_t y = 0; y < output_height; y++) {
+            uint8_t row_edges = ((0 == y) ? WFC_EDGE_TOP : 0) | (((output_height - 1) == y) ? WFC_EDGE_BOTTOM : 0);
+
+            for (uint32_t x = 0; x < output_width; x++) {
+                state->edge_classes[x + y * output_width] =
+                    row_edges | ((0 == x) ? WFC_EDGE_LEFT : 0) | (((output_width - 1) == x) ? WFC_EDGE_RIGHT : 0);
+            }
+        }
+
+        WFC_StateSetNeighbours(state);
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        log_trace("WFC setting up support counts");
+        WFC_TRACE_BEGIN("supports");
+        uint32_t supports_per_pixel = model->propagator.num_patterns * model->propagator.num_adjacent;
+
+        for (uint32_t pix_index = 0; pix_index < num_pixels; pix_index++) {
+            memcpy(&state->supports[pix_index * supports_per_pixel],
+                   model->initial_supports,
+                   sizeof(WFC_Support) * supports_per_pixel);
+        }
+        WFC_TRACE_END("supports");
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        log_trace("WFC setting up entropy heap");
+        WFC_TRACE_BEGIN("entropy_heap");
+
+        // every pixel starts with all patterns valid.
+        // pixels which start with a single pattern are never selected
+        state->heap.num_items = 0;
+        for (uint32_t pix_index = 0; pix_index < num_pixels; pix_index++) {
+            state->entropies[pix_index] = model->initial_entropy;
+
+            if (model->propagator.num_patterns > 1) {
+                state->heap.items[state->heap.num_items] = pix_index;
+                state->heap.positions[pix_index] = state->heap.num_items;
+                state->heap.num_items++;
+            } else {
+                state->heap.positions[pix_index] = WFC_HEAP_NONE;
+            }
+        }
+
+        // the seed sets each pixel's tie break and orders the heap
+        result = WFC_StateSetSeed(state, WFC_DEFAULT_SEED);
+        WFC_TRACE_END("entropy_heap");
+    }
+
+    WFC_TRACE_END("state_init");
+
+    return result;
+}
+
+WFC_RESULT_ENUM WFC_StateSetSeed(WFC_State *state, uint32_t seed) {
+    // the tie breaks can only be replaced while every pixel is still in the heap
+    if ((NULL == state) || (0 != state->step_num)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    state->seed = seed;
+
+    // each pixel's tie break is drawn independently, so this loop has no chain between iterations
+    const uint32_t num_pixels = state->output_width * state->output_height;
+    for (uint32_t pix_index = 0; pix_index < num_pixels; pix_index++) {
+        state->entropies[pix_index].tie_break = WFC_Random(seed, pix_index, WFC_RANDOM_TIE_BREAK);
+        WFC_UpdateKey(state, pix_index);
+    }
+
+    // heapify, as the tie breaks give each pixel a different key
+    for (uint32_t heap_index = state->heap.num_items / 2; heap_index > 0; heap_index--) {
+        WFC_HeapSiftDown(state, heap_index - 1);
+    }
+
+    return WFC_RESULT_OKAY;
+}
+
+WFC_RESULT_ENUM WFC_StateSetPeriodic(WFC_State *state, bool periodic) {
+    // the supports of edge pixels only match the new setting before anything is removed
+    if ((NULL == state) || (0 != state->step_num) || (0 != state->queue.num_items)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    state->periodic = periodic;
+    WFC_StateSetNeighbours(state);
+
+    return WFC_RESULT_OKAY;
+}
+
+void WFC_StateSetNeighbours(WFC_State *state) {
+    const int32_t width = state->output_width;
+    const int32_t height = state->output_height;
+    const uint32_t num_adjacent = state->model->propagator.num_adjacent;
+    const WFC_Pos *adjacent_offsets = WFC_AdjacentOffsets(num_adjacent);
+
+    for (uint32_t edges = 0; edges < WFC_NUM_EDGE_CLASSES; edges++) {
+        state->neighbour_directions[edges] = 0;
+
+        for (uint32_t adj_index = 0; adj_index < num_adjacent; adj_index++) {
+            WFC_Pos offset = adjacent_offsets[adj_index];
+
+            // stepping off an edge wraps around to the far side of the grid
+            bool leaves_grid = false;
+            if (((offset.x < 0) && (edges & WFC_EDGE_LEFT)) || ((offset.x > 0) && (edges & WFC_EDGE_RIGHT))) {
+                offset.x -= offset.x * width;
+                leaves_grid = true;
+            }
+            if (((offset.y < 0) && (edges & WFC_EDGE_TOP)) || ((offset.y > 0) && (edges & WFC_EDGE_BOTTOM))) {
+                offset.y -= offset.y * height;
+                leaves_grid = true;
+            }
+
+            state->neighbour_deltas[edges][adj_index] = offset.x + offset.y * width;
+
+            if (state->periodic || !leaves_grid) {
+                state->neighbour_directions[edges] |= 1 << adj_index;
+            }
+        }
+    }
+}
+
+WFC_RESULT_ENUM WFC_StateSetQueueOrder(WFC_State *state, WFC_QUEUE_ORDER_ENUM order) {
+    // only between propagations, so each propagation runs in a single order
+    if ((NULL == state) || (0 != state->queue.num_items) ||
+        ((WFC_QUEUE_ORDER_LIFO != order) && (WFC_QUEUE_ORDER_FIFO != order))) {
+        return WFC_RESULT_ERROR;
+    }
+
+    state->queue.order = order;
+
+    return WFC_RESULT_OKAY;
+}
+
+void WFC_StateDestroy(WFC_State *state) {
+    if (NULL != state) {
+          // the per-run buffers are in one block, unless they are in a caller's arena
+          WFC_Free(state->memory);
+
+          WFC_Free(state->backtrack.trail);
+          WFC_Free(state->backtrack.decisions);
+
+          WFC_ModelRelease(state->model);
+
+          // clear memory so its pointers are no longer available for use
+          memset(state, 0, sizeof(*state));
+     }
+}
+
+void WFC_FileLayout(const WFC_Propagator *propagator, WFC_FileHeader *header) {
+    memset(header, 0, sizeof(*header));
+
+    header->magic = WFC_FILE_MAGIC;
+    header->byte_order = WFC_FILE_BYTE_ORDER;
+    header->version = WFC_FILE_VERSION;
+    header->header_bytes = sizeof(WFC_FileHeader);
+
+    header->n = WFC_N;
+    header->cell_num_bits = WFC_CELL_NUM_BITS;
+    header->num_adjacent = propagator->num_adjacent;
+    header->pattern_bytes = sizeof(WFC_Pattern);
+
+    header->num_patterns = propagator->num_patterns;
+    header->bitmap_words = propagator->bitmap_words;
+
+    header->patterns_offset = WFC_FILE_ALIGN_OFFSET(sizeof(WFC_FileHeader));
+    header->weights_offset =
+        WFC_FILE_ALIGN_OFFSET(header->patterns_offset + sizeof(WFC_Pattern) * (uint64_t)propagator->num_patterns);
+    header->index_offset =
+        WFC_FILE_ALIGN_OFFSET(header->weights_offset + sizeof(double) * (uint64_t)propagator->num_patterns);
+    header->file_bytes =
+        header->index_offset +
+        sizeof(uint64_t) * (uint64_t)WFC_INDEX_LENGTH_WORDS(propagator->num_patterns, propagator->num_adjacent);
+}
+
+WFC_RESULT_ENUM WFC_ModelSave(const WFC_Model *model, const char *path) {
+    WFC_RESULT_ENUM result = WFC_RESULT_OKAY;
+
+    if ((NULL == model) || (NULL == path) || (NULL == model->propagator.index)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    const WFC_Propagator *propagator = &model->propagator;
+
+    WFC_FileHeader header;
+    WFC_FileLayout(propagator, &header);
+
+    // the patterns are copied field by field into zeroed records, so the padding
+    // between and after their fields is written as zeros
+    WFC_Pattern *records = (WFC_Pattern*)WFC_Calloc(sizeof(WFC_Pattern) * propagator->num_patterns);
+    if (NULL == records) {
+        return WFC_RESULT_ERROR;
+    }
+
+    for (uint32_t pat_index = 0; pat_index < propagator->num_patterns; pat_index++) {
+        records[pat_index].index = propagator->patterns[pat_index].index;
+        records[pat_index].count = propagator->patterns[pat_index].count;
+        records[pat_index].tile = propagator->patterns[pat_index].tile;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (NULL == file) {
+        WFC_Free(records);
+        return WFC_RESULT_ERROR;
+    }
+
+    // each section is written at its offset, padding with zeros up to it
+    const struct {
+        uint64_t offset;
+        const void *data;
+        uint64_t num_bytes;
+    } sections[] =
+        { { 0, &header, sizeof(header) }
+        , { header.patterns_offset, records, sizeof(WFC_Pattern) * (uint64_t)propagator->num_patterns }
+        , { header.weights_offset, propagator->weight_log_weights, sizeof(double) * (uint64_t)propagator->num_patterns }
+        , { header.index_offset, propagator->index, header.file_bytes - header.index_offset }
+        };
+
+    uint64_t position = 0;
+    for (uint32_t section_index = 0; section_index < sizeof(sections) / sizeof(sections[0]); section_index++) {
+        while ((WFC_RESULT_OKAY == result) && (position < sections[section_index].offset)) {
+            if (EOF == fputc(0, file)) {
+                result = WFC_RESULT_ERROR;
+            }
+            position++;
+        }
+
+        if (WFC_RESULT_OKAY == result) {
+            if (fwrite(sections[section_index].data, 1, sections[section_index].num_bytes, file) !=
+                sections[section_index].num_bytes) {
+                result = WFC_RESULT_ERROR;
+            }
+            position += sections[section_index].num_bytes;
+        }
+    }
+
+    if (0 != fclose(file)) {
+        result = WFC_RESULT_ERROR;
+    }
+
+    WFC_Free(records);
+
+    return result;
+}
+
+/** Check the contents of a propagator read from a file, which the solver otherwise
+ * trusts. Each pattern must have its own index, a non-zero count and no bits set outside
+ * of its tile, the counts must sum to a uint32_t, and the index must be symmetric, with
+ * no bits set past the last pattern.
+ */
+bool WFC_PropagatorValid(const WFC_Propagator *propagator) {
+    const uint32_t num_patterns = propagator->num_patterns;
+    const uint32_t num_adjacent = propagator->num_adjacent;
+    const uint32_t bitmap_words = propagator->bitmap_words;
+
+    uint64_t sum_counts = 0;
+    for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
+        const WFC_Pattern *pattern = &propagator->patterns[pat_index];
+
+        if ((pattern->index != pat_index) ||
+            (0 == pattern->count) ||
+            (0 != (pattern->tile & ~WFC_TILE_ALL)) ||
+            !isfinite(propagator->weight_log_weights[pat_index]) ||
+            (propagator->weight_log_weights[pat_index] < 0.0)) {
+            return false;
+        }
+
+        sum_counts += pattern->count;
+    }
+
+    if (sum_counts > UINT32_MAX) {
+        return false;
+    }
+
+    // bits of the last word past the final pattern, and any padding words, are clear
+    const uint32_t last_bits = num_patterns % WFC_BITMAP_WORD_BITS;
+    const uint64_t last_mask = (0 == last_bits) ? ~0ULL : ((1ULL << last_bits) - 1);
+    const uint32_t last_word = (num_patterns - 1) / WFC_BITMAP_WORD_BITS;
+
+    for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
+        for (uint32_t adj_index = 0; adj_index < num_adjacent; adj_index++) {
+            const uint64_t *index_bitmap = WFC_GetIndexBitmap(propagator, pat_index, adj_index);
+            const uint32_t opposite_index = WFC_OPPOSITE_ADJACENT(adj_index, num_adjacent);
+
+            if (0 != (index_bitmap[last_word] & ~last_mask)) {
+                return false;
+            }
+            for (uint32_t word_index = last_word + 1; word_index < bitmap_words; word_index++) {
+                if (0 != index_bitmap[word_index]) {
+                    return false;
+                }
+            }
+
+            // each pattern allowed must allow this one back from the opposite side
+            for (uint32_t other_pat_index = WFC_BitmapNext(index_bitmap, bitmap_words, 0);
+                 other_pat_index != WFC_BITMAP_END;
+                 other_pat_index = WFC_BitmapNext(index_bitmap, bitmap_words, other_pat_index + 1)) {
+                if (!WFC_BitmapGet(WFC_GetIndexBitmap(propagator, other_pat_index, opposite_index), pat_index)) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+WFC_RESULT_ENUM WFC_StateInitFromFile(WFC_State *state,
+                                      const char *path,
+                                      uint32_t output_width,
+                                      uint32_t output_height) {
+    WFC_Model *model = NULL;
+
+    WFC_RESULT_ENUM result = WFC_ModelLoad(&model, path);
+
+    if (WFC_RESULT_OKAY == result) {
+        result = WFC_StateInitFromModel(state, model, output_width, output_height);
+
+        // the state holds its own reference
+        WFC_ModelRelease(model);
+    }
+
+    return result;
+}
+
+WFC_RESULT_ENUM WFC_ModelLoad(WFC_Model **model_out, const char *path) {
+    WFC_RESULT_ENUM result = WFC_RESULT_OKAY;
+
+    if ((NULL == model_out) || (NULL == path)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    WFC_Model *model = (WFC_Model*)WFC_Calloc(sizeof(WFC_Model));
+    if (NULL == model) {
+        return WFC_RESULT_ERROR;
+    }
+    atomic_init(&model->ref_count, 1);
+
+    log_trace("WFC mapping propagator file %s", path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        WFC_Free(model);
+        return WFC_RESULT_ERROR;
+    }
+
+    struct stat file_stat;
+    if ((0 != fstat(fd, &file_stat)) || ((size_t)file_stat.st_size < sizeof(WFC_FileHeader))) {
+        result = WFC_RESULT_ERROR;
+    }
+
+    uint8_t *mapping = NULL;
+    size_t mapping_len = 0;
+    if (WFC_RESULT_OKAY == result) {
+        mapping_len = file_stat.st_size;
+        mapping = (uint8_t*)mmap(NULL, mapping_len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (MAP_FAILED == mapping) {
+            mapping = NULL;
+            result = WFC_RESULT_ERROR;
+        }
+    }
+
+    // the mapping stays valid once the file is closed
+    close(fd);
+
+    if (WFC_RESULT_OKAY == result) {
+        log_trace("WFC checking propagator file");
+        const WFC_FileHeader *header = (const WFC_FileHeader*)mapping;
+
+        // the file must have been written by a build with the same parameters
+        if ((WFC_FILE_MAGIC != header->magic) ||
+            (WFC_FILE_BYTE_ORDER != header->byte_order) ||
+            (WFC_FILE_VERSION != header->version) ||
+            (sizeof(WFC_FileHeader) != header->header_bytes) ||
+            (WFC_N != header->n) ||
+            (WFC_CELL_NUM_BITS != header->cell_num_bits) ||
+            ((WFC_ADJACENCY_ALL != header->num_adjacent) && (WFC_ADJACENCY_CARDINAL != header->num_adjacent)) ||
+            (sizeof(WFC_Pattern) != header->pattern_bytes) ||
+            (0 == header->num_patterns) ||
+            (header->num_patterns > UINT16_MAX)) {
+            result = WFC_RESULT_ERROR;
+        }
+
+        // check the layout against the one we would write, which also bounds each section
+        WFC_FileHeader expected;
+        if (WFC_RESULT_OKAY == result) {
+            WFC_Propagator counts = { .num_patterns = header->num_patterns,
+                                      .num_adjacent = header->num_adjacent,
+                                      .bitmap_words = WFC_BITMAP_WORDS_NEEDED(header->num_patterns) };
+            WFC_FileLayout(&counts, &expected);
+
+            if ((expected.bitmap_words != header->bitmap_words) ||
+                (expected.patterns_offset != header->patterns_offset) ||
+                (expected.weights_offset != header->weights_offset) ||
+                (expected.index_offset != header->index_offset) ||
+                (expected.file_bytes != header->file_bytes) ||
+                (header->file_bytes > mapping_len)) {
+                result = WFC_RESULT_ERROR;
+            }
+        }
+
+        if (WFC_RESULT_OKAY == result) {
+            // the arrays are used in place. They are never written through, despite the
+            // propagator's pointers not being const.
+            model->propagator.num_patterns = header->num_patterns;
+            model->propagator.max_patterns = header->num_patterns;
+            model->propagator.num_adjacent = header->num_adjacent;
+            model->propagator.bitmap_words = header->bitmap_words;
+            model->propagator.patterns = (WFC_Pattern*)(mapping + header->patterns_offset);
+            model->propagator.weight_log_weights = (double*)(mapping + header->weights_offset);
+            model->propagator.index = (uint64_t*)(mapping + header->index_offset);
+            model->propagator.mapping = mapping;
+            model->propagator.mapping_len = mapping_len;
+
+            // a corrupt file is rejected here rather than failing somewhere in the solver
+            if (!WFC_PropagatorValid(&model->propagator)) {
+                result = WFC_RESULT_ERROR;
+            }
+        }
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        // the model does not keep the input it was built from
+        result = WFC_ModelInitTables(model);
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        *model_out = model;
+    } else if (NULL != model->propagator.mapping) {
+        WFC_ModelDestroy(model);
+    } else {
+        if (NULL != mapping) {
+            munmap(mapping, mapping_len);
+        }
+        WFC_Free(model);
+    }
+
+    return result;
+}
+
+#if defined(WFC_TEST)
+// read a whole file into a malloc'd buffer
+static uint8_t *WFC_TestReadFile(const char *path, size_t *num_bytes) {
+    FILE *file = fopen(path, "rb");
+    assert(NULL != file);
+    fseek(file, 0, SEEK_END);
+    *num_bytes = (size_t)ftell(file);
+    rewind(file);
+
+    uint8_t *contents = (uint8_t*)malloc(*num_bytes);
+    assert(fread(contents, 1, *num_bytes, file) == *num_bytes);
+    fclose(file);
+
+    return contents;
+}
+
+static void WFC_TestWriteFile(const char *path, const uint8_t *contents, size_t num_bytes) {
+    FILE *file = fopen(path, "wb");
+    assert(NULL != file);
+    assert(fwrite(contents, 1, num_bytes, file) == num_bytes);
+    fclose(file);
+}
+
+void WFC_TestPropagatorFile(void) {
+    const char *path = "wfc_test_propagator.bin";
+
+    WFC_State state = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInit(&state, 4, 4, gv_test_rings, 10, 10));
+    assert(WFC_RESULT_OKAY == WFC_ModelSave(state.model, path));
+
+    WFC_State loaded = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInitFromFile(&loaded, path, 10, 10));
+    assert(NULL != loaded.model->propagator.mapping);
+    assert(((uintptr_t)loaded.model->propagator.index % WFC_BITMAP_ALIGN_BYTES) == 0);
+    assert(loaded.model->propagator.num_patterns == state.model->propagator.num_patterns);
+    assert(memcmp(loaded.model->propagator.index,
+                  state.model->propagator.index,
+                  sizeof(uint64_t) * WFC_INDEX_LENGTH_WORDS(state.model->propagator.num_patterns, WFC_NUM_ADJACENT)) == 0);
+
+    // both states make the same choices
+    WFC_RESULT_ENUM result = WFC_RESULT_CONTINUE;
+    while (WFC_RESULT_CONTINUE == result) {
+        result = WFC_Step(&state);
+        assert(result == WFC_Step(&loaded));
+    }
+    assert(memcmp(loaded.output,
+                  state.output,
+                  sizeof(uint64_t) * state.model->propagator.bitmap_words * 10 * 10) == 0);
+
+    WFC_StateDestroy(&loaded);
+
+    // saving a model twice gives the same bytes, with the padding of each pattern record zeroed
+    const char *second_path = "wfc_test_propagator_2.bin";
+    assert(WFC_RESULT_OKAY == WFC_ModelSave(state.model, second_path));
+
+    size_t file_bytes = 0;
+    uint8_t *contents = WFC_TestReadFile(path, &file_bytes);
+    size_t second_bytes = 0;
+    uint8_t *second_contents = WFC_TestReadFile(second_path, &second_bytes);
+    assert((file_bytes == second_bytes) && (0 == memcmp(contents, second_contents, file_bytes)));
+    free(second_contents);
+    remove(second_path);
+
+    WFC_FileHeader header;
+    WFC_FileLayout(&state.model->propagator, &header);
+    const uint32_t num_patterns = state.model->propagator.num_patterns;
+    for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
+        WFC_Pattern record;
+        memset(&record, 0, sizeof(record));
+        record.index = state.model->propagator.patterns[pat_index].index;
+        record.count = state.model->propagator.patterns[pat_index].count;
+        record.tile = state.model->propagator.patterns[pat_index].tile;
+        assert(0 == memcmp(&contents[header.patterns_offset + pat_index * sizeof(WFC_Pattern)], &record, sizeof(record)));
+    }
+
+    // corrupt files are rejected when loading. The first pattern allows something to its left,
+    // which then does not allow it back.
+    uint64_t *index_bitmap = WFC_GetIndexBitmap(&state.model->propagator, 0, 0);
+    const uint32_t allowed = WFC_BitmapNext(index_bitmap, state.model->propagator.bitmap_words, 0);
+    assert(WFC_BITMAP_END != allowed);
+    const uint64_t allowed_offset =
+        header.index_offset +
+        sizeof(uint64_t) * ((uint64_t)WFC_PATTERN_INDEX(num_patterns, WFC_NUM_ADJACENT, allowed) +
+                            WFC_ADJACENT_INDEX(num_patterns, WFC_OPPOSITE_ADJACENT(0, WFC_NUM_ADJACENT)));
+
+    for (uint32_t corruption = 0; corruption < 5; corruption++) {
+        uint8_t *corrupt = (uint8_t*)malloc(file_bytes);
+        memcpy(corrupt, contents, file_bytes);
+
+        WFC_Pattern *patterns = (WFC_Pattern*)&corrupt[header.patterns_offset];
+        uint64_t *index = (uint64_t*)&corrupt[header.index_offset];
+        size_t corrupt_bytes = file_bytes;
+
+        switch (corruption) {
+            case 0: patterns[1].index = 0; break;
+            case 1: patterns[0].count = 0; break;
+            case 2: index[0] |= 1ULL << num_patterns; break;
+            case 3: ((uint64_t*)&corrupt[allowed_offset])[0] &= ~1ULL; break;
+            case 4: corrupt_bytes = header.index_offset; break;
+        }
+
+        WFC_TestWriteFile(path, corrupt, corrupt_bytes);
+        free(corrupt);
+
+        WFC_Model *model = NULL;
+        assert(WFC_RESULT_ERROR == WFC_ModelLoad(&model, path));
+        assert(NULL == model);
+    }
+
+    // and the uncorrupted file still loads
+    WFC_TestWriteFile(path, contents, file_bytes);
+    WFC_Model *model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelLoad(&model, path));
+    WFC_ModelRelease(model);
+    free(contents);
+
+    WFC_StateDestroy(&state);
+
+    // a file with the wrong magic number is rejected
+    FILE *file = fopen(path, "r+b");
+    assert(NULL != file);
+    fputc(0, file);
+    fclose(file);
+    assert(WFC_RESULT_ERROR == WFC_StateInitFromFile(&loaded, path, 10, 10));
+
+    remove(path);
+}
+#endif
+
+#if defined(WFC_TEST)
+void WFC_TestSharedModel(void) {
+    WFC_Model *model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&model, 4, 4, gv_test_rings));
+    assert(1 == atomic_load(&model->ref_count));
+
+    // states sharing a model each take a reference
+    WFC_State first = {0};
+    WFC_State second = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(&first, model, 10, 10));
+    assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(&second, model, 12, 8));
+    assert(3 == atomic_load(&model->ref_count));
+    assert(first.model == second.model);
+
+    // a state with its own model makes the same choices as one sharing a model
+    WFC_State separate = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInit(&separate, 4, 4, gv_test_rings, 10, 10));
+    assert(separate.model != model);
+
+    WFC_RESULT_ENUM result = WFC_RESULT_CONTINUE;
+    while (WFC_RESULT_CONTINUE == result) {
+        result = WFC_Step(&first);
+        assert(result == WFC_Step(&separate));
+    }
+    assert(memcmp(first.output,
+                  separate.output,
+                  sizeof(uint64_t) * model->propagator.bitmap_words * 10 * 10) == 0);
+
+    while (WFC_RESULT_CONTINUE == WFC_Step(&second)) {
+    }
+
+    WFC_StateDestroy(&separate);
+    WFC_StateDestroy(&first);
+    assert(2 == atomic_load(&model->ref_count));
+
+    // the model outlives the caller's reference while a state still holds one
+    WFC_ModelRelease(model);
+    assert(1 == atomic_load(&second.model->ref_count));
+    assert(NULL != second.model->propagator.index);
+
+    WFC_StateDestroy(&second);
+}
+#endif
+
+#if defined(WFC_TEST)
+typedef struct WFC_TestAllocCounts {
+    uint32_t num_allocs;
+    uint32_t num_live;
+} WFC_TestAllocCounts;
+
+void *WFC_TestCountingAlloc(size_t size, size_t align, void *user) {
+    WFC_TestAllocCounts *counts = (WFC_TestAllocCounts*)user;
+    counts->num_allocs++;
+    counts->num_live++;
+
+    return WFC_DefaultAlloc(size, align, NULL);
+}
+
+void WFC_TestCountingFree(void *ptr, void *user) {
+    WFC_TestAllocCounts *counts = (WFC_TestAllocCounts*)user;
+    counts->num_live--;
+
+    WFC_DefaultFree(ptr, NULL);
+}
+
+void WFC_TestArena(void) {
+    WFC_TestAllocCounts counts = {0};
+    WFC_Allocator allocator = { WFC_TestCountingAlloc, WFC_TestCountingFree, &counts };
+    WFC_SetAllocator(&allocator);
+
+    WFC_Model *model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&model, 4, 4, gv_test_rings));
+    assert(counts.num_allocs > 0);
+    assert(WFC_ModelSize(model) > sizeof(WFC_Model));
+
+    const size_t arena_bytes = WFC_StateSize(model, 10, 10);
+    uint8_t *arena = (uint8_t*)aligned_alloc(WFC_ARENA_ALIGN, WFC_ALIGN_UP(arena_bytes + WFC_ARENA_ALIGN, WFC_ARENA_ALIGN));
+    assert(NULL != arena);
+
+    // an empty output, or one too large to index, is rejected before anything is written
+    WFC_State state = {0};
+    assert(0 == WFC_StateSize(model, 0, 10));
+    assert(0 == WFC_StateSize(model, 0x10000, 0x10000));
+    assert(0 == WFC_StateSize(model, 0x4000, 0x4000));
+    assert(WFC_RESULT_ERROR == WFC_StateInitInArena(&state, model, 10, 0, arena, arena_bytes));
+    assert(WFC_RESULT_ERROR == WFC_StateInitFromModel(&state, model, 0, 10));
+    assert(WFC_RESULT_ERROR == WFC_StateInitFromModel(&state, model, 0x10000, 0x10000));
+
+    // as is an empty input, or one whose size overflows
+    WFC_Model *invalid = NULL;
+    assert(WFC_RESULT_ERROR == WFC_ModelCreate(&invalid, 0, 4, gv_test_rings));
+    assert(WFC_RESULT_ERROR == WFC_ModelCreate(&invalid, 4, 0, gv_test_rings));
+    assert(WFC_RESULT_ERROR == WFC_ModelCreate(&invalid, 0x10000, 0x10000, gv_test_rings));
+    assert(NULL == invalid);
+
+    // an arena which is too small or misaligned is rejected
+    assert(WFC_RESULT_ERROR == WFC_StateInitInArena(&state, model, 10, 10, arena, arena_bytes - 1));
+    assert(WFC_RESULT_ERROR == WFC_StateInitInArena(&state, model, 10, 10, arena + 8, arena_bytes));
+
+    // a state in an arena never allocates while initializing or solving
+    const uint32_t num_allocs = counts.num_allocs;
+    assert(WFC_RESULT_OKAY == WFC_StateInitInArena(&state, model, 10, 10, arena, arena_bytes));
+    assert(NULL == state.memory);
+    assert((uint8_t*)state.output >= arena);
+    assert((uint8_t*)state.heap.positions < arena + arena_bytes);
+
+    WFC_RESULT_ENUM result = WFC_RESULT_CONTINUE;
+    while (WFC_RESULT_CONTINUE == result) {
+        result = WFC_Step(&state);
+    }
+    assert(num_allocs == counts.num_allocs);
+
+    // and makes the same choices as a state which allocates its own buffers
+    WFC_State allocated = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(&allocated, model, 10, 10));
+    assert(num_allocs + 1 == counts.num_allocs);
+
+    result = WFC_RESULT_CONTINUE;
+    while (WFC_RESULT_CONTINUE == result) {
+        result = WFC_Step(&allocated);
+    }
+    assert(memcmp(state.output,
+                  allocated.output,
+                  sizeof(uint64_t) * model->propagator.bitmap_words * 10 * 10) == 0);
+
+    WFC_StateDestroy(&allocated);
+    WFC_StateDestroy(&state);
+    WFC_ModelRelease(model);
+    free(arena);
+
+    // everything went through the hooks
+    assert(0 == counts.num_live);
+    WFC_SetAllocator(NULL);
+}
+#endif
+
+void WFC_PrintTile(WFC_Tile tile) {
+    for (uint32_t y = 0; y < WFC_N; y++) {
+        printf("\t\t");
+        for (uint32_t x = 0; x < WFC_N; x++) {
+            printf("%*X", (WFC_CELL_NUM_BITS + 3) / 4, (unsigned)(tile >> WFC_CELL_SHIFT(x, y)) & WFC_CELL_MASK);
+        }
+        printf("\n");
+    }
+}
+
+void WFC_PrintState(WFC_State *state) {
+    const WFC_Model *model = state->model;
+
+    printf("WFC_State: \n");
+    // a model loaded from a file has no input
+    printf("\tinput:\n");
+    for (uint32_t y = 0; y < model->input_height; y++) {
+        printf("\t\t");
+        for (uint32_t x = 0; x < model->input_width; x++) {
+            printf("%0*X", (WFC_CELL_NUM_BITS + 3) / 4, model->input[x + y * model->input_width]);
+        }
+        printf("\n");
+    }
+
+    printf("\tpatterns (%d):\n", state->model->propagator.num_patterns);
+    for (uint32_t pattern_index = 0; pattern_index < state->model->propagator.num_patterns; pattern_index++) {
+        WFC_Pattern pattern = state->model->propagator.patterns[pattern_index];
+        printf("\t\tindex %d (count %d)\n", pattern.index, pattern.count);
+        WFC_PrintTile(pattern.tile);
+    }
+    printf("\n");
+}
+
+uint64_t *WFC_GetOutputBitmap(WFC_State *state, WFC_Pos pos) {
+    uint32_t pixel_index = pos.x + pos.y * state->output_width;
+
+    return &state->output[pixel_index * state->model->propagator.bitmap_words];
+}
+
+uint64_t *WFC_GetIndexBitmap(const WFC_Propagator *propagator, uint32_t pattern, uint32_t adjacent) {
+    const uint32_t num_patterns = propagator->num_patterns;
+
+    return &propagator->index[WFC_PATTERN_INDEX(num_patterns, propagator->num_adjacent, pattern) +
+                              WFC_ADJACENT_INDEX(num_patterns, adjacent)];
+}
+
+const WFC_Pos *WFC_AdjacentOffsets(uint32_t num_adjacent) {
+    return (WFC_ADJACENCY_CARDINAL == num_adjacent) ? gv_cardinal_offsets : gv_adjacent_offsets;
+}
+
+/** Offset a given position by a given offset, wrapping around a grid of a given
+ * width and height.
+ */
+WFC_Pos WFC_OffsetFrom(WFC_Pos pos, WFC_Pos offset, uint32_t width, uint32_t height) {
+    WFC_Pos loc = pos;
+
+    loc.x = loc.x + offset.x;
+    if (loc.x < 0) {
+        loc.x = width + loc.x;
+    }
+    loc.x %= width;
+
+    loc.y = loc.y + offset.y;
+    if (loc.y < 0) {
+        loc.y = height + loc.y;
+    }
+    loc.y %= height;
+
+    return loc;
+}
+
+#if defined(WFC_TEST)
+bool WFC_PosEqual(WFC_Pos first, WFC_Pos second) {
+    return (first.x == second.x) && (first.y == second.y);
+}
+
+void WFC_TestOffsetFrom(void) {
+    WFC_Pos pos = { .x = 0, .y = 0};
+    WFC_Pos answer;
+
+    WFC_Pos offset;
+    offset.x = 1;
+    offset.y = 1;
+
+    answer = WFC_OffsetFrom(pos, offset, 10, 10);
+    assert(WFC_PosEqual((WFC_Pos){ .x = 1, .y = 1 }, answer));
+
+    offset.x = 1;
+    offset.y = -1;
+    answer = WFC_OffsetFrom(pos, offset, 10, 10);
+    assert(WFC_PosEqual((WFC_Pos){ .x = 1, .y = 9 }, answer));
+}
+
+void WFC_TestNeighbours(void) {
+    WFC_Model *model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&model, 4, 4, gv_test_rings));
+
+    // the tables agree with wrapping each offset, including on grids too narrow to have an interior
+    WFC_Pos sizes[] = { { 7, 5 }, { 1, 3 }, { 2, 2 } };
+    for (uint32_t size_index = 0; size_index < sizeof(sizes) / sizeof(sizes[0]); size_index++) {
+        const uint32_t width = sizes[size_index].x;
+        const uint32_t height = sizes[size_index].y;
+
+        WFC_State state = {0};
+        assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(&state, model, width, height));
+
+        for (uint32_t periodic = 0; periodic < 2; periodic++) {
+            assert(WFC_RESULT_OKAY == WFC_StateSetPeriodic(&state, periodic));
+
+            for (uint32_t pix_index = 0; pix_index < width * height; pix_index++) {
+                WFC_Pos pos = { pix_index % width, pix_index / width };
+                const uint8_t edges = state.edge_classes[pix_index];
+
+                for (uint32_t adj_index = 0; adj_index < WFC_NUM_ADJACENT; adj_index++) {
+                    WFC_Pos offset = gv_adjacent_offsets[adj_index];
+                    int32_t x = pos.x + offset.x;
+                    int32_t y = pos.y + offset.y;
+                    bool inside = (x >= 0) && (y >= 0) && (x < (int32_t)width) && (y < (int32_t)height);
+
+                    bool has_neighbour = 0 != (state.neighbour_directions[edges] & (1 << adj_index));
+                    assert(has_neighbour == (periodic || inside));
+
+                    WFC_Pos other_pos = WFC_OffsetFrom(pos, offset, width, height);
+                    assert((uint32_t)(other_pos.x + other_pos.y * width) ==
+                           pix_index + state.neighbour_deltas[edges][adj_index]);
+                }
+            }
+        }
+
+        WFC_StateDestroy(&state);
+    }
+
+    WFC_ModelRelease(model);
+}
+#endif
+
+/** Get the WFC_Tile from a given offset. This is a WFC_N x WFC_N pattern
+ * encoded into an integer, row by row.
+ */
+WFC_Tile WFC_TileAt(WFC_Pos pos, uint32_t width, uint32_t height, uint8_t *input) {
+    assert(NULL != input);
+
+    WFC_Tile tile = 0;
+
+    for (int32_t y = 0; y < WFC_N; y++) {
+        for (int32_t x = 0; x < WFC_N; x++) {
+            WFC_Pos loc = WFC_OffsetFrom(pos, (WFC_Pos){ x, y }, width, height);
+
+            tile = (WFC_Tile)(tile << WFC_CELL_NUM_BITS);
+
+            tile |= input[loc.x + loc.y * width];
+        }
+    }
+
+    return tile;
+}
+
+/** Find the slot of a tile in the table of patterns seen so far. The slot holds
+ * one more than the tile's pattern index, or 0 if the tile has not been seen.
+ */
+uint32_t *WFC_PatternLookup(const WFC_Propagator *propagator, uint32_t *lookup, size_t lookup_len, WFC_Tile tile) {
+#if WFC_TILE_BITS <= 16
+    // small tiles index the table directly
+    (void)propagator;
+    (void)lookup_len;
+
+    return &lookup[tile];
+#else
+    // larger tiles are hashed into a table kept at most half full, probing linearly
+    uint64_t hash = (uint64_t)tile;
+#if WFC_TILE_BITS > 64
+    hash ^= (uint64_t)(tile >> 64) * 0xC2B2AE3D27D4EB4FULL;
+#endif
+    size_t slot = (size_t)((hash * 0x9E3779B97F4A7C15ULL) >> 32) & (lookup_len - 1);
+
+    while ((0 != lookup[slot]) && (propagator->patterns[lookup[slot] - 1].tile != tile)) {
+        slot = (slot + 1) & (lookup_len - 1);
+    }
+
+    return &lookup[slot];
+#endif
+}
+
+WFC_RESULT_ENUM WFC_FindPatterns(WFC_Model *model) {
+    WFC_RESULT_ENUM result = WFC_RESULT_OKAY;
+
+    assert(NULL != model);
+
+    // there is at most one pattern per input pixel, so the tables never need to grow
+    model->propagator.max_patterns = model->input_width * model->input_height;
+
+    // table from each tile to one more than its pattern index, or 0 if the tile has not
+    // been seen yet. It has a slot per possible tile if WFC_Tile is small enough.
+#if WFC_TILE_BITS <= 16
+    size_t lookup_len = WFC_TILE_LOOKUP_LEN;
+#else
+    size_t lookup_len = 1;
+    while (lookup_len < 2 * (size_t)model->propagator.max_patterns) {
+        lookup_len *= 2;
+    }
+#endif
+    uint32_t *pattern_lookup = (uint32_t*)WFC_Calloc(lookup_len * sizeof(uint32_t));
+
+    model->propagator.patterns = (WFC_Pattern*)WFC_Malloc(sizeof(WFC_Pattern) * model->propagator.max_patterns);
+
+    if ((NULL == pattern_lookup) || (NULL == model->propagator.patterns)) {
+        result = WFC_RESULT_ERROR;
+    }
+
+    for (uint32_t y = 0; (WFC_RESULT_OKAY == result) && (y < model->input_height); y++) {
+        for (uint32_t x = 0; x < model->input_width; x++) {
+            WFC_Pos pos = { x, y };
+
+            // get the tile at the current location
+            WFC_Pattern pattern = {0};
+            pattern.tile = WFC_TileAt(pos, model->input_width, model->input_height, model->input);
+
+            // check if the pattern is already defined
+            uint32_t *lookup_slot = WFC_PatternLookup(&model->propagator, pattern_lookup, lookup_len, pattern.tile);
+            uint32_t lookup_entry = *lookup_slot;
+
+            // if not defined, add to the propagator table
+            if (0 == lookup_entry) {
+                assert(model->propagator.num_patterns < model->propagator.max_patterns);
+
+                pattern.count = 1;
+                pattern.index = model->propagator.num_patterns;
+                model->propagator.patterns[model->propagator.num_patterns] = pattern;
+                model->propagator.num_patterns++;
+
+                *lookup_slot = model->propagator.num_patterns;
+            } else {
+                // found another occurrance, so bump the count
+                model->propagator.patterns[lookup_entry - 1].count++;
+            }
+        }
+    }
+
+    WFC_Free(pattern_lookup);
+
+    return result;
+}
+
+#if defined(WFC_TEST)
+void WFC_TestFindPatterns(void) {
+    WFC_State state = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInit(&state, 4, 4, gv_test_rings, 4, 4));
+
+    // every input pixel contributes one occurrance, and patterns are unique
+    uint32_t total_count = 0;
+    for (uint32_t pattern_index = 0; pattern_index < state.model->propagator.num_patterns; pattern_index++) {
+        WFC_Pattern *pattern = &state.model->propagator.patterns[pattern_index];
+
+        assert(pattern->index == pattern_index);
+        total_count += pattern->count;
+
+        for (uint32_t other_index = pattern_index + 1; other_index < state.model->propagator.num_patterns; other_index++) {
+            assert(pattern->tile != state.model->propagator.patterns[other_index].tile);
+        }
+    }
+    assert(total_count == 16);
+
+#if WFC_N == 2
+    // the top left corner wraps around to the tile with a single 1 in its last cell, which only occurs there
+    assert(state.model->propagator.patterns[0].tile == 0x0001);
+    assert(state.model->propagator.patterns[0].count == 1);
+#endif
+
+    WFC_StateDestroy(&state);
+}
+#endif
+
+int WFC_CompareOverlapKeys(const void *first, const void *second) {
+    WFC_Tile first_key = ((const WFC_OverlapKey*)first)->key;
+    WFC_Tile second_key = ((const WFC_OverlapKey*)second)->key;
+
+    return (first_key > second_key) - (first_key < second_key);
+}
+
+/** Fill in the index by bucketing patterns on the part of them which overlaps a
+ * neighbour. Two patterns overlap exactly when the shifted, masked part of the first
+ * equals the masked part of the second, so each pattern only visits the patterns in
+ * its bucket instead of comparing against every other pattern.
+ */
+WFC_RESULT_ENUM WFC_IndexInit(WFC_Model *model) {
+    WFC_RESULT_ENUM result = WFC_RESULT_OKAY;
+
+    assert(NULL != model);
+
+    const uint32_t num_patterns = model->propagator.num_patterns;
+    const uint32_t num_adjacent = model->propagator.num_adjacent;
+    const WFC_Pos *adjacent_offsets = WFC_AdjacentOffsets(num_adjacent);
+
+    WFC_OverlapKey *keys = (WFC_OverlapKey*)WFC_Malloc(sizeof(WFC_OverlapKey) * num_patterns);
+
+    if (NULL == keys) {
+        result = WFC_RESULT_ERROR;
+    }
+
+    // overlapping is symmetric, so only the first half of the adjacencies are matched and
+    // their opposites are marked as we go.
+    for (uint8_t adj_index = 0; (WFC_RESULT_OKAY == result) && (adj_index < (num_adjacent / 2)); adj_index++) {
+        WFC_Pos adjacency = adjacent_offsets[adj_index];
+        WFC_Pos opposite = { -adjacency.x, -adjacency.y };
+        uint8_t opposite_index = WFC_OPPOSITE_ADJACENT(adj_index, num_adjacent);
+
+        // sort the patterns by the part that a pattern on the opposite side overlaps
+        for (uint32_t other_pat_index = 0; other_pat_index < num_patterns; other_pat_index++) {
+            keys[other_pat_index].key = WFC_MaskTile(model->propagator.patterns[other_pat_index].tile, opposite);
+            keys[other_pat_index].pattern = other_pat_index;
+        }
+        qsort(keys, num_patterns, sizeof(WFC_OverlapKey), WFC_CompareOverlapKeys);
+
+        for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
+            WFC_Tile tile = model->propagator.patterns[pat_index].tile;
+            WFC_Tile key = WFC_ShiftTile(WFC_MaskTile(tile, adjacency), adjacency);
+
+            // binary search for the start of this key's bucket
+            uint32_t low = 0;
+            uint32_t high = num_patterns;
+            while (low < high) {
+                uint32_t middle = low + (high - low) / 2;
+                if (keys[middle].key < key) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+
+            uint64_t *index_bitmap = WFC_GetIndexBitmap(&model->propagator, pat_index, adj_index);
+
+            for (uint32_t key_index = low; (key_index < num_patterns) && (keys[key_index].key == key); key_index++) {
+                uint32_t other_pat_index = keys[key_index].pattern;
+
+                WFC_BitmapSet(index_bitmap, other_pat_index);
+                WFC_BitmapSet(WFC_GetIndexBitmap(&model->propagator, other_pat_index, opposite_index), pat_index);
+            }
+        }
+    }
+
+    WFC_Free(keys);
+
+    return result;
+}
+
+#if defined(WFC_TEST)
+void WFC_TestIndexInit(void) {
+    // a noisy input gives a large number of patterns
+    uint8_t input[16 * 16];
+    WFC_TestNoise(input, sizeof(input), 1234, 3);
+
+    // the bucketed index must match comparing every pair of patterns, for either adjacency
+    WFC_ADJACENCY_ENUM adjacencies[] = { WFC_ADJACENCY_ALL, WFC_ADJACENCY_CARDINAL };
+    for (uint32_t adjacency_index = 0; adjacency_index < 2; adjacency_index++) {
+        WFC_Model *model = NULL;
+        assert(WFC_RESULT_OKAY == WFC_ModelCreateWithAdjacency(&model, 16, 16, input, adjacencies[adjacency_index]));
+        assert(model->propagator.num_patterns > 64);
+
+        const uint32_t num_adjacent = model->propagator.num_adjacent;
+        const WFC_Pos *adjacent_offsets = WFC_AdjacentOffsets(num_adjacent);
+
+        for (uint32_t pat_index = 0; pat_index < model->propagator.num_patterns; pat_index++) {
+            WFC_Tile tile = model->propagator.patterns[pat_index].tile;
+
+            for (uint32_t adj_index = 0; adj_index < num_adjacent; adj_index++) {
+                uint64_t *index_bitmap = WFC_GetIndexBitmap(&model->propagator, pat_index, adj_index);
+
+                for (uint32_t other_pat_index = 0; other_pat_index < model->propagator.num_patterns; other_pat_index++) {
+                    WFC_Tile other_tile = model->propagator.patterns[other_pat_index].tile;
+
+                    assert(WFC_BitmapGet(index_bitmap, other_pat_index) ==
+                           WFC_TilesOverlap(tile, other_tile, adjacent_offsets[adj_index]));
+                }
+            }
+        }
+
+        WFC_ModelRelease(model);
+    }
+}
+#endif
+
+WFC_Tile WFC_MaskTile(WFC_Tile tile, WFC_Pos adjacency) {
+    // keep the columns and rows which a neighbour in this direction also covers
+    return tile & gv_column_masks[adjacency.x + 1] & gv_row_masks[adjacency.y + 1];
+}
+
+WFC_Tile WFC_ShiftTile(WFC_Tile tile, WFC_Pos adjacency) {
+    WFC_Tile tile_part = tile;
+
+    if (adjacency.x == 1) {
+        tile_part = (WFC_Tile)(tile_part << WFC_CELL_NUM_BITS);
+    } else if (adjacency.x == -1) {
+        tile_part = tile_part >> WFC_CELL_NUM_BITS;
+    }
+
+    if (adjacency.y == 1) {
+        tile_part = (WFC_Tile)(tile_part << WFC_ROW_BITS);
+    } else if (adjacency.y == -1) {
+        tile_part = tile_part >> WFC_ROW_BITS;
+    }
+
+    return tile_part;
+}
+
+bool WFC_TilesOverlap(WFC_Tile tile, WFC_Tile other_tile, WFC_Pos adjacency) {
+    WFC_Tile tile_part = WFC_ShiftTile(WFC_MaskTile(tile, adjacency), adjacency);
+    WFC_Tile other_tile_part = WFC_MaskTile(other_tile, (WFC_Pos){-adjacency.x, -adjacency.y});
+    //log_trace("%04X tile", tile_part);
+    //log_trace("%04X other", other_tile_part);
+
+    return tile_part == other_tile_part;
+}
+
+#if defined(WFC_TEST)
+void WFC_TestTileOverlap(void) {
+    // random tiles overlap a neighbour exactly when the cells they share match one by one
+    uint32_t seed = 4471;
+    for (uint32_t trial = 0; trial < 256; trial++) {
+        // cells are mostly 0 or 1, so a good share of pairs overlap
+        WFC_Tile tiles[2] = { 0, 0 };
+        for (uint32_t tile_index = 0; tile_index < 2; tile_index++) {
+            for (uint32_t cell_index = 0; cell_index < WFC_PATTERN_LEN; cell_index++) {
+                seed = WFC_XorShift(seed);
+                uint32_t cell = ((seed % 16) != 0) ? ((seed >> 8) & 1) : ((seed >> 8) & WFC_CELL_MASK);
+                tiles[tile_index] = (WFC_Tile)(tiles[tile_index] << WFC_CELL_NUM_BITS) | cell;
+            }
+        }
+
+        for (uint32_t adj_index = 0; adj_index < WFC_NUM_ADJACENT; adj_index++) {
+            WFC_Pos adjacency = gv_adjacent_offsets[adj_index];
+
+            bool cells_match = true;
+            for (int32_t y = 0; y < WFC_N; y++) {
+                for (int32_t x = 0; x < WFC_N; x++) {
+                    int32_t other_x = x - adjacency.x;
+                    int32_t other_y = y - adjacency.y;
+                    if ((other_x >= 0) && (other_y >= 0) && (other_x < WFC_N) && (other_y < WFC_N)) {
+                        uint32_t cell = (uint32_t)(tiles[0] >> WFC_CELL_SHIFT(x, y)) & WFC_CELL_MASK;
+                        uint32_t other_cell = (uint32_t)(tiles[1] >> WFC_CELL_SHIFT(other_x, other_y)) & WFC_CELL_MASK;
+                        cells_match = cells_match && (cell == other_cell);
+                    }
+                }
+            }
+
+            assert(cells_match == WFC_TilesOverlap(tiles[0], tiles[1], adjacency));
+            assert(cells_match == WFC_TilesOverlap(tiles[1], tiles[0], (WFC_Pos){ -adjacency.x, -adjacency.y }));
+        }
+    }
+
+#if (WFC_N == 2) && (WFC_CELL_NUM_BITS == 4)
+    assert(WFC_TilesOverlap(0x0001, 0x1000, (WFC_Pos){1, 1}));
+    assert(WFC_TilesOverlap(0x1234, 0x4321, (WFC_Pos){1, 1}));
+
+    assert(WFC_TilesOverlap(0x1234, 0x2040, (WFC_Pos){1, 0}));
+    assert(WFC_TilesOverlap(0x1234, 0x2948, (WFC_Pos){1, 0}));
+
+    assert(WFC_TilesOverlap(0x1234, 0x3400, (WFC_Pos){0, 1}));
+
+    assert(WFC_TilesOverlap(0x1234, 0x0001, (WFC_Pos){-1, -1}));
+
+    assert(WFC_TilesOverlap(0x1234, 0x0103, (WFC_Pos){-1, 0}));
+
+    assert(WFC_TilesOverlap(0x1234, 0x0012, (WFC_Pos){0, -1}));
+#endif
+}
+#endif
+
+/** Shannon entropy of the patterns still valid at a pixel, weighting each pattern
+ * by its count. This uses the sums cached in state->entropies, so it does not
+ * depend on the number of patterns.
+ */
+double WFC_Entropy(WFC_State *state, uint32_t pixel_index) {
+    WFC_CellEntropy *cell = &state->entropies[pixel_index];
+
+    double sum_weights = cell->sum_weights;
+
+    return log(sum_weights) - (cell->sum_weight_log_weights / sum_weights);
+}
+
+void WFC_UpdateKey(WFC_State *state, uint32_t pixel_index) {
+    WFC_CellEntropy *cell = &state->entropies[pixel_index];
+
+    // entropies are at most log(UINT16_MAX), so 28 fractional bits fit in the upper word.
+    // Entropies within rounding of each other compare equal and fall to the tie break.
+    double entropy = WFC_Entropy(state, pixel_index);
+    uint64_t fixed = (entropy > 0.0) ? (uint64_t)(entropy * (double)(1 << WFC_ENTROPY_FRACTION_BITS) + 0.5) : 0;
+
+    cell->key = (fixed << 32) | cell->tie_break;
+}
+
+void WFC_HeapSiftUp(WFC_State *state, uint32_t heap_index) {
+    WFC_Heap *heap = &state->heap;
+
+    uint32_t pixel_index = heap->items[heap_index];
+    uint64_t key = state->entropies[pixel_index].key;
+
+    while (heap_index > 0) {
+        uint32_t parent_index = (heap_index - 1) / 2;
+        uint32_t parent_pixel = heap->items[parent_index];
+
+        if (state->entropies[parent_pixel].key <= key) {
+            break;
+        }
+
+        heap->items[heap_index] = parent_pixel;
+        heap->positions[parent_pixel] = heap_index;
+        heap_index = parent_index;
+    }
+
+    heap->items[heap_index] = pixel_index;
+    heap->positions[pixel_index] = heap_index;
+}
+
+void WFC_HeapSiftDown(WFC_State *state, uint32_t heap_index) {
+    WFC_Heap *heap = &state->heap;
+
+    uint32_t pixel_index = heap->items[heap_index];
+    uint64_t key = state->entropies[pixel_index].key;
+
+    while (true) {
+        uint32_t child_index = heap_index * 2 + 1;
+
+        if (child_index >= heap->num_items) {
+            break;
+        }
+
+        uint64_t child_key = state->entropies[heap->items[child_index]].key;
+
+        // pick the smaller of the two children
+        if ((child_index + 1) < heap->num_items) {
+            uint64_t right_key = state->entropies[heap->items[child_index + 1]].key;
+            if (right_key < child_key) {
+                child_index++;
+                child_key = right_key;
+            }
+        }
+
+        if (key <= child_key) {
+            break;
+        }
+
+        heap->items[heap_index] = heap->items[child_index];
+        heap->positions[heap->items[heap_index]] = heap_index;
+        heap_index = child_index;
+    }
+
+    heap->items[heap_index] = pixel_index;
+    heap->positions[pixel_index] = heap_index;
+}
+
+void WFC_HeapUpdate(WFC_State *state, uint32_t pixel_index) {
+    uint32_t heap_index = state->heap.positions[pixel_index];
+
+    if (WFC_HEAP_NONE != heap_index) {
+        WFC_UpdateKey(state, pixel_index);
+
+        // removing a dominant pattern can raise the entropy, so the key may move either way
+        WFC_HeapSiftUp(state, heap_index);
+        WFC_HeapSiftDown(state, state->heap.positions[pixel_index]);
+    }
+}
+
+void WFC_HeapRemove(WFC_State *state, uint32_t pixel_index) {
+    WFC_Heap *heap = &state->heap;
+    uint32_t heap_index = heap->positions[pixel_index];
+
+    if (WFC_HEAP_NONE == heap_index) {
+        return;
+    }
+
+    heap->positions[pixel_index] = WFC_HEAP_NONE;
+    heap->num_items--;
+
+    // move the last item into the hole and restore the heap order around it
+    if (heap_index != heap->num_items) {
+        uint32_t moved_pixel = heap->items[heap->num_items];
+
+        heap->items[heap_index] = moved_pixel;
+        heap->positions[moved_pixel] = heap_index;
+        WFC_HeapSiftUp(state, heap_index);
+        WFC_HeapSiftDown(state, heap->positions[moved_pixel]);
+    }
+}
+
+void WFC_HeapInsert(WFC_State *state, uint32_t pixel_index) {
+    WFC_Heap *heap = &state->heap;
+
+    assert(WFC_HEAP_NONE == heap->positions[pixel_index]);
+
+    WFC_UpdateKey(state, pixel_index);
+
+    heap->items[heap->num_items] = pixel_index;
+    heap->positions[pixel_index] = heap->num_items;
+    heap->num_items++;
+
+    WFC_HeapSiftUp(state, heap->num_items - 1);
+}
+
+uint32_t WFC_StateRemaining(const WFC_State *state) {
+    assert(NULL != state);
+
+    // the heap holds exactly the undecided pixels, swap-removing each as it is decided
+    return state->heap.num_items;
+}
+
+WFC_RESULT_ENUM WFC_LowestEntropy(WFC_State *state, WFC_Pos *pos) {
+    assert(NULL != state);
+    assert(NULL != pos);
+
+    // every pixel has been collapsed to a single pattern
+    if (WFC_StateRemaining(state) == 0) {
+        return WFC_RESULT_FINISHED;
+    }
+
+    uint32_t pixel_index = state->heap.items[0];
+    pos->x = pixel_index % state->output_width;
+    pos->y = pixel_index / state->output_width;
+
+    return WFC_RESULT_CONTINUE;
+}
+
+WFC_RESULT_ENUM WFC_Observe(WFC_State *state, WFC_Pos *pos) {
+    assert(NULL != state);
+    assert(NULL != pos);
+
+    WFC_STATS_BEGIN(start);
+    WFC_TRACE_BEGIN("observe");
+
+    WFC_RESULT_ENUM result;
+    result = WFC_LowestEntropy(state, pos);
+
+    if (result == WFC_RESULT_CONTINUE) {
+        uint32_t pixel_index = pos->x + pos->y * state->output_width;
+        uint32_t n = WFC_Random(state->seed, pixel_index, state->step_num) % state->entropies[pixel_index].sum_weights;
+
+        uint32_t chosen_pattern = WFC_ChoosePattern(state, pixel_index, n);
+
+        // remember the choice so it can be undone if it leads to a contradiction
+        if (state->backtrack.enabled) {
+            WFC_Decision *decision = &state->backtrack.decisions[state->backtrack.num_decisions];
+            decision->trail_len = state->backtrack.trail_len;
+            decision->pixel_index = pixel_index;
+            decision->pattern = chosen_pattern;
+            state->backtrack.num_decisions++;
+        }
+
+        // the chosen pattern stays valid, so this can only fail to record the removals
+        if (WFC_RESULT_OKAY != WFC_Collapse(state, pixel_index, chosen_pattern)) {
+            result = WFC_RESULT_ERROR;
+        }
+    }
+
+    WFC_TRACE_END("observe");
+    WFC_STATS_END(state, observe_cycles, start);
+
+    return result;
+}
+
+/** Choose a pattern by walking the valid patterns, removing counts until 'n' lands in
+ * a pattern's range. Only set bits are visited, and a word whose patterns are all
+ * still valid is stepped over, or searched, with the model's prefix sums of counts.
+ * This lands on the same pattern as walking every pattern in order would.
+ */
+uint32_t WFC_ChoosePattern(WFC_State *state, uint32_t pixel_index, uint32_t n) {
+    const WFC_Model *model = state->model;
+    const uint32_t num_patterns = model->propagator.num_patterns;
+    const uint32_t bitmap_words = model->propagator.bitmap_words;
+    const uint64_t *output_bitmap = &state->output[pixel_index * bitmap_words];
+
+    for (uint32_t word_index = 0; word_index < bitmap_words; word_index++) {
+        uint64_t word = output_bitmap[word_index];
+
+        if (0 == word) {
+            continue;
+        }
+
+        uint32_t first_pattern = word_index * WFC_BITMAP_WORD_BITS;
+        uint32_t end_pattern = first_pattern + WFC_BITMAP_WORD_BITS;
+        if (end_pattern > num_patterns) {
+            end_pattern = num_patterns;
+        }
+
+        uint32_t num_word_patterns = end_pattern - first_pattern;
+        uint64_t full_word = (num_word_patterns == WFC_BITMAP_WORD_BITS) ? ~0ULL : ((1ULL << num_word_patterns) - 1);
+
+        if (word == full_word) {
+            uint32_t word_weight = model->prefix_weights[end_pattern] - model->prefix_weights[first_pattern];
+
+            if (n >= word_weight) {
+                n -= word_weight;
+                continue;
+            }
+
+            // the last pattern whose prefix sum is at most n
+            uint32_t target = model->prefix_weights[first_pattern] + n;
+            uint32_t low = first_pattern;
+            uint32_t high = end_pattern - 1;
+            while (low < high) {
+                uint32_t middle = (low + high + 1) / 2;
+
+                if (model->prefix_weights[middle] <= target) {
+                    low = middle;
+                } else {
+                    high = middle - 1;
+                }
+            }
+
+            return low;
+        }
+
+        while (0 != word) {
+            uint32_t pat_index = first_pattern + __builtin_ctzll(word);
+            uint32_t count = model->propagator.patterns[pat_index].count;
+
+            if (n < count) {
+                return pat_index;
+            }
+
+            n -= count;
+            word &= word - 1;
+        }
+    }
+
+    // n is always less than the pixel's sum of counts
+    assert(false);
+    return WFC_BITMAP_END;
+}
+
+WFC_RESULT_ENUM WFC_TrailReserve(WFC_State *state, uint32_t num_entries) {
+    // the trail never needs more than one entry per pattern per pixel, so doubling settles quickly
+    uint32_t new_max_trail_len = state->backtrack.max_trail_len;
+    while (state->backtrack.trail_len + num_entries > new_max_trail_len) {
+        new_max_trail_len *= 2;
+    }
+
+    if (new_max_trail_len != state->backtrack.max_trail_len) {
+        WFC_TrailEntry *trail =
+            (WFC_TrailEntry*)WFC_Realloc(state->backtrack.trail,
+                                         sizeof(WFC_TrailEntry) * state->backtrack.max_trail_len,
+                                         sizeof(WFC_TrailEntry) * new_max_trail_len);
+
+        if (NULL == trail) {
+            return WFC_RESULT_ERROR;
+        }
+
+        state->backtrack.trail = trail;
+        state->backtrack.max_trail_len = new_max_trail_len;
+    }
+
+    return WFC_RESULT_OKAY;
+}
+
+/** Remove every other pattern from a pixel, as a call to WFC_Ban for each would,
+ * but with one masked write per bitmap word. The pixel's entropy terms are set
+ * to those of the single pattern left rather than updated once per pattern.
+ */
+WFC_RESULT_ENUM WFC_Collapse(WFC_State *state, uint32_t pixel_index, uint32_t pattern) {
+    const WFC_Model *model = state->model;
+    const uint32_t bitmap_words = model->propagator.bitmap_words;
+
+    uint64_t *output_bitmap = &state->output[pixel_index * bitmap_words];
+    uint64_t *removed_bitmap = &state->removed[pixel_index * bitmap_words];
+
+    assert(WFC_BitmapGet(output_bitmap, pattern));
+
+    WFC_CellEntropy *cell = &state->entropies[pixel_index];
+    uint32_t num_removed = cell->num_valid - 1;
+
+    if (0 == num_removed) {
+        return WFC_RESULT_OKAY;
+    }
+
+    if (state->backtrack.enabled && (WFC_RESULT_OKAY != WFC_TrailReserve(state, num_removed))) {
+        return WFC_RESULT_ERROR;
+    }
+
+    uint32_t directions = 0;
+
+    for (uint32_t word_index = 0; word_index < bitmap_words; word_index++) {
+        uint64_t keep = (word_index == (pattern / WFC_BITMAP_WORD_BITS)) ? (1ULL << (pattern % WFC_BITMAP_WORD_BITS)) : 0;
+        uint64_t banned = output_bitmap[word_index] & ~keep;
+
+        if (0 == banned) {
+            continue;
+        }
+
+        output_bitmap[word_index] &= keep;
+        removed_bitmap[word_index] |= banned;
+
+        // the directions and trail entries still need each removed pattern
+        while (0 != banned) {
+            uint32_t pat_index = word_index * WFC_BITMAP_WORD_BITS + __builtin_ctzll(banned);
+            banned &= banned - 1;
+
+            directions |= model->pattern_directions[pat_index];
+
+            if (state->backtrack.enabled) {
+                WFC_TrailEntry *entry = &state->backtrack.trail[state->backtrack.trail_len];
+                entry->pixel_index = pixel_index;
+                entry->pattern = pat_index;
+                state->backtrack.trail_len++;
+            }
+        }
+    }
+
+    WFC_STATS_ADD(state, bits_cleared, num_removed);
+
+    if (!WFC_BitmapGet(state->queued, pixel_index)) {
+        WFC_BitmapSet(state->queued, pixel_index);
+        WFC_QueuePush(&state->queue, pixel_index);
+
+        WFC_STATS_ADD(state, queue_pushes, 1);
+        WFC_STATS_MAX(state, queue_high_water, state->queue.num_items);
+    }
+    state->queued_directions[pixel_index] |= directions;
+
+    cell->num_valid = 1;
+    cell->sum_weights = model->propagator.patterns[pattern].count;
+    cell->sum_weight_log_weights = model->propagator.weight_log_weights[pattern];
+
+    WFC_HeapRemove(state, pixel_index);
+
+    return WFC_RESULT_OKAY;
+}
+
+WFC_RESULT_ENUM WFC_Ban(WFC_State *state, uint32_t pixel_index, uint32_t pattern) {
+    uint64_t *output_bitmap = &state->output[pixel_index * state->model->propagator.bitmap_words];
+
+    if (!WFC_BitmapGet(output_bitmap, pattern)) {
+        return WFC_RESULT_OKAY;
+    }
+
+    if (state->backtrack.enabled) {
+        if (WFC_RESULT_OKAY != WFC_TrailReserve(state, 1)) {
+            return WFC_RESULT_ERROR;
+        }
+
+        WFC_TrailEntry *entry = &state->backtrack.trail[state->backtrack.trail_len];
+        entry->pixel_index = pixel_index;
+        entry->pattern = pattern;
+        state->backtrack.trail_len++;
+    }
+
+    WFC_BitmapClear(output_bitmap, pattern);
+    WFC_STATS_ADD(state, bits_cleared, 1);
+
+    WFC_BitmapSet(&state->removed[pixel_index * state->model->propagator.bitmap_words], pattern);
+
+    if (!WFC_BitmapGet(state->queued, pixel_index)) {
+        WFC_BitmapSet(state->queued, pixel_index);
+        WFC_QueuePush(&state->queue, pixel_index);
+
+        WFC_STATS_ADD(state, queue_pushes, 1);
+        WFC_STATS_MAX(state, queue_high_water, state->queue.num_items);
+    }
+    state->queued_directions[pixel_index] |= state->model->pattern_directions[pattern];
+
+    // keep the cached entropy terms in step with the bitmap
+    WFC_CellEntropy *cell = &state->entropies[pixel_index];
+    cell->num_valid--;
+    cell->sum_weights -= state->model->propagator.patterns[pattern].count;
+    cell->sum_weight_log_weights -= state->model->propagator.weight_log_weights[pattern];
+
+    if (cell->num_valid <= 1) {
+        // decided pixels, and pixels with no valid patterns, are no longer candidates
+        WFC_HeapRemove(state, pixel_index);
+    } else {
+        WFC_HeapUpdate(state, pixel_index);
+    }
+
+    // check for a contradiction- a pixel with no valid patterns
+    if (cell->num_valid == 0) {
+        WFC_STATS_ADD(state, contradictions, 1);
+        WFC_TRACE_INSTANT("contradiction", "pixel", pixel_index);
+        return WFC_RESULT_RESTART;
+    }
+
+    return WFC_RESULT_OKAY;
+}
+
+void WFC_QueuePush(WFC_Queue *queue, uint32_t pixel_index) {
+    assert(queue->num_items < queue->max_items);
+
+    uint32_t item_index = queue->head + queue->num_items;
+    if (item_index >= queue->max_items) {
+        item_index -= queue->max_items;
+    }
+
+    queue->items[item_index] = pixel_index;
+    queue->num_items++;
+}
+
+uint32_t WFC_QueuePop(WFC_Queue *queue) {
+    assert(queue->num_items > 0);
+
+    uint32_t item_index;
+    if (WFC_QUEUE_ORDER_FIFO == queue->order) {
+        item_index = queue->head;
+
+        queue->head++;
+        if (queue->head == queue->max_items) {
+            queue->head = 0;
+        }
+    } else {
+        item_index = queue->head + queue->num_items - 1;
+        if (item_index >= queue->max_items) {
+            item_index -= queue->max_items;
+        }
+    }
+
+    queue->num_items--;
+
+    return queue->items[item_index];
+}
+
+/** Propagate removed patterns through the output using the AC-4 algorithm.
+ *
+ * Each pixel keeps, for each pattern and direction, the number of patterns in the
+ * neighbouring pixel in that direction which still allow it. When a pattern is removed
+ * from a pixel, only the patterns it allowed in each neighbour have their count
+ * decremented, and a pattern whose count reaches 0 is removed in turn.
+ *
+ * This is always inlined so that WFC_Propagate can pass a constant 'bitmap_words' of 1 for
+ * models with at most 64 patterns, leaving a copy with the word loops folded away.
+ */
+static inline __attribute__((always_inline))
+WFC_RESULT_ENUM WFC_PropagateWords(WFC_State *state, const uint32_t bitmap_words) {
+    WFC_RESULT_ENUM result = WFC_RESULT_CONTINUE;
+
+    const uint32_t num_patterns = state->model->propagator.num_patterns;
+    const uint32_t num_adjacent = state->model->propagator.num_adjacent;
+    const WFC_BitmapKernels *kernels = WFC_GetBitmapKernels();
+
+    // A pattern already removed from a neighbour never has its support read again, so only
+    // the patterns it still allows are walked. Backtracking can restore removed patterns,
+    // and gives back support for every pattern in the index row, so it walks them all.
+    const bool intersect = !state->backtrack.enabled;
+
+    while ((WFC_RESULT_CONTINUE == result) && (state->queue.num_items > 0)) {
+        // pop off an item
+        uint32_t pixel_index = WFC_QueuePop(&state->queue);
+        WFC_STATS_ADD(state, queue_pops, 1);
+
+        uint64_t *removed_bitmap = &state->removed[pixel_index * bitmap_words];
+
+        // only neighbours in directions the removed patterns allowed something in lose support,
+        // and off the edges of a non-periodic output there are none
+        const uint8_t edges = state->edge_classes[pixel_index];
+        const int32_t *deltas = state->neighbour_deltas[edges];
+        uint32_t directions = state->queued_directions[pixel_index] & state->neighbour_directions[edges];
+        state->queued_directions[pixel_index] = 0;
+        WFC_BitmapClear(state->queued, pixel_index);
+
+        for (uint32_t word_index = 0; word_index < bitmap_words; word_index++) {
+            // A pixel which is its own neighbour, in a periodic output one pixel wide or high, can
+            // remove patterns from itself while it is propagated. Those in words already passed are
+            // left pending and the pixel is queued again, while those in later words are taken here,
+            // so the directions of removals since the pop are added before each word. They are also
+            // left in queued_directions for the pixel's next pop.
+            directions |= state->queued_directions[pixel_index] & state->neighbour_directions[edges];
+
+            // take the whole word before propagating so removals from this pixel land in the bitmap
+            uint64_t removed_word = removed_bitmap[word_index];
+            removed_bitmap[word_index] = 0;
+
+            while ((WFC_RESULT_CONTINUE == result) && (removed_word != 0)) {
+                uint32_t pat_index = word_index * WFC_BITMAP_WORD_BITS + __builtin_ctzll(removed_word);
+                removed_word &= removed_word - 1;
+
+                for (uint32_t adj_index = 0; adj_index < num_adjacent; adj_index++) {
+                    if (0 == (directions & (1 << adj_index))) {
+                        continue;
+                    }
+                    uint32_t other_pixel_index = pixel_index + deltas[adj_index];
+
+                    WFC_Support *other_supports =
+                        &state->supports[other_pixel_index * num_patterns * num_adjacent];
+
+                    const uint64_t *index_bitmap = WFC_GetIndexBitmap(&state->model->propagator, pat_index, adj_index);
+                    WFC_STATS_ADD(state, index_lookups, 1);
+
+                    if (intersect) {
+                        // a single word is intersected inline, as the call would cost more than it saves
+                        const uint64_t *other_output = &state->output[other_pixel_index * bitmap_words];
+                        bool any = (1 == bitmap_words) ?
+                            WFC_BitmapAnd(state->live, index_bitmap, other_output, 1) :
+                            kernels->intersect(state->live, index_bitmap, other_output, bitmap_words);
+
+                        if (!any) {
+                            continue;
+                        }
+                        index_bitmap = state->live;
+                    }
+
+                    // only patterns that 'pat_index' allowed in this direction lose support
+                    for (uint32_t index_word_index = 0; index_word_index < bitmap_words; index_word_index++) {
+                        uint64_t index_word = index_bitmap[index_word_index];
+
+                        while (index_word != 0) {
+                            uint32_t other_pat_index = index_word_index * WFC_BITMAP_WORD_BITS + __builtin_ctzll(index_word);
+                            index_word &= index_word - 1;
+
+                            WFC_Support *support = &other_supports[other_pat_index * num_adjacent + adj_index];
+                            assert(*support > 0);
+
+                            (*support)--;
+
+                            // the rest of this pattern's removal is still applied on a contradiction,
+                            // so that every pattern is either fully propagated or still pending.
+                            if (*support == 0) {
+                                WFC_RESULT_ENUM ban_result = WFC_Ban(state, other_pixel_index, other_pat_index);
+                                if (WFC_RESULT_OKAY != ban_result) {
+                                    result = ban_result;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            // removals not yet propagated are left pending, which backtracking relies on
+            removed_bitmap[word_index] |= removed_word;
+        }
+    }
+
+    return result;
+}
+
+WFC_RESULT_ENUM WFC_Propagate(WFC_State *state) {
+    assert(NULL != state);
+
+    WFC_RESULT_ENUM result;
+
+    WFC_STATS_BEGIN(start);
+    WFC_STATS_ADD(state, propagations, 1);
+    WFC_TRACE_BEGIN("propagate");
+
+    if (1 == state->model->propagator.bitmap_words) {
+        result = WFC_PropagateWords(state, 1);
+    } else {
+        result = WFC_PropagateWords(state, state->model->propagator.bitmap_words);
+    }
+
+    WFC_TRACE_END("propagate");
+    WFC_STATS_END(state, propagate_cycles, start);
+
+    return result;
+}
+
+WFC_RESULT_ENUM WFC_EnableBacktracking(WFC_State *state) {
+    if ((NULL == state) || (NULL == state->output) || (state->step_num != 0)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    uint32_t num_pixels = state->output_width * state->output_height;
+
+    if (!state->backtrack.enabled) {
+        state->backtrack.max_trail_len = num_pixels;
+        state->backtrack.trail = (WFC_TrailEntry*)WFC_Malloc(sizeof(WFC_TrailEntry) * state->backtrack.max_trail_len);
+        state->backtrack.decisions = (WFC_Decision*)WFC_Malloc(sizeof(WFC_Decision) * num_pixels);
+
+        if ((NULL == state->backtrack.trail) || (NULL == state->backtrack.decisions)) {
+            return WFC_RESULT_ERROR;
+        }
+
+        state->backtrack.enabled = true;
+    }
+
+    return WFC_RESULT_OKAY;
+}
+
+WFC_RESULT_ENUM WFC_Constrain(WFC_State *state, WFC_Pos pos, uint32_t pattern) {
+    if ((NULL == state) ||
+        (pos.x < 0) || (pos.y < 0) ||
+        (pos.x >= (int32_t)state->output_width) || (pos.y >= (int32_t)state->output_height) ||
+        (pattern >= state->model->propagator.num_patterns)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    uint64_t *output_bitmap = WFC_GetOutputBitmap(state, pos);
+
+    if (!WFC_BitmapGet(output_bitmap, pattern)) {
+        return WFC_RESULT_RESTART;
+    }
+
+    WFC_RESULT_ENUM result = WFC_Collapse(state, pos.x + pos.y * state->output_width, pattern);
+
+    if (WFC_RESULT_OKAY == result) {
+        result = WFC_Propagate(state);
+    }
+
+    return (WFC_RESULT_CONTINUE == result) ? WFC_RESULT_OKAY : result;
+}
+
+/** Restore a removed pattern to a pixel. If the removal was already propagated,
+ * the supports it took from each neighbour are given back.
+ */
+void WFC_Unban(WFC_State *state, uint32_t pixel_index, uint32_t pattern) {
+    const uint32_t num_patterns = state->model->propagator.num_patterns;
+    const uint32_t num_adjacent = state->model->propagator.num_adjacent;
+    const uint32_t bitmap_words = state->model->propagator.bitmap_words;
+
+    WFC_BitmapSet(&state->output[pixel_index * bitmap_words], pattern);
+
+    uint64_t *removed_bitmap = &state->removed[pixel_index * bitmap_words];
+    if (WFC_BitmapGet(removed_bitmap, pattern)) {
+        // never propagated, so there is nothing to give back
+        WFC_BitmapClear(removed_bitmap, pattern);
+    } else {
+        const uint8_t edges = state->edge_classes[pixel_index];
+
+        for (uint32_t adj_index = 0; adj_index < num_adjacent; adj_index++) {
+            if (0 == (state->neighbour_directions[edges] & (1 << adj_index))) {
+                continue;
+            }
+            uint32_t other_pixel_index = pixel_index + state->neighbour_deltas[edges][adj_index];
+
+            WFC_Support *other_supports =
+                &state->supports[other_pixel_index * num_patterns * num_adjacent];
+
+            uint64_t *index_bitmap = WFC_GetIndexBitmap(&state->model->propagator, pattern, adj_index);
+            WFC_STATS_ADD(state, index_lookups, 1);
+
+            for (uint32_t other_pat_index = WFC_BitmapNext(index_bitmap, bitmap_words, 0);
+                 other_pat_index != WFC_BITMAP_END;
+                 other_pat_index = WFC_BitmapNext(index_bitmap, bitmap_words, other_pat_index + 1)) {
+                other_supports[other_pat_index * num_adjacent + adj_index]++;
+            }
+        }
+    }
+
+    WFC_CellEntropy *cell = &state->entropies[pixel_index];
+    cell->num_valid++;
+    cell->sum_weights += state->model->propagator.patterns[pattern].count;
+    cell->sum_weight_log_weights += state->model->propagator.weight_log_weights[pattern];
+
+    if (cell->num_valid == 2) {
+        WFC_HeapInsert(state, pixel_index);
+    } else if (cell->num_valid > 2) {
+        WFC_HeapUpdate(state, pixel_index);
+    }
+}
+
+// undo removals in reverse order until the trail is back to 'trail_len' entries
+void WFC_Undo(WFC_State *state, uint32_t trail_len) {
+    WFC_STATS_BEGIN(start);
+
+    while (state->backtrack.trail_len > trail_len) {
+        state->backtrack.trail_len--;
+        WFC_TrailEntry *entry = &state->backtrack.trail[state->backtrack.trail_len];
+
+        WFC_Unban(state, entry->pixel_index, entry->pattern);
+    }
+
+    // every pending removal was made after the last choice, so they have all been undone
+    while (state->queue.num_items > 0) {
+        uint32_t pixel_index = WFC_QueuePop(&state->queue);
+        WFC_BitmapClear(state->queued, pixel_index);
+        state->queued_directions[pixel_index] = 0;
+        WFC_STATS_ADD(state, queue_pops, 1);
+    }
+
+    WFC_STATS_END(state, backtrack_cycles, start);
+}
+
+/** Recover from a contradiction by undoing the most recent choice and banning
+ * its pattern instead. If that contradicts too, the choice before it is undone,
+ * and so on. Returns WFC_RESULT_RESTART when there are no choices left to undo.
+ */
+WFC_RESULT_ENUM WFC_UndoDecision(WFC_State *state) {
+    WFC_RESULT_ENUM result = WFC_RESULT_RESTART;
+
+    while ((WFC_RESULT_RESTART == result) && (state->backtrack.num_decisions > 0)) {
+        state->backtrack.num_decisions--;
+        WFC_Decision decision = state->backtrack.decisions[state->backtrack.num_decisions];
+
+        WFC_Undo(state, decision.trail_len);
+        state->backtrack.num_backtracks++;
+
+        // the removal belongs to the previous choice, so it is undone along with it
+        result = WFC_Ban(state, decision.pixel_index, decision.pattern);
+
+        if (WFC_RESULT_OKAY == result) {
+            result = WFC_Propagate(state);
+        }
+    }
+
+    return result;
+}
+
+WFC_RESULT_ENUM WFC_Step(WFC_State *state) {
+    assert(NULL != state);
+
+    WFC_Pos pos;
+
+    WFC_TRACE_BEGIN_ARG("step", "step", state->step_num);
+
+    WFC_RESULT_ENUM result;
+    result = WFC_Observe(state, &pos);
+
+    if (result == WFC_RESULT_CONTINUE) {
+        result = WFC_Propagate(state);
+    }
+
+    if ((WFC_RESULT_RESTART == result) && state->backtrack.enabled) {
+        WFC_TRACE_BEGIN("backtrack");
+        result = WFC_UndoDecision(state);
+        WFC_TRACE_END("backtrack");
+    }
+
+    WFC_TRACE_END("step");
+
+    state->step_num++;
+
+    WFC_STATS_ADD(state, steps, 1);
+    if (WFC_RESULT_RESTART == result) {
+        WFC_STATS_ADD(state, restarts, 1);
+    }
+
+    return result;
+}
+
+WFC_RESULT_ENUM WFC_Output(WFC_State *state, uint8_t *output) {
+    assert(NULL != state);
+    assert(NULL != output);
+
+    WFC_RESULT_ENUM result = WFC_RESULT_OKAY;
+    const WFC_BitmapKernels *kernels = WFC_GetBitmapKernels();
+
+    for (uint32_t y = 0; (WFC_RESULT_OKAY == result) && (y < state->output_height); y++) {
+        for (uint32_t x = 0; x < state->output_width; x++) {
+            uint64_t *output_bitmap = WFC_GetOutputBitmap(state, (WFC_Pos){x, y});
+
+            if (kernels->popcount(output_bitmap, state->model->propagator.bitmap_words) != 1) {
+                result = WFC_RESULT_ERROR;
+                break;
+            }
+
+            // the pixel's color is the upper left cell of its pattern
+            uint32_t chosen_pattern = WFC_BitmapNext(output_bitmap, state->model->propagator.bitmap_words, 0);
+            WFC_Tile tile = state->model->propagator.patterns[chosen_pattern].tile;
+            output[x + y * state->output_width] =
+                (tile >> ((WFC_PATTERN_LEN - 1) * WFC_CELL_NUM_BITS)) & WFC_CELL_MASK;
+        }
+    }
+
+    return result;
+}
+
+WFC_RESULT_ENUM WFC_BatchInit(WFC_Batch *batch, WFC_Model *model, uint32_t output_width, uint32_t output_height) {
+    if (NULL == batch) {
+        return WFC_RESULT_ERROR;
+    }
+
+    memset(batch, 0, sizeof(*batch));
+
+    WFC_RESULT_ENUM result = WFC_StateInitFromModel(&batch->state, model, output_width, output_height);
+
+    if (WFC_RESULT_OKAY == result) {
+        // the state's buffers are one block, so the whole initial state is copied at once
+        batch->template_bytes = WFC_StateSize(model, output_width, output_height);
+        batch->template = WFC_AlignedAlloc(batch->template_bytes, WFC_ARENA_ALIGN);
+
+        if (NULL == batch->template) {
+            result = WFC_RESULT_ERROR;
+        } else {
+            memcpy(batch->template, batch->state.memory, batch->template_bytes);
+        }
+    }
+
+    if (WFC_RESULT_OKAY != result) {
+        WFC_BatchDestroy(batch);
+    }
+
+    return result;
+}
+
+void WFC_BatchDestroy(WFC_Batch *batch) {
+    if (NULL != batch) {
+        WFC_StateDestroy(&batch->state);
+        WFC_Free(batch->template);
+
+        memset(batch, 0, sizeof(*batch));
+    }
+}
+
+WFC_RESULT_ENUM WFC_BatchReset(WFC_Batch *batch, uint32_t seed) {
+    if ((NULL == batch) || (NULL == batch->template)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    WFC_State *state = &batch->state;
+
+    memcpy(state->memory, batch->template, batch->template_bytes);
+
+    // the rest of the run state lives outside the block
+    state->step_num = 0;
+    state->queue.head = 0;
+    state->queue.num_items = 0;
+    state->heap.num_items = (state->model->propagator.num_patterns > 1) ? state->output_width * state->output_height : 0;
+    state->backtrack.trail_len = 0;
+    state->backtrack.num_decisions = 0;
+    state->backtrack.num_backtracks = 0;
+
+#if defined(WFC_STATS)
+    memset(&state->stats, 0, sizeof(state->stats));
+#endif
+
+    return WFC_StateSetSeed(state, seed);
+}
+
+WFC_RESULT_ENUM WFC_GenerateBatch(WFC_Model *model,
+                                  uint32_t output_width,
+                                  uint32_t output_height,
+                                  uint32_t seed,
+                                  uint32_t num_outputs,
+                                  uint8_t *outputs,
+                                  WFC_RESULT_ENUM *results) {
+    if (NULL == outputs) {
+        return WFC_RESULT_ERROR;
+    }
+
+    WFC_Batch batch;
+    WFC_RESULT_ENUM batch_result = WFC_BatchInit(&batch, model, output_width, output_height);
+
+    const size_t output_bytes = (size_t)output_width * output_height;
+
+    for (uint32_t output_index = 0; (WFC_RESULT_ERROR != batch_result) && (output_index < num_outputs); output_index++) {
+        uint8_t *output = &outputs[output_index * output_bytes];
+
+        // an image which hits a contradiction is tried again with the next of its seeds,
+        // so every image keeps the same seeds however the others went
+        WFC_RESULT_ENUM result = WFC_RESULT_RESTART;
+        for (uint32_t attempt = 0; (WFC_RESULT_RESTART == result) && (attempt < WFC_BATCH_MAX_ATTEMPTS); attempt++) {
+            result = WFC_BatchReset(&batch, WFC_RaceSeed(seed, output_index + attempt * num_outputs));
+
+            if (WFC_RESULT_OKAY == result) {
+                result = WFC_RESULT_CONTINUE;
+                while (WFC_RESULT_CONTINUE == result) {
+                    result = WFC_Step(&batch.state);
+                }
+            }
+        }
+
+        if (WFC_RESULT_FINISHED == result) {
+            if (WFC_RESULT_OKAY != WFC_Output(&batch.state, output)) {
+                result = WFC_RESULT_ERROR;
+            }
+        }
+
+        if (WFC_RESULT_FINISHED != result) {
+            memset(output, 0, output_bytes);
+            batch_result = result;
+        }
+
+        if (NULL != results) {
+            results[output_index] = result;
+        }
+    }
+
+    WFC_BatchDestroy(&batch);
+
+    return batch_result;
+}
+
+// shared by the threads of a race
+typedef struct WFC_RaceContext {
+    WFC_Model *model;
+    uint32_t output_width;
+    uint32_t output_height;
+    const WFC_RaceOptions *options;
+
+    WFC_State *states; /* one per attempt, kept until the race ends if finished */
+
+    atomic_uint next_attempt; /* next attempt to be started by a thread */
+    atomic_uint winner; /* winning attempt so far, or num_attempts if none */
+    atomic_bool error;
+} WFC_RaceContext;
+
+uint32_t WFC_RaceSeed(uint32_t seed, uint32_t attempt) {
+    // mix the attempt in so nearby attempts get unrelated seeds
+    uint32_t mixed = seed + attempt * 0x9E3779B9;
+    mixed ^= mixed >> 16;
+    mixed *= 0x7FEB352D;
+    mixed ^= mixed >> 15;
+    mixed *= 0x846CA68B;
+    mixed ^= mixed >> 16;
+
+    return mixed;
+}
+
+bool WFC_RaceCancelled(WFC_RaceContext *context, uint32_t attempt) {
+    if (atomic_load_explicit(&context->error, memory_order_relaxed)) {
+        return true;
+    }
+
+    uint32_t winner = atomic_load_explicit(&context->winner, memory_order_relaxed);
+
+    if (WFC_RACE_POLICY_LOWEST == context->options->policy) {
+        return winner < attempt;
+    } else {
+        return winner != context->options->num_attempts;
+    }
+}
+
+int WFC_RaceWorker(void *arg) {
+    WFC_RaceContext *context = (WFC_RaceContext*)arg;
+    const WFC_RaceOptions *options = context->options;
+
+    while (true) {
+        uint32_t attempt = atomic_fetch_add_explicit(&context->next_attempt, 1, memory_order_relaxed);
+
+        if (attempt >= options->num_attempts) {
+            break;
+        }
+
+        if (WFC_RaceCancelled(context, attempt)) {
+            continue;
+        }
+
+        WFC_State *state = &context->states[attempt];
+
+        WFC_RESULT_ENUM result =
+            WFC_StateInitFromModel(state, context->model, context->output_width, context->output_height);
+
+        if (WFC_RESULT_OKAY == result) {
+            result = WFC_StateSetSeed(state, WFC_RaceSeed(options->seed, attempt));
+        }
+
+        if ((WFC_RESULT_OKAY == result) && options->backtracking) {
+            result = WFC_EnableBacktracking(state);
+        }
+
+        if (WFC_RESULT_OKAY == result) {
+            result = WFC_RESULT_CONTINUE;
+            while ((WFC_RESULT_CONTINUE == result) && !WFC_RaceCancelled(context, attempt)) {
+                result = WFC_Step(state);
+            }
+        }
+
+        if (WFC_RESULT_FINISHED == result) {
+            // claim the win. Under the lowest policy a lower attempt can take it
+            // from a higher one that finished first.
+            uint32_t winner = atomic_load(&context->winner);
+
+            if (WFC_RACE_POLICY_LOWEST == options->policy) {
+                while ((attempt < winner) &&
+                       !atomic_compare_exchange_weak(&context->winner, &winner, attempt)) {
+                }
+            } else if (winner == options->num_attempts) {
+                atomic_compare_exchange_strong(&context->winner, &winner, attempt);
+            }
+        } else {
+            if (WFC_RESULT_ERROR == result) {
+                atomic_store(&context->error, true);
+            }
+
+            WFC_StateDestroy(state);
+        }
+    }
+
+    return 0;
+}
+
+WFC_RESULT_ENUM WFC_Race(WFC_Model *model,
+                         uint32_t output_width,
+                         uint32_t output_height,
+                         const WFC_RaceOptions *options,
+                         WFC_State *winner,
+                         uint32_t *winner_attempt) {
+    if ((NULL == model) || (NULL == options) || (NULL == winner) || (0 == options->num_attempts)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    WFC_RaceContext context;
+    context.model = model;
+    context.output_width = output_width;
+    context.output_height = output_height;
+    context.options = options;
+    atomic_init(&context.next_attempt, 0);
+    atomic_init(&context.winner, options->num_attempts);
+    atomic_init(&context.error, false);
+
+    context.states = (WFC_State*)WFC_Calloc(sizeof(WFC_State) * options->num_attempts);
+    if (NULL == context.states) {
+        return WFC_RESULT_ERROR;
+    }
+
+    uint32_t num_threads = options->num_threads;
+    if (num_threads > options->num_attempts) {
+        num_threads = options->num_attempts;
+    }
+
+    // the calling thread takes attempts as well, so it counts as one of the threads
+    thrd_t *threads = NULL;
+    uint32_t num_started = 0;
+    if (num_threads > 1) {
+        threads = (thrd_t*)WFC_Malloc(sizeof(thrd_t) * (num_threads - 1));
+    }
+
+    if (NULL != threads) {
+        while ((num_started < num_threads - 1) &&
+               (thrd_success == thrd_create(&threads[num_started], WFC_RaceWorker, &context))) {
+            num_started++;
+        }
+    }
+
+    WFC_RaceWorker(&context);
+
+    for (uint32_t thread_index = 0; thread_index < num_started; thread_index++) {
+        thrd_join(threads[thread_index], NULL);
+    }
+    WFC_Free(threads);
+
+    WFC_RESULT_ENUM result = WFC_RESULT_OKAY;
+    uint32_t winning_attempt = atomic_load(&context.winner);
+
+    if (atomic_load(&context.error)) {
+        result = WFC_RESULT_ERROR;
+    } else if (winning_attempt == options->num_attempts) {
+        result = WFC_RESULT_RESTART;
+    } else {
+        *winner = context.states[winning_attempt];
+        memset(&context.states[winning_attempt], 0, sizeof(WFC_State));
+
+        if (NULL != winner_attempt) {
+            *winner_attempt = winning_attempt;
+        }
+    }
+
+    // other attempts may have finished before losing to the winner
+    for (uint32_t attempt = 0; attempt < options->num_attempts; attempt++) {
+        WFC_StateDestroy(&context.states[attempt]);
+    }
+    WFC_Free(context.states);
+
+    return result;
+}
+
+WFC_RESULT_ENUM WFC_ChunkSolve(WFC_Model *model,
+                               uint32_t width,
+                               uint32_t height,
+                               const uint32_t *top,
+                               const uint32_t *left,
+                               uint32_t lookahead,
+                               uint32_t seed,
+                               uint32_t *patterns) {
+    if ((NULL == model) || (NULL == patterns) || (0 == width) || (0 == height) || (0 == lookahead)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    // the chunk and its margins must not wrap the sizes of the state solving them
+    if (((uint64_t)width + 1 + lookahead > UINT32_MAX) || ((uint64_t)height + 1 + lookahead > UINT32_MAX)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    // the chunk is solved without wrapping, with a margin of one pixel above and to
+    // the left holding its neighbours' patterns. A margin of 'lookahead' pixels below
+    // and to the right is solved as well and thrown away, so the chunk's last row and
+    // column can be extended by the chunks after it.
+    WFC_State state;
+    WFC_RESULT_ENUM result =
+        WFC_StateInitFromModel(&state, model, width + 1 + lookahead, height + 1 + lookahead);
+
+    if (WFC_RESULT_OKAY == result) {
+        result = WFC_StateSetPeriodic(&state, false);
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        result = WFC_StateSetSeed(&state, seed);
+    }
+
+    for (uint32_t x = 0; (WFC_RESULT_OKAY == result) && (NULL != top) && (x < width + 1 + lookahead); x++) {
+        if (WFC_PATTERN_NONE != top[x]) {
+            result = WFC_Constrain(&state, (WFC_Pos){ x, 0 }, top[x]);
+        }
+    }
+
+    for (uint32_t y = 0; (WFC_RESULT_OKAY == result) && (NULL != left) && (y < height + lookahead); y++) {
+        if (WFC_PATTERN_NONE != left[y]) {
+            result = WFC_Constrain(&state, (WFC_Pos){ 0, y + 1 }, left[y]);
+        }
+    }
+
+    // the constraints are never undone, as they are made before the first choice
+    if (WFC_RESULT_OKAY == result) {
+        result = WFC_EnableBacktracking(&state);
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        result = WFC_RESULT_CONTINUE;
+        while (WFC_RESULT_CONTINUE == result) {
+            result = WFC_Step(&state);
+        }
+    }
+
+    if (WFC_RESULT_FINISHED == result) {
+        const uint32_t bitmap_words = model->propagator.bitmap_words;
+
+        const uint32_t stride = width + lookahead;
+
+        for (uint32_t y = 0; y < height + lookahead; y++) {
+            for (uint32_t x = 0; x < stride; x++) {
+                uint64_t *output_bitmap = WFC_GetOutputBitmap(&state, (WFC_Pos){ x + 1, y + 1 });
+                patterns[x + y * stride] = WFC_BitmapNext(output_bitmap, bitmap_words, 0);
+            }
+        }
+
+        result = WFC_RESULT_OKAY;
+    }
+
+    WFC_StateDestroy(&state);
+
+    return result;
+}
+
+/* A row of chunks being solved, in one of the slots WFC_GenerateChunks cycles through.
+ * Everything but 'pixels' is guarded by the context's lock.
+ */
+typedef struct WFC_ChunkRow {
+    uint32_t chunk_y;
+    uint32_t generation; /* changed whenever the row is started again, so the row below starts again too */
+    uint32_t above_generation; /* generation of the row above that this one is solved against */
+    uint32_t num_solved; /* chunks solved, from the left, in this generation */
+    bool finished; /* every chunk was solved, or 'result' says why not */
+    WFC_RESULT_ENUM result;
+    uint32_t *bottom; /* the patterns of the row's last pixel row, with margins as in 'top' of WFC_ChunkSolve */
+    uint8_t *pixels; /* each chunk's pixels, one chunk after another */
+} WFC_ChunkRow;
+
+typedef struct WFC_ChunkContext {
+    WFC_Model *model;
+    const WFC_ChunkOptions *options;
+    WFC_ChunkSink sink;
+    void *user;
+
+    size_t row_len;
+    size_t stride;
+    uint32_t reach; /* chunks past its own that a chunk's top margin reaches into */
+    uint32_t max_attempts;
+
+    mtx_t lock;
+    cnd_t changed; /* broadcast whenever a row makes progress, starts again or is passed on */
+
+    WFC_ChunkRow *rows;
+    uint32_t num_rows; /* slots, one more than the rows solved at once */
+    uint32_t next_row; /* next row for a thread to take */
+    uint32_t num_sunk; /* rows passed to the sink */
+    bool sinking; /* a thread is passing a row to the sink */
+    bool stop;
+    WFC_RESULT_ENUM result;
+} WFC_ChunkContext;
+
+// a thread's buffers for solving chunks
+typedef struct WFC_ChunkScratch {
+    uint32_t *top;
+    uint32_t *left;
+    uint32_t *patterns;
+} WFC_ChunkScratch;
+
+static WFC_ChunkRow *WFC_ChunkRowAt(WFC_ChunkContext *context, uint32_t chunk_y) {
+    return &context->rows[chunk_y % context->num_rows];
+}
+
+// start a row, or start it again, from its first attempt against the row above as it is now
+static void WFC_ChunkRowRestart(WFC_ChunkContext *context, WFC_ChunkRow *row) {
+    row->generation++;
+    row->num_solved = 0;
+    row->finished = false;
+    row->above_generation = (0 == row->chunk_y) ? 0 : WFC_ChunkRowAt(context, row->chunk_y - 1)->generation;
+    cnd_broadcast(&context->changed);
+}
+
+static bool WFC_ChunkRowStale(WFC_ChunkContext *context, const WFC_ChunkRow *row) {
+    return (0 != row->chunk_y) && (row->above_generation != WFC_ChunkRowAt(context, row->chunk_y - 1)->generation);
+}
+
+/** Solve a row of chunks, as WFC_GenerateChunks would one row after another. The row above
+ * may still be being solved, so each chunk waits until the chunks above it are, and the
+ * row starts again whenever the row above does. The caller holds the lock, which is held
+ * again on return.
+ */
+static void WFC_ChunkRowSolve(WFC_ChunkContext *context, WFC_ChunkScratch *scratch, WFC_ChunkRow *row) {
+    const WFC_ChunkOptions *options = context->options;
+    const uint32_t chunk_width = options->chunk_width;
+    const uint32_t chunk_height = options->chunk_height;
+    const uint32_t lookahead = options->lookahead;
+    const uint32_t num_chunks = options->num_chunks_x * options->num_chunks_y;
+    const size_t stride = context->stride;
+    WFC_ChunkRow *above = (0 == row->chunk_y) ? NULL : WFC_ChunkRowAt(context, row->chunk_y - 1);
+
+    WFC_ChunkRowRestart(context, row);
+    uint32_t attempt = 0;
+    uint32_t chunk_x = 0;
+
+    while (!context->stop && (chunk_x < options->num_chunks_x)) {
+        const uint32_t x0 = chunk_x * chunk_width;
+
+        if (0 == chunk_x) {
+            for (uint32_t y = 0; y < chunk_height + lookahead; y++) {
+                scratch->left[y] = WFC_PATTERN_NONE;
+            }
+        }
+
+        // the chunk's top margin reaches into the next chunks of the row above
+        uint32_t needed = chunk_x + 1 + context->reach;
+        if (needed > options->num_chunks_x) {
+            needed = options->num_chunks_x;
+        }
+        while ((NULL != above) && !context->stop && !WFC_ChunkRowStale(context, row) && (above->num_solved < needed)) {
+            cnd_wait(&context->changed, &context->lock);
+        }
+
+        if (context->stop) {
+            break;
+        }
+        if (WFC_ChunkRowStale(context, row)) {
+            WFC_ChunkRowRestart(context, row);
+            attempt = 0;
+            chunk_x = 0;
+            continue;
+        }
+
+        for (uint32_t x = 0; x < chunk_width + 1 + lookahead; x++) {
+            scratch->top[x] = (NULL == above) ? WFC_PATTERN_NONE : above->bottom[x0 + x];
+        }
+
+        mtx_unlock(&context->lock);
+
+        const uint32_t chunk_index = chunk_x + row->chunk_y * options->num_chunks_x;
+        WFC_RESULT_ENUM result = WFC_ChunkSolve(context->model,
+                                                chunk_width,
+                                                chunk_height,
+                                                scratch->top,
+                                                scratch->left,
+                                                lookahead,
+                                                WFC_RaceSeed(options->seed, chunk_index + attempt * num_chunks),
+                                                scratch->patterns);
+
+        if (WFC_RESULT_OKAY == result) {
+            // the next chunk continues the last column's lookahead as well, so
+            // the two chunks' lookaheads agree where the next row meets them
+            for (uint32_t y = 0; y < chunk_height + lookahead; y++) {
+                scratch->left[y] = scratch->patterns[(chunk_width - 1) + y * stride];
+            }
+
+            // the pixel's color is the upper left cell of its pattern
+            uint8_t *chunk_pixels = &row->pixels[(size_t)chunk_x * chunk_width * chunk_height];
+            for (uint32_t y = 0; y < chunk_height; y++) {
+                for (uint32_t x = 0; x < chunk_width; x++) {
+                    WFC_Tile tile = context->model->propagator.patterns[scratch->patterns[x + y * stride]].tile;
+                    chunk_pixels[x + y * chunk_width] =
+                        (tile >> ((WFC_PATTERN_LEN - 1) * WFC_CELL_NUM_BITS)) & WFC_CELL_MASK;
+                }
+            }
+        }
+
+        mtx_lock(&context->lock);
+
+        if (WFC_ChunkRowStale(context, row)) {
+            // solved against patterns which have since been replaced
+            WFC_ChunkRowRestart(context, row);
+            attempt = 0;
+            chunk_x = 0;
+        } else if (WFC_RESULT_OKAY == result) {
+            for (uint32_t x = 0; x < chunk_width; x++) {
+                row->bottom[x0 + x + 1] = scratch->patterns[x + (chunk_height - 1) * stride];
+            }
+            row->num_solved++;
+            cnd_broadcast(&context->changed);
+            chunk_x++;
+        } else if ((WFC_RESULT_RESTART == result) && (attempt + 1 < context->max_attempts)) {
+            // a chunk which cannot be solved is retried by solving its row again with other seeds
+            WFC_ChunkRowRestart(context, row);
+            attempt++;
+            chunk_x = 0;
+        } else {
+            row->finished = true;
+            row->result = result;
+            cnd_broadcast(&context->changed);
+            return;
+        }
+    }
+
+    if (!context->stop) {
+        row->finished = true;
+        row->result = WFC_RESULT_OKAY;
+        cnd_broadcast(&context->changed);
+    }
+}
+
+/** Each thread solves one row at a time, staying with it until it is passed on in case
+ * the row above starts again. A row is passed on once every row above it has been, by
+ * whichever thread finds it finished first.
+ */
+int WFC_ChunkWorker(void *arg) {
+    WFC_ChunkContext *context = (WFC_ChunkContext*)arg;
+    const WFC_ChunkOptions *options = context->options;
+
+    WFC_ChunkScratch scratch;
+    scratch.top = (uint32_t*)WFC_Malloc(sizeof(uint32_t) * (context->stride + 1));
+    scratch.left = (uint32_t*)WFC_Malloc(sizeof(uint32_t) * (options->chunk_height + options->lookahead));
+    scratch.patterns = (uint32_t*)WFC_Malloc(sizeof(uint32_t) * context->stride * (options->chunk_height + options->lookahead));
+
+    mtx_lock(&context->lock);
+
+    if ((NULL == scratch.top) || (NULL == scratch.left) || (NULL == scratch.patterns)) {
+        context->result = WFC_RESULT_ERROR;
+        context->stop = true;
+        cnd_broadcast(&context->changed);
+    }
+
+    // the row this thread solves. Its slot may be reused as soon as it is passed on,
+    // so that is checked against the row's number rather than the slot's.
+    WFC_ChunkRow *owned = NULL;
+    uint32_t owned_y = 0;
+
+    while (!context->stop && (context->num_sunk < options->num_chunks_y)) {
+        WFC_ChunkRow *next = WFC_ChunkRowAt(context, context->num_sunk);
+
+        if ((NULL != owned) && (owned_y < context->num_sunk)) {
+            owned = NULL;
+        }
+
+        if (!context->sinking && (next->chunk_y == context->num_sunk) && (context->num_sunk < context->next_row) &&
+            next->finished && !WFC_ChunkRowStale(context, next)) {
+            // every row above has been passed on, so this one is final
+            if (WFC_RESULT_OKAY != next->result) {
+                context->result = next->result;
+                context->stop = true;
+                cnd_broadcast(&context->changed);
+                break;
+            }
+
+            context->sinking = true;
+            mtx_unlock(&context->lock);
+
+            WFC_RESULT_ENUM result = WFC_RESULT_OKAY;
+            for (uint32_t chunk_x = 0; (WFC_RESULT_OKAY == result) && (chunk_x < options->num_chunks_x); chunk_x++) {
+                result = context->sink(context->user,
+                                       chunk_x,
+                                       next->chunk_y,
+                                       options->chunk_width,
+                                       options->chunk_height,
+                                       &next->pixels[(size_t)chunk_x * options->chunk_width * options->chunk_height]);
+            }
+
+            mtx_lock(&context->lock);
+            context->sinking = false;
+            context->num_sunk++;
+            if (WFC_RESULT_OKAY != result) {
+                context->result = result;
+                context->stop = true;
+            }
+            cnd_broadcast(&context->changed);
+        } else if ((NULL == owned) && (context->next_row < options->num_chunks_y) &&
+                   (context->next_row + 1 < context->num_sunk + context->num_rows)) {
+            // the slot is free once its last row, and the row below that which read it, are passed on
+            owned = WFC_ChunkRowAt(context, context->next_row);
+            owned_y = context->next_row;
+            owned->chunk_y = context->next_row;
+            for (size_t x = 0; x < context->row_len; x++) {
+                owned->bottom[x] = WFC_PATTERN_NONE;
+            }
+            context->next_row++;
+
+            WFC_ChunkRowSolve(context, &scratch, owned);
+        } else if ((NULL != owned) && WFC_ChunkRowStale(context, owned)) {
+            WFC_ChunkRowSolve(context, &scratch, owned);
+        } else {
+            cnd_wait(&context->changed, &context->lock);
+        }
+    }
+
+    mtx_unlock(&context->lock);
+
+    WFC_Free(scratch.top);
+    WFC_Free(scratch.left);
+    WFC_Free(scratch.patterns);
+
+    return 0;
+}
+
+WFC_RESULT_ENUM WFC_GenerateChunks(WFC_Model *model,
+                                   const WFC_ChunkOptions *options,
+                                   WFC_ChunkSink sink,
+                                   void *user) {
+    if ((NULL == model) || (NULL == options) || (NULL == sink) ||
+        (0 == options->chunk_width) || (0 == options->chunk_height) ||
+        (0 == options->lookahead)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    const uint32_t chunk_width = options->chunk_width;
+    const uint32_t chunk_height = options->chunk_height;
+    const uint32_t lookahead = options->lookahead;
+
+    // rows of patterns across the world, and the patterns of a chunk and its lookahead,
+    // are indexed with uint32_t, so their sizes must fit along with the margins
+    const uint64_t world_width = (uint64_t)chunk_width * options->num_chunks_x;
+    if ((world_width + 1 + lookahead > UINT32_MAX) ||
+        ((uint64_t)chunk_width + 1 + lookahead > UINT32_MAX) ||
+        ((uint64_t)chunk_height + 1 + lookahead > UINT32_MAX) ||
+        !WFC_SizeValid(chunk_width + lookahead, chunk_height + lookahead) ||
+        ((uint64_t)(chunk_width + lookahead) * (chunk_height + lookahead) > SIZE_MAX / sizeof(uint32_t)) ||
+        (world_width * chunk_height > SIZE_MAX)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    if ((0 == options->num_chunks_x) || (0 == options->num_chunks_y)) {
+        return WFC_RESULT_OKAY;
+    }
+
+    uint32_t num_threads = (0 == options->num_threads) ? 1 : options->num_threads;
+    if (num_threads > options->num_chunks_y) {
+        num_threads = options->num_chunks_y;
+    }
+
+    WFC_ChunkContext context;
+    context.model = model;
+    context.options = options;
+    context.sink = sink;
+    context.user = user;
+    context.row_len = (size_t)world_width + 1 + lookahead;
+    context.stride = (size_t)chunk_width + lookahead;
+    context.reach = (chunk_width + lookahead - 1) / chunk_width;
+    context.max_attempts = (0 == options->max_attempts) ? 1 : options->max_attempts;
+    context.num_rows = num_threads + 1;
+    context.next_row = 0;
+    context.num_sunk = 0;
+    context.sinking = false;
+    context.stop = false;
+    context.result = WFC_RESULT_OKAY;
+
+    // only the last pixel row of each row of chunks in flight is kept, with extra
+    // entries on each end for the missing pixels past the world's edges, along with
+    // the pixels of the rows being solved
+    context.rows = (WFC_ChunkRow*)WFC_Calloc(sizeof(WFC_ChunkRow) * context.num_rows);
+    WFC_RESULT_ENUM result = (NULL == context.rows) ? WFC_RESULT_ERROR : WFC_RESULT_OKAY;
+
+    for (uint32_t row_index = 0; (WFC_RESULT_OKAY == result) && (row_index < context.num_rows); row_index++) {
+        WFC_ChunkRow *row = &context.rows[row_index];
+        row->bottom = (uint32_t*)WFC_Malloc(sizeof(uint32_t) * context.row_len);
+        row->pixels = (uint8_t*)WFC_Malloc((size_t)world_width * chunk_height);
+
+        if ((NULL == row->bottom) || (NULL == row->pixels)) {
+            result = WFC_RESULT_ERROR;
+        }
+    }
+
+    bool locks_made = false;
+    if (WFC_RESULT_OKAY == result) {
+        if ((thrd_success == mtx_init(&context.lock, mtx_plain)) && (thrd_success == cnd_init(&context.changed))) {
+            locks_made = true;
+        } else {
+            result = WFC_RESULT_ERROR;
+        }
+    }
+
+    if (WFC_RESULT_OKAY == result) {
+        // the calling thread solves rows as well, so it counts as one of the threads
+        thrd_t *threads = NULL;
+        uint32_t num_started = 0;
+        if (num_threads > 1) {
+            threads = (thrd_t*)WFC_Malloc(sizeof(thrd_t) * (num_threads - 1));
+        }
+
+        if (NULL != threads) {
+            while ((num_started < num_threads - 1) &&
+                   (thrd_success == thrd_create(&threads[num_started], WFC_ChunkWorker, &context))) {
+                num_started++;
+            }
+        }
+
+        WFC_ChunkWorker(&context);
+
+        for (uint32_t thread_index = 0; thread_index < num_started; thread_index++) {
+            thrd_join(threads[thread_index], NULL);
+        }
+        WFC_Free(threads);
+
+        result = context.result;
+    }
+
+    if (locks_made) {
+        cnd_destroy(&context.changed);
+        mtx_destroy(&context.lock);
+    }
+
+    if (NULL != context.rows) {
+        for (uint32_t row_index = 0; row_index < context.num_rows; row_index++) {
+            WFC_Free(context.rows[row_index].bottom);
+            WFC_Free(context.rows[row_index].pixels);
+        }
+        WFC_Free(context.rows);
+    }
+
+    return result;
+}
+
+WFC_RESULT_ENUM WFC_ChunkSinkFile(void *user,
+                                  uint32_t chunk_x,
+                                  uint32_t chunk_y,
+                                  uint32_t width,
+                                  uint32_t height,
+                                  const uint8_t *pixels) {
+    FILE *file = (FILE*)user;
+
+    if (!WFC_SizeValid(width, height)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    const uint32_t record[4] = { chunk_x, chunk_y, width, height };
+    const size_t num_pixels = (size_t)width * height;
+
+    if ((fwrite(record, sizeof(record), 1, file) != 1) ||
+        (fwrite(pixels, 1, num_pixels, file) != num_pixels)) {
+        return WFC_RESULT_ERROR;
+    }
+
+    return WFC_RESULT_OKAY;
+}
+
+#if defined(WFC_TEST)
+// find the single pattern left at a pixel of a finished output
+uint32_t WFC_TestCollapsedPattern(WFC_State *state, WFC_Pos pos) {
+    uint64_t *output_bitmap = WFC_GetOutputBitmap(state, pos);
+
+    assert(WFC_BitmapPopcount(output_bitmap, state->model->propagator.bitmap_words) == 1);
+
+    return WFC_BitmapNext(output_bitmap, state->model->propagator.bitmap_words, 0);
+}
+
+void WFC_TestPropagate(void) {
+    WFC_State state = {0};
+    WFC_RESULT_ENUM result = WFC_RESULT_RESTART;
+
+    for (uint32_t attempt = 1; (WFC_RESULT_RESTART == result) && (attempt < 100); attempt++) {
+        result = WFC_StateInit(&state, 4, 4, gv_test_rings, 12, 8);
+        assert(WFC_RESULT_OKAY == result);
+        assert(WFC_RESULT_OKAY == WFC_StateSetSeed(&state, attempt));
+
+        do {
+            result = WFC_Step(&state);
+        } while (WFC_RESULT_CONTINUE == result);
+
+        if (WFC_RESULT_RESTART == result) {
+            WFC_StateDestroy(&state);
+        }
+    }
+    assert(WFC_RESULT_FINISHED == result);
+
+    // a model this small is solved with single word bitmaps
+    assert(1 == state.model->propagator.bitmap_words);
+
+    // every pair of neighbouring patterns must overlap
+    for (uint32_t y = 0; y < state.output_height; y++) {
+        for (uint32_t x = 0; x < state.output_width; x++) {
+            WFC_Pos pos = { x, y };
+            WFC_Tile tile = state.model->propagator.patterns[WFC_TestCollapsedPattern(&state, pos)].tile;
+
+            for (uint32_t adj_index = 0; adj_index < WFC_NUM_ADJACENT; adj_index++) {
+                WFC_Pos adjacency = gv_adjacent_offsets[adj_index];
+                WFC_Pos other_pos = WFC_OffsetFrom(pos, adjacency, state.output_width, state.output_height);
+                WFC_Tile other_tile = state.model->propagator.patterns[WFC_TestCollapsedPattern(&state, other_pos)].tile;
+
+                assert(WFC_TilesOverlap(tile, other_tile, adjacency));
+            }
+        }
+    }
+
+    uint8_t output[12 * 8];
+    assert(WFC_RESULT_OKAY == WFC_Output(&state, output));
+
+    WFC_StateDestroy(&state);
+}
+
+#endif
+
+#if defined(WFC_TEST)
+// check the heap order and that the cached entropy terms and keys match the output bitmaps
+void WFC_TestCheckEntropies(WFC_State *state) {
+    for (uint32_t heap_index = 1; heap_index < state->heap.num_items; heap_index++) {
+        uint32_t pixel_index = state->heap.items[heap_index];
+        uint32_t parent_pixel = state->heap.items[(heap_index - 1) / 2];
+        assert(state->entropies[parent_pixel].key <= state->entropies[pixel_index].key);
+        assert(state->heap.positions[pixel_index] == heap_index);
+    }
+
+    for (uint32_t heap_index = 0; heap_index < state->heap.num_items; heap_index++) {
+        uint32_t pixel_index = state->heap.items[heap_index];
+        uint64_t key = state->entropies[pixel_index].key;
+        WFC_UpdateKey(state, pixel_index);
+        assert(key == state->entropies[pixel_index].key);
+    }
+
+    uint32_t num_remaining = 0;
+    for (uint32_t pix_index = 0; pix_index < state->output_width * state->output_height; pix_index++) {
+        uint64_t *output_bitmap = &state->output[pix_index * state->model->propagator.bitmap_words];
+
+        uint32_t num_valid = 0;
+        uint32_t sum_weights = 0;
+        for (uint32_t pat_index = 0; pat_index < state->model->propagator.num_patterns; pat_index++) {
+            if (WFC_BitmapGet(output_bitmap, pat_index)) {
+                num_valid++;
+                sum_weights += state->model->propagator.patterns[pat_index].count;
+            }
+        }
+
+        assert(state->entropies[pix_index].num_valid == num_valid);
+        assert(state->entropies[pix_index].sum_weights == sum_weights);
+        assert((num_valid > 1) == (state->heap.positions[pix_index] != WFC_HEAP_NONE));
+
+        if (num_valid > 1) {
+            num_remaining++;
+        }
+    }
+
+    assert(WFC_StateRemaining(state) == num_remaining);
+}
+
+void WFC_TestEntropyHeap(void) {
+    WFC_State state = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInit(&state, 4, 4, gv_test_rings, 8, 8));
+    WFC_TestCheckEntropies(&state);
+
+    for (uint32_t step = 0; step < 5; step++) {
+        if (WFC_RESULT_CONTINUE != WFC_Step(&state)) {
+            break;
+        }
+        WFC_TestCheckEntropies(&state);
+    }
+
+    WFC_StateDestroy(&state);
+}
+#endif
+
+#if defined(WFC_TEST)
+// check every support count against a count of the patterns that actually support it.
+// Without backtracking, only the counts of patterns still valid are kept up to date.
+void WFC_TestCheckSupports(WFC_State *state) {
+    const uint32_t num_patterns = state->model->propagator.num_patterns;
+    const uint32_t num_adjacent = state->model->propagator.num_adjacent;
+
+    for (uint32_t pix_index = 0; pix_index < state->output_width * state->output_height; pix_index++) {
+        WFC_Pos pos = { pix_index % state->output_width, pix_index / state->output_width };
+
+        for (uint32_t adj_index = 0; adj_index < num_adjacent; adj_index++) {
+            // the supports from 'adj_index' come from the pixel on the opposite side
+            WFC_Pos adjacency = WFC_AdjacentOffsets(num_adjacent)[adj_index];
+            WFC_Pos other_pos =
+                WFC_OffsetFrom(pos, (WFC_Pos){ -adjacency.x, -adjacency.y }, state->output_width, state->output_height);
+            uint64_t *other_bitmap = WFC_GetOutputBitmap(state, other_pos);
+
+            // off the edge of a non-periodic output there is no pixel to take support away
+            const uint8_t edges = state->edge_classes[pix_index];
+            if (0 == (state->neighbour_directions[edges] & (1 << WFC_OPPOSITE_ADJACENT(adj_index, num_adjacent)))) {
+                for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
+                    assert(state->supports[(pix_index * num_patterns + pat_index) * num_adjacent + adj_index] ==
+                           state->model->initial_supports[pat_index * num_adjacent + adj_index]);
+                }
+                continue;
+            }
+
+            for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
+                if (!state->backtrack.enabled && !WFC_BitmapGet(WFC_GetOutputBitmap(state, pos), pat_index)) {
+                    continue;
+                }
+
+                WFC_Support support = 0;
+                for (uint32_t other_pat_index = 0; other_pat_index < num_patterns; other_pat_index++) {
+                    if (WFC_BitmapGet(other_bitmap, other_pat_index) &&
+                        WFC_BitmapGet(WFC_GetIndexBitmap(&state->model->propagator, other_pat_index, adj_index), pat_index)) {
+                        support++;
+                    }
+                }
+
+                assert(state->supports[(pix_index * num_patterns + pat_index) * num_adjacent + adj_index] == support);
+            }
+        }
+    }
+}
+
+void WFC_TestBacktracking(void) {
+    // a small noisy input which contradicts several times while solving
+    uint8_t input[5 * 5];
+    WFC_TestNoisyInput(input);
+
+    WFC_State state = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInit(&state, 5, 5, input, 12, 12));
+    assert(WFC_RESULT_OKAY == WFC_EnableBacktracking(&state));
+
+    const uint32_t num_pixels = 12 * 12;
+    const size_t output_bytes = sizeof(uint64_t) * state.model->propagator.bitmap_words * num_pixels;
+    const size_t supports_bytes = sizeof(WFC_Support) * state.model->propagator.num_patterns * WFC_NUM_ADJACENT * num_pixels;
+
+    uint64_t *initial_output = (uint64_t*)malloc(output_bytes);
+    WFC_Support *initial_supports = (WFC_Support*)malloc(supports_bytes);
+    memcpy(initial_output, state.output, output_bytes);
+    memcpy(initial_supports, state.supports, supports_bytes);
+
+    // undoing every choice restores the initial state exactly
+    for (uint32_t step = 0; step < 5; step++) {
+        assert(WFC_RESULT_CONTINUE == WFC_Step(&state));
+    }
+    assert(state.backtrack.trail_len > 0);
+
+    WFC_Undo(&state, 0);
+    state.backtrack.num_decisions = 0;
+    assert(memcmp(initial_output, state.output, output_bytes) == 0);
+    assert(memcmp(initial_supports, state.supports, supports_bytes) == 0);
+    WFC_TestCheckEntropies(&state);
+
+    free(initial_output);
+    free(initial_supports);
+
+    // a full solve never needs to restart, and stays consistent after each backtrack
+    WFC_RESULT_ENUM result;
+    do {
+        result = WFC_Step(&state);
+
+        if (WFC_RESULT_CONTINUE == result) {
+            assert(state.queue.num_items == 0);
+            WFC_TestCheckSupports(&state);
+            WFC_TestCheckEntropies(&state);
+        }
+    } while (WFC_RESULT_CONTINUE == result);
+
+    assert(WFC_RESULT_FINISHED == result);
+
+    uint8_t output[12 * 12];
+    assert(WFC_RESULT_OKAY == WFC_Output(&state, output));
+
+    WFC_StateDestroy(&state);
+}
+
+void WFC_TestThinOutputs(void) {
+    // a noisy input with patterns spread over several bitmap words
+    uint8_t input[16 * 16];
+    WFC_TestNoise(input, sizeof(input), 9127, 8);
+
+    WFC_Model *model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&model, 16, 16, input));
+    assert(model->propagator.bitmap_words > 1);
+
+    // rewrite the index so that every pattern allows every other, except that the first
+    // pattern allows nothing above or below it, and only it allows the first pattern of
+    // the second word to its right
+    WFC_Propagator *propagator = &model->propagator;
+    const uint32_t num_patterns = propagator->num_patterns;
+    const uint32_t num_adjacent = propagator->num_adjacent;
+    const WFC_Pos *offsets = WFC_AdjacentOffsets(num_adjacent);
+    const uint32_t sideways = 0;
+    const uint32_t second_word = WFC_BITMAP_WORD_BITS;
+
+    uint32_t right_index = 0;
+    while ((offsets[right_index].x != 1) || (offsets[right_index].y != 0)) {
+        right_index++;
+    }
+    const uint32_t left_index = WFC_OPPOSITE_ADJACENT(right_index, num_adjacent);
+
+    for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
+        for (uint32_t adj_index = 0; adj_index < num_adjacent; adj_index++) {
+            for (uint32_t other_pat_index = 0; other_pat_index < num_patterns; other_pat_index++) {
+                uint32_t opposite_index = WFC_OPPOSITE_ADJACENT(adj_index, num_adjacent);
+                bool allowed =
+                    !(((sideways == pat_index) && (0 != offsets[adj_index].y)) ||
+                      ((sideways == other_pat_index) && (0 != offsets[opposite_index].y)) ||
+                      ((right_index == adj_index) && (second_word == other_pat_index) && (sideways != pat_index)) ||
+                      ((left_index == adj_index) && (second_word == pat_index) && (sideways != other_pat_index)));
+
+                uint64_t *index_bitmap = WFC_GetIndexBitmap(propagator, pat_index, adj_index);
+                if (allowed) {
+                    WFC_BitmapSet(index_bitmap, other_pat_index);
+                } else {
+                    WFC_BitmapClear(index_bitmap, other_pat_index);
+                }
+            }
+        }
+    }
+    WFC_Free(model->initial_supports);
+    WFC_Free(model->pattern_directions);
+    WFC_Free(model->prefix_weights);
+    assert(WFC_RESULT_OKAY == WFC_ModelInitTables(model));
+    assert(0 == (model->pattern_directions[sideways] & ~((1 << left_index) | (1 << right_index))));
+
+    // in a periodic output one pixel wide, a pixel is its own left and right neighbour. Removing
+    // the first pattern then removes the second word's first pattern from the same pixel, which
+    // takes support from the pixels above and below even though the first pattern did not.
+    WFC_State state = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(&state, model, 1, 4));
+    assert(WFC_RESULT_OKAY == WFC_Ban(&state, 1, sideways));
+    assert(WFC_RESULT_CONTINUE == WFC_Propagate(&state));
+
+    assert(!WFC_BitmapGet(WFC_GetOutputBitmap(&state, (WFC_Pos){ 0, 1 }), second_word));
+    WFC_TestCheckSupports(&state);
+    WFC_TestCheckEntropies(&state);
+
+    WFC_StateDestroy(&state);
+    WFC_ModelRelease(model);
+}
+#endif
+
+#if defined(WFC_TEST)
+void WFC_TestCardinal(void) {
+    const char *path = "wfc_test_cardinal.bin";
+
+    WFC_Model *all = NULL;
+    WFC_Model *cardinal = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&all, 4, 4, gv_test_rings));
+    assert(WFC_RESULT_OKAY == WFC_ModelCreateWithAdjacency(&cardinal, 4, 4, gv_test_rings, WFC_ADJACENCY_CARDINAL));
+    assert(WFC_ADJACENCY_CARDINAL == cardinal->propagator.num_adjacent);
+    assert(WFC_RESULT_ERROR == WFC_ModelCreateWithAdjacency(&cardinal, 4, 4, gv_test_rings, (WFC_ADJACENCY_ENUM)6));
+
+    // each cardinal direction keeps the bitmaps of the same direction of the full index
+    const uint32_t num_patterns = cardinal->propagator.num_patterns;
+    const uint32_t bitmap_words = cardinal->propagator.bitmap_words;
+    for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
+        for (uint32_t adj_index = 0; adj_index < WFC_ADJACENCY_CARDINAL; adj_index++) {
+            assert(0 == memcmp(WFC_GetIndexBitmap(&cardinal->propagator, pat_index, adj_index),
+                               WFC_GetIndexBitmap(&all->propagator, pat_index, adj_index * 2 + 1),
+                               sizeof(uint64_t) * bitmap_words));
+        }
+    }
+    assert(WFC_ModelSize(cardinal) < WFC_ModelSize(all));
+    assert(WFC_StateSize(cardinal, 12, 8) < WFC_StateSize(all, 12, 8));
+
+    // and the adjacency is kept by a propagator file
+    WFC_Model *loaded = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelSave(cardinal, path));
+    assert(WFC_RESULT_OKAY == WFC_ModelLoad(&loaded, path));
+    assert(WFC_ADJACENCY_CARDINAL == loaded->propagator.num_adjacent);
+    assert(0 == memcmp(loaded->propagator.index,
+                       cardinal->propagator.index,
+                       sizeof(uint64_t) * WFC_INDEX_LENGTH_WORDS(num_patterns, WFC_ADJACENCY_CARDINAL)));
+    WFC_ModelRelease(loaded);
+    remove(path);
+
+    // a finished output overlaps its diagonal neighbours too, periodic or not
+    for (uint32_t periodic = 0; periodic < 2; periodic++) {
+        WFC_State state = {0};
+        WFC_RESULT_ENUM result = WFC_RESULT_RESTART;
+
+        for (uint32_t attempt = 1; (WFC_RESULT_RESTART == result) && (attempt < 100); attempt++) {
+            assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(&state, cardinal, 12, 8));
+            assert(WFC_RESULT_OKAY == WFC_StateSetPeriodic(&state, periodic));
+            assert(WFC_RESULT_OKAY == WFC_StateSetSeed(&state, attempt));
+
+            do {
+                result = WFC_Step(&state);
+
+                if (WFC_RESULT_CONTINUE == result) {
+                    WFC_TestCheckSupports(&state);
+                }
+            } while (WFC_RESULT_CONTINUE == result);
+
+            if (WFC_RESULT_RESTART == result) {
+                WFC_StateDestroy(&state);
+            }
+        }
+        assert(WFC_RESULT_FINISHED == result);
+
+        for (uint32_t y = 0; y < state.output_height; y++) {
+            for (uint32_t x = 0; x < state.output_width; x++) {
+                WFC_Pos pos = { x, y };
+                WFC_Tile tile = state.model->propagator.patterns[WFC_TestCollapsedPattern(&state, pos)].tile;
+
+                for (uint32_t adj_index = 0; adj_index < WFC_NUM_ADJACENT; adj_index++) {
+                    WFC_Pos adjacency = gv_adjacent_offsets[adj_index];
+                    int32_t other_x = x + adjacency.x;
+                    int32_t other_y = y + adjacency.y;
+                    if (!periodic && ((other_x < 0) || (other_y < 0) ||
+                                      (other_x >= (int32_t)state.output_width) ||
+                                      (other_y >= (int32_t)state.output_height))) {
+                        continue;
+                    }
+
+                    WFC_Pos other_pos = WFC_OffsetFrom(pos, adjacency, state.output_width, state.output_height);
+                    WFC_Tile other_tile =
+                        state.model->propagator.patterns[WFC_TestCollapsedPattern(&state, other_pos)].tile;
+
+                    assert(WFC_TilesOverlap(tile, other_tile, adjacency));
+                }
+            }
+        }
+
+        WFC_StateDestroy(&state);
+    }
+
+    WFC_ModelRelease(all);
+    WFC_ModelRelease(cardinal);
+}
+#endif
+
+#if defined(WFC_TEST)
+void WFC_TestQueue(void) {
+    // the ring wraps around, and is read from either end
+    uint32_t items[4];
+    WFC_Queue queue = { items, 0, 0, 4, WFC_QUEUE_ORDER_FIFO };
+
+    WFC_QueuePush(&queue, 1);
+    WFC_QueuePush(&queue, 2);
+    WFC_QueuePush(&queue, 3);
+    assert(1 == WFC_QueuePop(&queue));
+    assert(2 == WFC_QueuePop(&queue));
+    WFC_QueuePush(&queue, 4);
+    WFC_QueuePush(&queue, 5);
+    WFC_QueuePush(&queue, 6);
+    assert(4 == queue.num_items);
+    assert(3 == WFC_QueuePop(&queue));
+
+    queue.order = WFC_QUEUE_ORDER_LIFO;
+    assert(6 == WFC_QueuePop(&queue));
+    assert(5 == WFC_QueuePop(&queue));
+    WFC_QueuePush(&queue, 7);
+    assert(7 == WFC_QueuePop(&queue));
+    assert(4 == WFC_QueuePop(&queue));
+    assert(0 == queue.num_items);
+
+    WFC_Model *model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&model, 4, 4, gv_test_rings));
+
+    // every pattern of a periodic input allows something in each direction
+    for (uint32_t pat_index = 0; pat_index < model->propagator.num_patterns; pat_index++) {
+        assert(0xFF == model->pattern_directions[pat_index]);
+    }
+
+    // both orders solve consistently, keeping each pixel on the queue at most once
+    WFC_QUEUE_ORDER_ENUM orders[] = { WFC_QUEUE_ORDER_LIFO, WFC_QUEUE_ORDER_FIFO };
+    for (uint32_t order_index = 0; order_index < 2; order_index++) {
+        WFC_State state = {0};
+        assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(&state, model, 12, 12));
+        assert(WFC_QUEUE_ORDER_LIFO == state.queue.order);
+        assert(WFC_RESULT_OKAY == WFC_StateSetQueueOrder(&state, orders[order_index]));
+
+        WFC_RESULT_ENUM result;
+        do {
+            result = WFC_Step(&state);
+
+            if (WFC_RESULT_CONTINUE == result) {
+                assert(0 == state.queue.num_items);
+                for (uint32_t pix_index = 0; pix_index < 12 * 12; pix_index++) {
+                    assert(!WFC_BitmapGet(state.queued, pix_index));
+                    assert(0 == state.queued_directions[pix_index]);
+                }
+                WFC_TestCheckSupports(&state);
+                WFC_TestCheckEntropies(&state);
+            }
+        } while (WFC_RESULT_CONTINUE == result);
+
+        assert(WFC_RESULT_FINISHED == result);
+
+        uint8_t output[12 * 12];
+        assert(WFC_RESULT_OKAY == WFC_Output(&state, output));
+
+        WFC_StateDestroy(&state);
+    }
+
+    // the order can't change while removals are waiting to be propagated
+    WFC_State state = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(&state, model, 6, 6));
+    assert(WFC_RESULT_OKAY == WFC_Ban(&state, 2 + 3 * 6, 0));
+    assert(1 == state.queue.num_items);
+    assert(0xFF == state.queued_directions[2 + 3 * 6]);
+    assert(WFC_RESULT_ERROR == WFC_StateSetQueueOrder(&state, WFC_QUEUE_ORDER_FIFO));
+    assert(WFC_RESULT_CONTINUE == WFC_Propagate(&state));
+    assert(WFC_RESULT_OKAY == WFC_StateSetQueueOrder(&state, WFC_QUEUE_ORDER_FIFO));
+    WFC_StateDestroy(&state);
+
+    WFC_ModelRelease(model);
+}
+#endif
+
+#if defined(WFC_TEST)
+void WFC_TestObserve(void) {
+    // a noisy input with enough patterns to fill more than one bitmap word
+    uint8_t input[16 * 16];
+    uint32_t seed = WFC_TestNoise(input, sizeof(input), 9127, 8);
+
+    WFC_Model *model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&model, 16, 16, input));
+
+    const uint32_t num_patterns = model->propagator.num_patterns;
+    const uint32_t bitmap_words = model->propagator.bitmap_words;
+    assert(num_patterns > 2 * WFC_BITMAP_WORD_BITS);
+
+    WFC_State state = {0};
+    WFC_State reference = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(&state, model, 8, 8));
+    assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(&reference, model, 8, 8));
+    assert(WFC_RESULT_OKAY == WFC_EnableBacktracking(&state));
+    assert(WFC_RESULT_OKAY == WFC_EnableBacktracking(&reference));
+
+    // leave the first word of one pixel full and thin out the rest
+    const uint32_t pixel_index = 3 + 5 * 8;
+    for (uint32_t pat_index = WFC_BITMAP_WORD_BITS; pat_index < num_patterns; pat_index++) {
+        seed = WFC_XorShift(seed);
+        if ((seed % 3) == 0) {
+            assert(WFC_RESULT_OKAY == WFC_Ban(&state, pixel_index, pat_index));
+            assert(WFC_RESULT_OKAY == WFC_Ban(&reference, pixel_index, pat_index));
+        }
+    }
+
+    // every n lands on the same pattern as walking each valid pattern in order would
+    uint64_t *output_bitmap = &state.output[pixel_index * bitmap_words];
+    for (uint32_t n = 0; n < state.entropies[pixel_index].sum_weights; n++) {
+        uint32_t remaining = n;
+        uint32_t expected = WFC_BitmapNext(output_bitmap, bitmap_words, 0);
+        while (remaining >= model->propagator.patterns[expected].count) {
+            remaining -= model->propagator.patterns[expected].count;
+            expected = WFC_BitmapNext(output_bitmap, bitmap_words, expected + 1);
+        }
+
+        assert(expected == WFC_ChoosePattern(&state, pixel_index, n));
+    }
+
+    // collapsing a pixel leaves the state as banning each other pattern does
+    uint32_t chosen = WFC_ChoosePattern(&state, pixel_index, state.entropies[pixel_index].sum_weights / 2);
+    assert(WFC_RESULT_OKAY == WFC_Collapse(&state, pixel_index, chosen));
+    for (uint32_t pat_index = 0; pat_index < num_patterns; pat_index++) {
+        if (pat_index != chosen) {
+            assert(WFC_RESULT_OKAY == WFC_Ban(&reference, pixel_index, pat_index));
+        }
+    }
+
+    const size_t bitmaps_bytes = sizeof(uint64_t) * bitmap_words * 8 * 8;
+    assert(0 == memcmp(state.output, reference.output, bitmaps_bytes));
+    assert(0 == memcmp(state.removed, reference.removed, bitmaps_bytes));
+    assert(state.entropies[pixel_index].num_valid == 1);
+    assert(state.entropies[pixel_index].sum_weights == reference.entropies[pixel_index].sum_weights);
+    assert(state.heap.num_items == reference.heap.num_items);
+    assert(state.queue.num_items == reference.queue.num_items);
+    assert(state.queued_directions[pixel_index] == reference.queued_directions[pixel_index]);
+    assert(state.backtrack.trail_len == reference.backtrack.trail_len);
+    WFC_TestCheckEntropies(&state);
+
+    // propagating the collapse over padded bitmaps keeps the supports consistent
+    WFC_RESULT_ENUM propagated = WFC_Propagate(&state);
+    assert(propagated == WFC_Propagate(&reference));
+    assert(0 == memcmp(state.output, reference.output, bitmaps_bytes));
+    if (WFC_RESULT_CONTINUE == propagated) {
+        WFC_TestCheckSupports(&state);
+    }
+    WFC_TestCheckEntropies(&state);
+
+    // and undoing it restores the pixel
+    WFC_Undo(&state, 0);
+    WFC_Undo(&reference, 0);
+    assert(0 == memcmp(state.output, reference.output, bitmaps_bytes));
+    WFC_TestCheckEntropies(&state);
+
+    WFC_StateDestroy(&state);
+    WFC_StateDestroy(&reference);
+    WFC_ModelRelease(model);
+}
+#endif
+
+#if defined(WFC_TEST)
+void WFC_TestRandom(void) {
+    // values depend only on their key, not on which were drawn before them
+    uint32_t forward[64];
+    for (uint32_t counter = 0; counter < 64; counter++) {
+        forward[counter] = WFC_Random(5, 17, counter);
+    }
+    for (uint32_t counter = 64; counter > 0; counter--) {
+        assert(forward[counter - 1] == WFC_Random(5, 17, counter - 1));
+    }
+
+    // neighbouring seeds, streams and counters give unrelated values with balanced bits
+    uint32_t ones = 0;
+    for (uint32_t index = 0; index < 4096; index++) {
+        uint32_t value = WFC_Random(index % 4, (index / 4) % 32, index / 128);
+        ones += __builtin_popcount(value);
+
+        assert(value != WFC_Random(index % 4, (index / 4) % 32, index / 128 + 1));
+        assert(value != WFC_Random(index % 4, (index / 4) % 32 + 32, index / 128));
+        assert(value != WFC_Random(index % 4 + 4, (index / 4) % 32, index / 128));
+    }
+    assert((ones > 4096 * 15) && (ones < 4096 * 17));
+
+    WFC_Model *model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&model, 4, 4, gv_test_rings));
+
+    // a seed of 0 is as good as any other, and each pixel's tie break comes from its own stream
+    WFC_State states[2] = { {0}, {0} };
+    uint8_t outputs[2][10 * 10];
+    for (uint32_t state_index = 0; state_index < 2; state_index++) {
+        WFC_State *state = &states[state_index];
+        assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(state, model, 10, 10));
+        assert(WFC_RESULT_OKAY == WFC_StateSetSeed(state, 0));
+
+        for (uint32_t pix_index = 0; pix_index < 10 * 10; pix_index++) {
+            assert(WFC_Random(0, pix_index, WFC_RANDOM_TIE_BREAK) == state->entropies[pix_index].tie_break);
+        }
+        WFC_TestCheckEntropies(state);
+    }
+
+    // states with the same seed make the same choices, whichever steps first
+    WFC_RESULT_ENUM results[2] = { WFC_RESULT_CONTINUE, WFC_RESULT_CONTINUE };
+    while ((WFC_RESULT_CONTINUE == results[0]) || (WFC_RESULT_CONTINUE == results[1])) {
+        if (WFC_RESULT_CONTINUE == results[0]) {
+            results[0] = WFC_Step(&states[0]);
+        }
+
+        // the second state takes its steps in pairs
+        for (uint32_t step = 0; (step < 2) && (WFC_RESULT_CONTINUE == results[1]); step++) {
+            results[1] = WFC_Step(&states[1]);
+        }
+    }
+
+    assert(results[0] == results[1]);
+    assert(states[0].step_num == states[1].step_num);
+    if (WFC_RESULT_FINISHED == results[0]) {
+        assert(WFC_RESULT_OKAY == WFC_Output(&states[0], outputs[0]));
+        assert(WFC_RESULT_OKAY == WFC_Output(&states[1], outputs[1]));
+        assert(0 == memcmp(outputs[0], outputs[1], sizeof(outputs[0])));
+    }
+
+    WFC_StateDestroy(&states[0]);
+    WFC_StateDestroy(&states[1]);
+    WFC_ModelRelease(model);
+}
+#endif
+
+#if defined(WFC_TEST) && defined(WFC_STATS)
+void WFC_TestStats(void) {
+    WFC_Model *model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&model, 4, 4, gv_test_rings));
+    const uint32_t num_patterns = model->propagator.num_patterns;
+
+    WFC_Batch batch;
+    assert(WFC_RESULT_OKAY == WFC_BatchInit(&batch, model, 12, 12));
+    WFC_State *state = &batch.state;
+    const uint32_t num_pixels = 12 * 12;
+
+    WFC_RESULT_ENUM result;
+    do {
+        result = WFC_Step(state);
+    } while (WFC_RESULT_CONTINUE == result);
+
+    assert(WFC_RESULT_FINISHED == result);
+
+    // without backtracking every pixel lost all but one pattern, once each
+    assert(state->stats.steps == state->step_num);
+    assert(state->stats.propagations == state->step_num - 1);
+    assert(state->stats.bits_cleared == (uint64_t)num_pixels * (num_patterns - 1));
+    assert(state->stats.queue_pushes == state->stats.queue_pops);
+    assert((state->stats.queue_high_water > 0) && (state->stats.queue_high_water <= num_pixels));
+    assert(state->stats.index_lookups > 0);
+    assert(state->stats.contradictions == 0);
+    assert(state->stats.restarts == 0);
+    assert(state->stats.observe_cycles > 0);
+    assert(state->stats.propagate_cycles > 0);
+    assert(state->stats.backtrack_cycles == 0);
+
+    // a reset run starts counting again
+    assert(WFC_RESULT_OKAY == WFC_BatchReset(&batch, 3));
+    assert(state->stats.steps == 0);
+    assert(state->stats.bits_cleared == 0);
+    assert(state->stats.queue_high_water == 0);
+
+    WFC_BatchDestroy(&batch);
+    WFC_ModelRelease(model);
+
+    // a noisy input contradicts, and each contradiction is undone by backtracking
+    uint8_t noisy[5 * 5];
+    WFC_TestNoisyInput(noisy);
+
+    WFC_State noisy_state = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInit(&noisy_state, 5, 5, noisy, 12, 12));
+    assert(WFC_RESULT_OKAY == WFC_EnableBacktracking(&noisy_state));
+
+    do {
+        result = WFC_Step(&noisy_state);
+    } while (WFC_RESULT_CONTINUE == result);
+
+    assert(WFC_RESULT_FINISHED == result);
+    assert(noisy_state.backtrack.num_backtracks > 0);
+    // each choice undone was forced by at least one contradiction
+    assert(noisy_state.stats.contradictions >= noisy_state.backtrack.num_backtracks);
+    assert(noisy_state.stats.restarts == 0);
+    assert(noisy_state.stats.queue_pushes == noisy_state.stats.queue_pops);
+    assert(noisy_state.stats.backtrack_cycles > 0);
+
+    WFC_StateDestroy(&noisy_state);
+}
+#endif
+
+#if defined(WFC_TEST) && defined(WFC_TRACE)
+// count a trace's events with a name and phase, checking begin and end events nest
+static uint32_t WFC_TestTraceCount(const WFC_Trace *trace, const char *name, char phase) {
+    uint32_t count = 0;
+    int32_t depth = 0;
+
+    for (uint64_t event_index = 0; event_index < trace->num_events; event_index++) {
+        const WFC_TraceEvent *event = &trace->events[event_index];
+
+        if ('B' == event->phase) {
+            depth++;
+        } else if ('E' == event->phase) {
+            depth--;
+            assert(depth >= 0);
+        }
+
+        if ((0 == strcmp(name, event->name)) && (phase == event->phase)) {
+            count++;
+        }
+    }
+
+    assert(0 == depth);
+
+    return count;
+}
+
+void WFC_TestTrace(void) {
+    const uint32_t max_events = 4096;
+    WFC_TraceEvent *events = (WFC_TraceEvent*)malloc(sizeof(WFC_TraceEvent) * max_events);
+
+    WFC_Trace trace;
+    assert(WFC_RESULT_OKAY == WFC_TraceStart(&trace, events, max_events));
+
+    WFC_State state = {0};
+    assert(WFC_RESULT_OKAY == WFC_StateInit(&state, 4, 4, gv_test_rings, 8, 8));
+
+    WFC_RESULT_ENUM result;
+    do {
+        result = WFC_Step(&state);
+    } while (WFC_RESULT_CONTINUE == result);
+    assert(WFC_RESULT_FINISHED == result);
+
+    WFC_TraceStop();
+
+    // nothing is recorded once the trace is stopped
+    uint64_t num_events = trace.num_events;
+    assert(WFC_RESULT_FINISHED == WFC_Step(&state));
+    assert(num_events == trace.num_events);
+    assert(num_events < max_events);
+
+    assert(1 == WFC_TestTraceCount(&trace, "model_create", 'B'));
+    assert(1 == WFC_TestTraceCount(&trace, "find_patterns", 'E'));
+    assert(1 == WFC_TestTraceCount(&trace, "index_init", 'E'));
+    assert(1 == WFC_TestTraceCount(&trace, "state_init", 'B'));
+    assert(1 == WFC_TestTraceCount(&trace, "supports", 'E'));
+    assert(state.step_num - 1 == WFC_TestTraceCount(&trace, "step", 'B'));
+    assert(state.step_num - 1 == WFC_TestTraceCount(&trace, "observe", 'E'));
+    assert(state.step_num - 2 == WFC_TestTraceCount(&trace, "propagate", 'B'));
+    assert(0 == WFC_TestTraceCount(&trace, "contradiction", 'i'));
+
+    // events are in time order, and steps carry their number
+    for (uint64_t event_index = 1; event_index < num_events; event_index++) {
+        assert(events[event_index - 1].time_ns <= events[event_index].time_ns);
+    }
+    assert(0 == strcmp("model_create", events[0].name));
+    for (uint64_t event_index = 0; event_index < num_events; event_index++) {
+        if ((0 == strcmp("step", events[event_index].name)) && ('B' == events[event_index].phase)) {
+            assert(0 == strcmp("step", events[event_index].arg_name));
+            assert(0 == events[event_index].arg);
+            break;
+        }
+    }
+
+    const char *path = "wfc_test_trace.json";
+    assert(WFC_RESULT_OKAY == WFC_TraceSave(&trace, path));
+
+    FILE *file = fopen(path, "r");
+    assert(NULL != file);
+    char header[16] = {0};
+    assert(1 == fread(header, 15, 1, file));
+    assert(0 == strcmp(header, "{\"traceEvents\":"));
+    fclose(file);
+    remove(path);
+
+    WFC_StateDestroy(&state);
+
+    // a backtracking run records its contradictions, and a small buffer keeps the latest events
+    uint8_t noisy[5 * 5];
+    WFC_TestNoisyInput(noisy);
+
+    assert(WFC_RESULT_OKAY == WFC_TraceStart(&trace, events, 16));
+    assert(WFC_RESULT_OKAY == WFC_StateInit(&state, 5, 5, noisy, 12, 12));
+    assert(WFC_RESULT_OKAY == WFC_EnableBacktracking(&state));
+
+    uint32_t num_contradictions = 0;
+    do {
+        uint64_t first_event = trace.num_events;
+        result = WFC_Step(&state);
+
+        for (uint64_t event_index = first_event; event_index < trace.num_events; event_index++) {
+            if ('i' == events[event_index % 16].phase) {
+                num_contradictions++;
+            }
+        }
+    } while (WFC_RESULT_CONTINUE == result);
+
+    WFC_TraceStop();
+
+    assert(WFC_RESULT_FINISHED == result);
+    assert(num_contradictions > 0);
+    assert(trace.num_events > 16);
+    assert(WFC_RESULT_OKAY == WFC_TraceSave(&trace, path));
+    remove(path);
+
+    WFC_StateDestroy(&state);
+    free(events);
+}
+
+// record events whose fields all follow from their argument, so a torn one shows
+static int WFC_TestTraceWriter(void *user) {
+    static const char *names[] = { "even", "odd" };
+    static const char *arg_names[] = { "even_arg", "odd_arg" };
+    (void)user;
+
+    for (uint32_t event_index = 0; event_index < 20000; event_index++) {
+        WFC_TraceEmit(names[event_index % 2], (0 == event_index % 2) ? 'B' : 'E', arg_names[event_index % 2], event_index);
+    }
+
+    return 0;
+}
+
+void WFC_TestTraceThreads(void) {
+    const uint32_t max_events = 64;
+    WFC_TraceEvent *events = (WFC_TraceEvent*)malloc(sizeof(WFC_TraceEvent) * max_events);
+
+    WFC_Trace trace;
+    assert(WFC_RESULT_OKAY == WFC_TraceStart(&trace, events, max_events));
+
+    // a small buffer wraps many times while it is read
+    thrd_t threads[4];
+    for (uint32_t thread_index = 0; thread_index < 4; thread_index++) {
+        assert(thrd_success == thrd_create(&threads[thread_index], WFC_TestTraceWriter, NULL));
+    }
+
+    // read at least once, even if the writers have already finished
+    uint32_t num_read = 0;
+    uint64_t num_events = 0;
+    do {
+        num_events = atomic_load(&trace.num_events);
+        uint64_t first_event = (num_events > max_events) ? num_events - max_events : 0;
+
+        for (uint64_t event_index = first_event; event_index < num_events; event_index++) {
+            WFC_TraceEvent event;
+            if (WFC_TraceRead(&trace, event_index, &event)) {
+                uint32_t parity = event.arg % 2;
+                assert(0 == strcmp((0 == parity) ? "even" : "odd", event.name));
+                assert(0 == strcmp((0 == parity) ? "even_arg" : "odd_arg", event.arg_name));
+                assert(((0 == parity) ? 'B' : 'E') == event.phase);
+                num_read++;
+            }
+        }
+    } while (num_events < 4 * 20000);
+
+    for (uint32_t thread_index = 0; thread_index < 4; thread_index++) {
+        assert(thrd_success == thrd_join(threads[thread_index], NULL));
+    }
+    WFC_TraceStop();
+
+    // once recording stops, every slot holds an event which can be read
+    assert(num_read > 0);
+    for (uint32_t event_index = 0; event_index < max_events; event_index++) {
+        uint64_t sequence = atomic_load(&events[event_index].sequence);
+        assert((0 != sequence) && (0 == (sequence & 1)));
+
+        WFC_TraceEvent event;
+        assert(WFC_TraceRead(&trace, sequence / 2 - 1, &event));
+    }
+
+    const char *path = "wfc_test_trace_threads.json";
+    assert(WFC_RESULT_OKAY == WFC_TraceSave(&trace, path));
+    remove(path);
+
+    free(events);
+}
+#endif
+
+#if defined(WFC_TEST)
+// run a state seeded like an attempt of a race to the end
+WFC_RESULT_ENUM WFC_TestRunAttempt(WFC_Model *model, WFC_State *state, uint32_t seed, uint32_t attempt) {
+    assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(state, model, 12, 12));
+    assert(WFC_RESULT_OKAY == WFC_StateSetSeed(state, WFC_RaceSeed(seed, attempt)));
+
+    WFC_RESULT_ENUM result = WFC_RESULT_CONTINUE;
+    while (WFC_RESULT_CONTINUE == result) {
+        result = WFC_Step(state);
+    }
+
+    return result;
+}
+
+void WFC_TestBatch(void) {
+    WFC_Model *model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&model, 4, 4, gv_test_rings));
+
+    const uint32_t num_outputs = 5;
+    uint8_t outputs[5 * 12 * 12];
+    WFC_RESULT_ENUM results[5];
+    assert(WFC_RESULT_OKAY == WFC_GenerateBatch(model, 12, 12, 3, num_outputs, outputs, results));
+
+    // each image matches one generated by a newly initialized state
+    for (uint32_t output_index = 0; output_index < num_outputs; output_index++) {
+        assert(WFC_RESULT_FINISHED == results[output_index]);
+
+        WFC_State state = {0};
+        assert(WFC_RESULT_OKAY == WFC_StateInitFromModel(&state, model, 12, 12));
+        assert(WFC_RESULT_OKAY == WFC_StateSetSeed(&state, WFC_RaceSeed(3, output_index)));
+
+        while (WFC_RESULT_CONTINUE == WFC_Step(&state)) {
+        }
+
+        uint8_t output[12 * 12];
+        assert(WFC_RESULT_OKAY == WFC_Output(&state, output));
+        assert(memcmp(output, &outputs[output_index * 12 * 12], sizeof(output)) == 0);
+
+        WFC_StateDestroy(&state);
+    }
+
+    WFC_ModelRelease(model);
+
+    // images of a noisy input which contradict are retried with their later seeds
+    uint8_t noisy[5 * 5];
+    WFC_TestNoisyInput(noisy);
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&model, 5, 5, noisy));
+
+    uint8_t noisy_outputs[8 * 12 * 12];
+    WFC_RESULT_ENUM noisy_results[8];
+    assert(WFC_RESULT_OKAY == WFC_GenerateBatch(model, 12, 12, 99, 8, noisy_outputs, noisy_results));
+
+    uint32_t num_retried = 0;
+    for (uint32_t output_index = 0; output_index < 8; output_index++) {
+        assert(WFC_RESULT_FINISHED == noisy_results[output_index]);
+
+        // the image is the first of its attempts that finishes
+        WFC_RESULT_ENUM result = WFC_RESULT_RESTART;
+        for (uint32_t attempt = 0; WFC_RESULT_RESTART == result; attempt++) {
+            assert(attempt < WFC_BATCH_MAX_ATTEMPTS);
+
+            WFC_State state = {0};
+            result = WFC_TestRunAttempt(model, &state, 99, output_index + attempt * 8);
+            if (WFC_RESULT_FINISHED == result) {
+                uint8_t output[12 * 12];
+                assert(WFC_RESULT_OKAY == WFC_Output(&state, output));
+                assert(memcmp(output, &noisy_outputs[output_index * 12 * 12], sizeof(output)) == 0);
+            } else {
+                num_retried += (0 == attempt) ? 1 : 0;
+            }
+            WFC_StateDestroy(&state);
+        }
+    }
+    assert(num_retried > 0);
+
+    // a reset clears the backtracking state along with the buffers
+    WFC_Batch batch;
+    assert(WFC_RESULT_OKAY == WFC_BatchInit(&batch, model, 12, 12));
+    assert(WFC_RESULT_OKAY == WFC_EnableBacktracking(&batch.state));
+
+    uint8_t first[12 * 12];
+    uint8_t second[12 * 12];
+    for (uint32_t run = 0; run < 2; run++) {
+        assert(WFC_RESULT_OKAY == WFC_BatchReset(&batch, 17));
+        assert(0 == batch.state.backtrack.trail_len);
+
+        while (WFC_RESULT_CONTINUE == WFC_Step(&batch.state)) {
+        }
+        assert(WFC_RESULT_OKAY == WFC_Output(&batch.state, (0 == run) ? first : second));
+    }
+    assert(memcmp(first, second, sizeof(first)) == 0);
+
+    WFC_BatchDestroy(&batch);
+    WFC_ModelRelease(model);
+}
+#endif
+
+#if defined(WFC_TEST)
+void WFC_TestRace(void) {
+    // a noisy input where many seeds hit a contradiction
+    uint8_t input[5 * 5];
+    WFC_TestNoisyInput(input);
+
+    WFC_Model *model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&model, 5, 5, input));
+
+    WFC_RaceOptions options = {0};
+    options.num_attempts = 16;
+    options.num_threads = 4;
+    options.seed = 99;
+    options.policy = WFC_RACE_POLICY_LOWEST;
+
+    WFC_State winner = {0};
+    uint32_t winner_attempt = 0;
+    assert(WFC_RESULT_OKAY == WFC_Race(model, 12, 12, &options, &winner, &winner_attempt));
+    assert(winner.model == model);
+
+    // several attempts fail before one finishes with this seed
+    assert(winner_attempt > 0);
+
+    // the winner is the first attempt that finishes when run one at a time
+    for (uint32_t attempt = 0; attempt <= winner_attempt; attempt++) {
+        WFC_State state = {0};
+        WFC_RESULT_ENUM result = WFC_TestRunAttempt(model, &state, options.seed, attempt);
+
+        if (attempt < winner_attempt) {
+            assert(WFC_RESULT_RESTART == result);
+        } else {
+            assert(WFC_RESULT_FINISHED == result);
+            assert(memcmp(state.output,
+                          winner.output,
+                          sizeof(uint64_t) * model->propagator.bitmap_words * 12 * 12) == 0);
+        }
+
+        WFC_StateDestroy(&state);
+    }
+
+    // the same winner is found with one thread
+    WFC_State single = {0};
+    uint32_t single_attempt = 0;
+    options.num_threads = 1;
+    assert(WFC_RESULT_OKAY == WFC_Race(model, 12, 12, &options, &single, &single_attempt));
+    assert(single_attempt == winner_attempt);
+    WFC_StateDestroy(&single);
+    WFC_StateDestroy(&winner);
+
+    // any attempt may win the first finished policy, but it must have finished
+    options.num_threads = 4;
+    options.policy = WFC_RACE_POLICY_FIRST;
+    options.backtracking = true;
+    assert(WFC_RESULT_OKAY == WFC_Race(model, 12, 12, &options, &winner, &winner_attempt));
+    assert(winner_attempt < options.num_attempts);
+
+    uint8_t output[12 * 12];
+    assert(WFC_RESULT_OKAY == WFC_Output(&winner, output));
+    WFC_StateDestroy(&winner);
+
+    // states share the model, so only the caller's reference is left
+    assert(1 == atomic_load(&model->ref_count));
+    WFC_ModelRelease(model);
+}
+#endif
+
+#if defined(WFC_TEST)
+typedef struct WFC_TestWorld {
+    uint32_t width;
+    uint8_t *pixels;
+    uint32_t num_chunks;
+} WFC_TestWorld;
+
+WFC_RESULT_ENUM WFC_TestWorldSink(void *user,
+                                  uint32_t chunk_x,
+                                  uint32_t chunk_y,
+                                  uint32_t width,
+                                  uint32_t height,
+                                  const uint8_t *pixels) {
+    WFC_TestWorld *world = (WFC_TestWorld*)user;
+
+    // chunks arrive one at a time, in row order
+    assert(chunk_y * (world->width / width) + chunk_x == world->num_chunks);
+
+    for (uint32_t y = 0; y < height; y++) {
+        memcpy(&world->pixels[chunk_x * width + (chunk_y * height + y) * world->width], &pixels[y * width], width);
+    }
+    world->num_chunks++;
+
+    return WFC_RESULT_OKAY;
+}
+
+void WFC_TestChunks(void) {
+    WFC_Model *model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&model, 4, 4, gv_test_rings));
+
+    WFC_ChunkOptions options = {0};
+    options.chunk_width = 6;
+    options.chunk_height = 5;
+    options.num_chunks_x = 3;
+    options.num_chunks_y = 3;
+    options.lookahead = 2;
+    options.max_attempts = 8;
+    options.seed = 11;
+
+    const uint32_t world_width = 6 * 3;
+    const uint32_t world_height = 5 * 3;
+    uint8_t world_pixels[6 * 3 * 5 * 3];
+    WFC_TestWorld world = { world_width, world_pixels, 0 };
+    assert(WFC_RESULT_OKAY == WFC_GenerateChunks(model, &options, WFC_TestWorldSink, &world));
+    assert(9 == world.num_chunks);
+
+    // every NxN block of the world, including across seams, is one of the input's patterns
+    for (uint32_t y = 0; y + WFC_N - 1 < world_height; y++) {
+        for (uint32_t x = 0; x + WFC_N - 1 < world_width; x++) {
+            WFC_Pos pos = { x, y };
+            WFC_Tile tile = WFC_TileAt(pos, world_width, world_height, world_pixels);
+
+            bool found = false;
+            for (uint32_t pat_index = 0; pat_index < model->propagator.num_patterns; pat_index++) {
+                found = found || (tile == model->propagator.patterns[pat_index].tile);
+            }
+            assert(found);
+        }
+    }
+
+    // the world is the same whatever the number of threads solving it, including
+    // when rows fail and have to be solved again
+    uint8_t noisy_input[5 * 5];
+    WFC_TestNoisyInput(noisy_input);
+    WFC_Model *noisy_model = NULL;
+    assert(WFC_RESULT_OKAY == WFC_ModelCreate(&noisy_model, 5, 5, noisy_input));
+
+    WFC_Model *thread_models[2] = { model, noisy_model };
+    for (uint32_t model_index = 0; model_index < 2; model_index++) {
+        WFC_ChunkOptions threaded = options;
+        threaded.num_chunks_y = 6;
+        threaded.lookahead = 1;
+
+        uint8_t single_pixels[6 * 3 * 5 * 6];
+        WFC_TestWorld single = { world_width, single_pixels, 0 };
+        memset(single_pixels, 0, sizeof(single_pixels));
+        threaded.num_threads = 1;
+        WFC_RESULT_ENUM single_result = WFC_GenerateChunks(thread_models[model_index], &threaded, WFC_TestWorldSink, &single);
+        assert(WFC_RESULT_ERROR != single_result);
+
+        for (uint32_t num_threads = 2; num_threads <= 4; num_threads += 2) {
+            uint8_t threaded_pixels[6 * 3 * 5 * 6];
+            WFC_TestWorld threaded_world = { world_width, threaded_pixels, 0 };
+            memset(threaded_pixels, 0, sizeof(threaded_pixels));
+            threaded.num_threads = num_threads;
+            assert(single_result == WFC_GenerateChunks(thread_models[model_index], &threaded, WFC_TestWorldSink, &threaded_world));
+            assert(single.num_chunks == threaded_world.num_chunks);
+            assert(memcmp(single_pixels, threaded_pixels, sizeof(single_pixels)) == 0);
+        }
+    }
+    WFC_ModelRelease(noisy_model);
+
+    // the file sink writes each chunk after its position and size
+    FILE *file = tmpfile();
+    assert(NULL != file);
+    assert(WFC_RESULT_OKAY == WFC_GenerateChunks(model, &options, WFC_ChunkSinkFile, file));
+    assert(ftell(file) == (long)(9 * (sizeof(uint32_t) * 4 + 6 * 5)));
+
+    // as does a chunk whose size overflows, before writing anything
+    assert(WFC_RESULT_ERROR == WFC_ChunkSinkFile(file, 0, 0, 0x10000, 0x10000, world_pixels));
+    assert(ftell(file) == (long)(9 * (sizeof(uint32_t) * 4 + 6 * 5)));
+    fclose(file);
+
+    // a world, a chunk, or a margin too large to index is rejected before anything is solved
+    WFC_ChunkOptions oversized = options;
+    oversized.chunk_width = 0x10000;
+    oversized.num_chunks_x = 0x10000;
+    assert(WFC_RESULT_ERROR == WFC_GenerateChunks(model, &oversized, WFC_TestWorldSink, &world));
+
+    oversized = options;
+    oversized.lookahead = UINT32_MAX;
+    assert(WFC_RESULT_ERROR == WFC_GenerateChunks(model, &oversized, WFC_TestWorldSink, &world));
+
+    oversized = options;
+    oversized.chunk_width = 0x10000;
+    oversized.chunk_height = 0x10000;
+    oversized.num_chunks_x = 1;
+    assert(WFC_RESULT_ERROR == WFC_GenerateChunks(model, &oversized, WFC_TestWorldSink, &world));
+    assert(9 == world.num_chunks);
+
+    uint32_t unused_patterns[1];
+    assert(WFC_RESULT_ERROR == WFC_ChunkSolve(model, 4, 4, NULL, NULL, UINT32_MAX, 5, unused_patterns));
+
+    // a chunk's margin is held to the given patterns
+    uint32_t top[4 + 1 + 1];
+    uint32_t patterns[(4 + 1) * (4 + 1)];
+    for (uint32_t x = 0; x < 4 + 1 + 1; x++) {
+        top[x] = WFC_PATTERN_NONE;
+    }
+    top[2] = 3;
+    assert(WFC_RESULT_OKAY == WFC_ChunkSolve(model, 4, 4, top, NULL, 1, 5, patterns));
+    assert(WFC_TilesOverlap(model->propagator.patterns[3].tile,
+                            model->propagator.patterns[patterns[1]].tile,
+                            gv_adjacent_offsets[WFC_ADJACENT_DOWN]));
+
+    WFC_ModelRelease(model);
+}
+#endif
+
+// SplitMix64's finalizer, a bijection which spreads each input bit over the output
+static uint64_t WFC_Mix64(uint64_t value) {
+    value += 0x9E3779B97F4A7C15ULL;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+uint32_t WFC_Random(uint32_t seed, uint32_t stream, uint32_t counter) {
+    uint64_t key = WFC_Mix64(((uint64_t)seed << 32) | stream);
+
+    return (uint32_t)(WFC_Mix64(key ^ counter) >> 32);
+}
+
+#if defined(WFC_TEST)
+uint32_t WFC_XorShift(uint32_t seed)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+void WFC_Test(void) {
+    WFC_TestOffsetFrom();
+    WFC_TestNeighbours();
+    WFC_TestBitmapKernels();
+    WFC_TestBitmapDispatch();
+    WFC_TestTileOverlap();
+    WFC_TestFindPatterns();
+    WFC_TestIndexInit();
+    WFC_TestPropagate();
+    WFC_TestCardinal();
+    WFC_TestThinOutputs();
+    WFC_TestEntropyHeap();
+    WFC_TestPropagatorFile();
+    WFC_TestSharedModel();
+    WFC_TestArena();
+    WFC_TestQueue();
+    WFC_TestObserve();
+    WFC_TestRandom();
+#if defined(WFC_TRACE)
+    WFC_TestTraceThreads();
+#endif
+    WFC_TestBatch();
+    WFC_TestBacktracking();
+#if defined(WFC_STATS)
+    WFC_TestStats();
+#endif
+#if defined(WFC_TRACE)
+    WFC_TestTrace();
+#endif
+    WFC_TestRace();
+    WFC_TestChunks();
+}
+#endif
+
+#if defined(WFC_TEST_MAIN)
+int main(int argc, char *argv[]) {
+    WFC_Test();
+
+    printf("All Tests Passed!\n");
+
+    return 0;
+}
+#endif